@@ -22,13 +22,63 @@
  * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
  * THE SOFTWARE.
  */
+#ifdef __linux__
+#define _GNU_SOURCE // for memfd_create
+#endif
+
 #include "pipe.h"
 
 #include <assert.h>
+#include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+// Mirrored buffers need a file descriptor that can be mapped more than once.
+#ifdef MFD_CLOEXEC
+#define HAVE_MIRRORING 1
+#else
+#define HAVE_MIRRORING 0
+#endif
+
+// pipe_page_allocator maps its blocks straight from the kernel where it can, and
+// can bind them to a NUMA node if the kernel knows about those.
+#if defined(__linux__) && defined(MAP_ANONYMOUS)
+#define HAVE_PAGE_ALLOCATOR 1
+#else
+#define HAVE_PAGE_ALLOCATOR 0
+#endif
+
+#if HAVE_PAGE_ALLOCATOR && defined(SYS_mbind) && defined(SYS_getcpu)
+#define HAVE_MBIND 1
+#else
+#define HAVE_MBIND 0
+#endif
+
+// pipe_consumer_fd and pipe_producer_fd hand out eventfds.
+#ifdef EFD_CLOEXEC
+#define HAVE_EVENTFD 1
+#else
+#define HAVE_EVENTFD 0
+#endif
+
+// Eventcounts sleep directly on a futex where there is one.
+#ifdef SYS_futex
+#define HAVE_FUTEX 1
+#else
+#define HAVE_FUTEX 0
+#endif
 
 // Vanity bytes. As long as this isn't removed from the executable, I don't
 // mind if I don't get credits in a README or any other documentation. Consider
@@ -81,6 +131,44 @@ const char _pipe_copyright[] =
 
 #include <windows.h>
 
+// Windows has no CLOCK_MONOTONIC, so deadlines are measured against the
+// performance counter instead. Returns how many milliseconds are left until
+// `deadline', rounded up so that we never wake up early.
+static DWORD ms_until(const struct timespec* deadline)
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+
+    double left = (double)deadline->tv_sec
+                + (double)deadline->tv_nsec / 1e9
+                - (double)now.QuadPart / (double)freq.QuadPart;
+
+    if(left <= 0)
+        return 0;
+
+    return left >= (INFINITE - 1) / 1000.0 ? INFINITE - 1
+                                           : (DWORD)(left * 1000.0) + 1;
+}
+
+static inline bool deadline_passed(const struct timespec* deadline)
+{
+    return ms_until(deadline) == 0;
+}
+
+// Milliseconds on the performance counter, for timing things that have no
+// deadline.
+static uint64_t now_ms(void)
+{
+    LARGE_INTEGER now, freq;
+    QueryPerformanceCounter(&now);
+    QueryPerformanceFrequency(&freq);
+
+    return (uint64_t)((double)now.QuadPart * 1000.0 / (double)freq.QuadPart);
+}
+
+#define thread_yield() SwitchToThread()
+
 // On vista+, we have native condition variables and fast locks. Yay.
 #if defined(_WIN32_WINNT) && _WIN32_WINNT >= 0x0600
 
@@ -89,6 +177,7 @@ const char _pipe_copyright[] =
 #define mutex_init          InitializeSRWLock
 #define mutex_lock          AcquireSRWLockExclusive
 #define mutex_unlock        ReleaseSRWLockExclusive
+#define mutex_trylock(m)    (TryAcquireSRWLockExclusive(m) != 0) // win7+
 #define mutex_destroy(m)
 
 #define cond_t              CONDITION_VARIABLE
@@ -97,6 +186,9 @@ const char _pipe_copyright[] =
 #define cond_signal         WakeConditionVariable
 #define cond_broadcast      WakeAllConditionVariable
 #define cond_wait(c, m)     SleepConditionVariableSRW((c), (m), INFINITE, 0)
+#define cond_timedwait(c, m, deadline)                                      \
+    (SleepConditionVariableSRW((c), (m), ms_until(deadline), 0)            \
+     || GetLastError() != ERROR_TIMEOUT)
 #define cond_destroy(c)
 
 // Oh god. Microsoft has slow locks and lacks native condition variables on
@@ -108,6 +200,7 @@ const char _pipe_copyright[] =
 #define mutex_init(m)   InitializeCriticalSectionAndSpinCount((m), MUTEX_SPINS)
 #define mutex_lock      EnterCriticalSection
 #define mutex_unlock    LeaveCriticalSection
+#define mutex_trylock(m) (TryEnterCriticalSection(m) != 0)
 #define mutex_destroy   DeleteCriticalSection
 
 // This Condition variable implementation is stolen from:
@@ -167,7 +260,9 @@ static void cond_broadcast(cond_t* c)
     LeaveCriticalSection(&c->waiters_count_lock);
 }
 
-static void cond_wait(cond_t* c, mutex_t* m)
+// Returns false if `deadline' passed before we were released. A NULL
+// deadline never passes.
+static bool cond_timedwait(cond_t* c, mutex_t* m, const struct timespec* deadline)
 {
     EnterCriticalSection(&c->waiters_count_lock);
 
@@ -178,11 +273,14 @@ static void cond_wait(cond_t* c, mutex_t* m)
     LeaveCriticalSection(&c->waiters_count_lock);
     mutex_unlock(m);
 
-    bool wait_done;
+    bool wait_done,
+         timed_out;
 
     do
     {
-        WaitForSingleObject(c->event, INFINITE);
+        timed_out = WaitForSingleObject(c->event,
+                        deadline ? ms_until(deadline) : INFINITE)
+                 == WAIT_TIMEOUT;
 
         EnterCriticalSection(&c->waiters_count_lock);
         int release_count = c->release_count;
@@ -192,16 +290,29 @@ static void cond_wait(cond_t* c, mutex_t* m)
         wait_done = release_count > 0
                  && wait_generation_count != my_generation;
     }
-    while(!wait_done);
+    while(!wait_done && !timed_out);
 
     mutex_lock(m);
     EnterCriticalSection(&c->waiters_count_lock);
     c->waiters_count--;
-    int release_count = --c->release_count;
+
+    // We may have been released right as we timed out. If so, we have to
+    // count ourselves out of the release like everybody else.
+    wait_done = c->release_count > 0
+             && c->wait_generation_count != my_generation;
+
+    int release_count = wait_done ? --c->release_count : -1;
     LeaveCriticalSection(&c->waiters_count_lock);
 
     if(release_count == 0) // we're the last waiter
         ResetEvent(c->event);
+
+    return wait_done;
+}
+
+static void cond_wait(cond_t* c, mutex_t* m)
+{
+    cond_timedwait(c, m, NULL);
 }
 
 static void cond_destroy(cond_t* c)
@@ -215,7 +326,9 @@ static void cond_destroy(cond_t* c)
 // Fall back on pthreads if we haven't special-cased the current OS.
 #else /* windows */
 
+#include <errno.h>
 #include <pthread.h>
+#include <sched.h>
 
 #define mutex_t pthread_mutex_t
 #define cond_t  pthread_cond_t
@@ -224,18 +337,333 @@ static void cond_destroy(cond_t* c)
 
 #define mutex_lock     pthread_mutex_lock
 #define mutex_unlock   pthread_mutex_unlock
+#define mutex_trylock(m) (pthread_mutex_trylock(m) == 0)
 #define mutex_destroy  pthread_mutex_destroy
 
-#define cond_init(c)   pthread_cond_init((c), NULL)
 #define cond_signal    pthread_cond_signal
 #define cond_broadcast pthread_cond_broadcast
 #define cond_wait      pthread_cond_wait
 #define cond_destroy   pthread_cond_destroy
 
+#define cond_timedwait(c, m, deadline) \
+    (pthread_cond_timedwait((c), (m), (deadline)) != ETIMEDOUT)
+
+// Deadlines are against CLOCK_MONOTONIC, so that they aren't thrown off when
+// somebody sets the system clock.
+static inline void cond_init(cond_t* c)
+{
+    pthread_condattr_t attr;
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(c, &attr);
+    pthread_condattr_destroy(&attr);
+}
+
+static inline bool deadline_passed(const struct timespec* deadline)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return now.tv_sec > deadline->tv_sec
+       || (now.tv_sec == deadline->tv_sec && now.tv_nsec >= deadline->tv_nsec);
+}
+
+// Milliseconds on CLOCK_MONOTONIC, for timing things that have no deadline.
+static inline uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+#define thread_yield() sched_yield()
+
 #endif /* windows */
 
+// Waits on `c' until `deadline', or forever if `deadline' is NULL. Returns false
+// if the deadline passed first.
+static inline bool cond_wait_until(cond_t* c,
+                                   mutex_t* m,
+                                   const struct timespec* deadline)
+{
+    if(!deadline)
+    {
+        cond_wait(c, m);
+        return true;
+    }
+
+    return cond_timedwait(c, m, deadline);
+}
+
 // End threading.
 
+// Atomics. The lock-free paths only need loads, stores, a full fence and a
+// couple of read-modify-writes, so we wrap whatever the compiler offers instead
+// of depending on C11's stdatomic.h.
+
+#if defined(__GNUC__)
+
+#define load_relaxed(ptr)       __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define load_acquire(ptr)       __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define store_relaxed(ptr, v)   __atomic_store_n((ptr), (v), __ATOMIC_RELAXED)
+#define store_release(ptr, v)   __atomic_store_n((ptr), (v), __ATOMIC_RELEASE)
+#define fetch_add(ptr, v)       __atomic_fetch_add((ptr), (v), __ATOMIC_SEQ_CST)
+#define fetch_sub(ptr, v)       __atomic_fetch_sub((ptr), (v), __ATOMIC_SEQ_CST)
+#define full_fence()            __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define exchange_ptr(ptr, v)    __atomic_exchange_n((ptr), (v), __ATOMIC_ACQ_REL)
+
+// On failure, `*expected' is updated with the current value.
+#define compare_and_swap(ptr, expected, desired)                   \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), true, \
+                                __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+
+#elif defined(_MSC_VER)
+
+// MSVC's C compiler has no __typeof__, so the loads and stores pick a typed
+// helper with _Generic instead. Everything we touch atomically is an int, an
+// unsigned, a size_t or a pointer. On 32-bit windows, size_t is unsigned.
+#if !defined(__STDC_VERSION__) || __STDC_VERSION__ < 201112L
+#error "pipe.c needs /std:c11 or later on MSVC, for _Generic."
+#endif
+
+#define ATOMIC_HELPERS(T, suffix, cast, read_nf, read_acq, write_nf, write_rel) \
+    static inline T load_relaxed_##suffix(const volatile void* ptr)            \
+    { return (T)read_nf((const cast volatile*)ptr); }                           \
+    static inline T load_acquire_##suffix(const volatile void* ptr)            \
+    { return (T)read_acq((const cast volatile*)ptr); }                          \
+    static inline void store_relaxed_##suffix(volatile void* ptr, T v)         \
+    { write_nf((cast volatile*)ptr, (cast)v); }                                 \
+    static inline void store_release_##suffix(volatile void* ptr, T v)         \
+    { write_rel((cast volatile*)ptr, (cast)v); }
+
+ATOMIC_HELPERS(int,      int,  LONG, ReadNoFence, ReadAcquire,
+                                     WriteNoFence, WriteRelease)
+ATOMIC_HELPERS(unsigned, uint, LONG, ReadNoFence, ReadAcquire,
+                                     WriteNoFence, WriteRelease)
+ATOMIC_HELPERS(void*,    ptr,  PVOID, ReadPointerNoFence, ReadPointerAcquire,
+                                      WritePointerNoFence, WritePointerRelease)
+#ifdef _WIN64
+ATOMIC_HELPERS(size_t,   size, LONG64, ReadNoFence64, ReadAcquire64,
+                                       WriteNoFence64, WriteRelease64)
+#define ATOMIC_SIZE_T(op) size_t: op##_size,
+#else
+#define ATOMIC_SIZE_T(op)
+#endif
+
+#undef ATOMIC_HELPERS
+
+// Anything that isn't an integer we know about is a pointer.
+#define atomic_typed(op, ptr) _Generic(*(ptr), \
+        int:      op##_int,                    \
+        unsigned: op##_uint,                   \
+        ATOMIC_SIZE_T(op)                      \
+        default:  op##_ptr)
+
+#define load_relaxed(ptr)       atomic_typed(load_relaxed, ptr)((ptr))
+#define load_acquire(ptr)       atomic_typed(load_acquire, ptr)((ptr))
+#define store_relaxed(ptr, v)   atomic_typed(store_relaxed, ptr)((ptr), (v))
+#define store_release(ptr, v)   atomic_typed(store_release, ptr)((ptr), (v))
+#define full_fence()            MemoryBarrier()
+#define exchange_ptr(ptr, v)    InterlockedExchangePointer((PVOID volatile*)(ptr), (v))
+
+#ifdef _WIN64
+#define fetch_add(ptr, v)  ((size_t)InterlockedExchangeAdd64((volatile LONG64*)(ptr), (LONG64)(v)))
+#else
+#define fetch_add(ptr, v)  ((size_t)InterlockedExchangeAdd((volatile LONG*)(ptr), (LONG)(v)))
+#endif
+#define fetch_sub(ptr, v)  fetch_add((ptr), -(v))
+
+static inline bool compare_and_swap(size_t* ptr, size_t* expected, size_t desired)
+{
+#ifdef _WIN64
+    size_t old = (size_t)InterlockedCompareExchange64(
+                    (volatile LONG64*)ptr, (LONG64)desired, (LONG64)*expected);
+#else
+    size_t old = (size_t)InterlockedCompareExchange(
+                    (volatile LONG*)ptr, (LONG)desired, (LONG)*expected);
+#endif
+    bool swapped = old == *expected;
+    *expected = old;
+    return swapped;
+}
+
+#else
+#error "pipe.c needs atomic operations. Please add them for your compiler."
+#endif
+
+// Tells the CPU we're spinning, so it can save power and let the other
+// hyperthread have the core for a bit.
+#if defined(__GNUC__) && (defined(__i386__) || defined(__x86_64__))
+#define cpu_relax() __builtin_ia32_pause()
+#elif defined(__GNUC__) && (defined(__aarch64__) || __ARM_ARCH >= 7)
+#define cpu_relax() __asm__ __volatile__("yield" ::: "memory")
+#elif defined(_MSC_VER)
+#define cpu_relax() YieldProcessor()
+#else
+#define cpu_relax() ((void)0)
+#endif
+
+// End atomics.
+
+// Eventcounts. A thread waiting for something to happen announces itself with
+// event_prepare, checks whether it still has to wait, then either backs out
+// with event_cancel or sleeps with event_wait. Whoever makes it happen calls
+// event_notify afterwards. Since waiters count themselves in, notifying an
+// event that nobody waits on is just a fence and a load. The fences in
+// event_prepare and event_notify pair up: either the notifier sees our count,
+// or we see whatever it published before notifying.
+
+typedef struct {
+    unsigned seq;     // Bumped by every notify that had somebody to wake.
+    size_t   waiters; // The number of threads between prepare and wait/cancel.
+#if !HAVE_FUTEX
+    mutex_t  lock;    // Without a futex, we sleep on a condition variable.
+    cond_t   cond;
+#endif
+} event_t;
+
+// Wakes up everybody, however many there are.
+#define EVENT_ALL ((size_t)-1)
+
+#if HAVE_FUTEX
+
+static inline void event_init(event_t* ev)
+{
+    ev->seq     = 0;
+    ev->waiters = 0;
+}
+
+#define event_destroy(ev)
+
+// Sleeps while `*addr' is still `val', until `deadline' (on CLOCK_MONOTONIC)
+// if there is one. Returns false if the deadline passed.
+static inline bool futex_wait(unsigned* addr,
+                              unsigned val,
+                              const struct timespec* deadline)
+{
+    // FUTEX_WAIT_BITSET takes an absolute deadline, unlike FUTEX_WAIT.
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG,
+                   val, deadline, NULL, FUTEX_BITSET_MATCH_ANY) == 0
+        || errno != ETIMEDOUT;
+}
+
+static inline void futex_wake(unsigned* addr, size_t count)
+{
+    syscall(SYS_futex, addr, FUTEX_WAKE | FUTEX_PRIVATE_FLAG,
+            count > INT_MAX ? INT_MAX : (int)count, NULL, NULL, 0);
+}
+
+#else /* HAVE_FUTEX */
+
+static inline void event_init(event_t* ev)
+{
+    ev->seq     = 0;
+    ev->waiters = 0;
+    mutex_init(&ev->lock);
+    cond_init(&ev->cond);
+}
+
+static inline void event_destroy(event_t* ev)
+{
+    mutex_destroy(&ev->lock);
+    cond_destroy(&ev->cond);
+}
+
+#endif /* HAVE_FUTEX */
+
+// Returns the key to pass to event_wait.
+static inline unsigned event_prepare(event_t* ev)
+{
+    fetch_add(&ev->waiters, 1);
+    full_fence();
+
+    return load_acquire(&ev->seq);
+}
+
+static inline void event_cancel(event_t* ev)
+{
+    fetch_sub(&ev->waiters, 1);
+}
+
+// Sleeps until the event is notified after the event_prepare that returned
+// `key', or until `deadline' if there is one. Returns false if the deadline
+// passed first.
+static bool event_wait(event_t* ev, unsigned key, const struct timespec* deadline)
+{
+    bool woken = true;
+
+#if HAVE_FUTEX
+    while(woken && load_acquire(&ev->seq) == key)
+        woken = futex_wait(&ev->seq, key, deadline);
+#else
+    mutex_lock(&ev->lock);
+        while(woken && load_relaxed(&ev->seq) == key)
+            woken = cond_wait_until(&ev->cond, &ev->lock, deadline);
+    mutex_unlock(&ev->lock);
+#endif
+
+    event_cancel(ev);
+
+    return woken;
+}
+
+#ifdef PIPE_SUITE_MAIN
+// The standalone pipe_suite counts wakes, to check that nobody is woken for
+// nothing: how many times event_wake went to wake anybody, and how many
+// threads it asked for in all.
+size_t pipe_suite_wake_calls,
+       pipe_suite_wakes;
+
+#define count_wakes(count)                          \
+    do {                                            \
+        fetch_add(&pipe_suite_wake_calls, 1);       \
+        fetch_add(&pipe_suite_wakes, (count));      \
+    } while(0)
+#else
+#define count_wakes(count) ((void)0)
+#endif
+
+// event_notify, minus the fence, for callers that have already fenced since
+// publishing whatever they're notifying about.
+static inline void event_wake(event_t* ev, size_t count)
+{
+    size_t waiters = load_relaxed(&ev->waiters);
+
+    if(likely(waiters == 0) || unlikely(count == 0))
+        return;
+
+    count = min(count, waiters);
+
+    count_wakes(count);
+
+#if HAVE_FUTEX
+    fetch_add(&ev->seq, 1);
+    futex_wake(&ev->seq, count);
+#else
+    mutex_lock(&ev->lock);
+        store_relaxed(&ev->seq, ev->seq + 1);
+
+        if(count == waiters)
+            cond_broadcast(&ev->cond);
+        else
+            while(count--)
+                cond_signal(&ev->cond);
+    mutex_unlock(&ev->lock);
+#endif
+}
+
+// Wakes up to `count' threads waiting on `ev'. If nobody is, this doesn't even
+// touch the kernel.
+static inline void event_notify(event_t* ev, size_t count)
+{
+    full_fence();
+    event_wake(ev, count);
+}
+
+// End eventcounts.
+
 /*
  * Pipe implementation overview
  * =================================
@@ -288,6 +716,156 @@ static void cond_destroy(cond_t* c)
  * independently of each other. This optimization has improved benchmarks by
  * 15-20%.
  *
+ * SPSC pipes:
+ *
+ * A pipe made with pipe_new_spsc promises that only one thread pushes and only
+ * one thread pops at a time. The buffer is allocated at full size up front and
+ * never resized, so begin and end are the only moving parts. The producer
+ * publishes end with a release store and the consumer publishes begin with a
+ * release store; each side reads the other's cursor with an acquire load. The
+ * only other shared state is the pair of eventcounts, which a side touches when
+ * it has to sleep because the ring is empty or full. Notifying them is free
+ * when nobody is asleep.
+ *
+ * MPMC pipes:
+ *
+ * A pipe made with pipe_new_mpmc has a fixed, power-of-two number of slots,
+ * and is safe for any number of producers and consumers. Each slot holds a
+ * sequence number followed by an element. enqueue_pos and dequeue_pos are
+ * claimed by compare-and-swap, and a slot's sequence number tells whoever
+ * claimed it whether it's ready yet:
+ *
+ *   seq == pos      the slot is free, and may be filled by the push at `pos'.
+ *   seq == pos + 1  the slot is full, and may be emptied by the pop at `pos'.
+ *
+ * Emptying the slot at `pos' sets its sequence to `pos + slots', which makes it
+ * free for the push one lap later. No locks are held while pushing or popping.
+ * Sleeping when the ring is full or empty works just like in SPSC pipes.
+ *
+ * Segmented pipes:
+ *
+ * A pipe made with pipe_new_segmented has no buffer. Its elements live in a
+ * singly linked list of fixed-size chunks, from `head' to `tail':
+ *
+ *     head                                  tail
+ *       [     >=========]->[===============]->[=======>       ]
+ *           begin                                    end
+ *
+ * Pushing fills the tail chunk and links a new one on when it runs out, and
+ * popping drains the head chunk and lets it go once `begin' runs off the end.
+ * Nothing is ever copied from one place in the pipe to another, so growing is
+ * O(1) no matter how many elements there are. The two locks work just like in
+ * locking pipes, but since begin and end can be in different chunks, the
+ * number of bytes in the pipe is kept separately in `used', which is only ever
+ * changed atomically. A push links its chunks before adding to `used', so a
+ * consumer never reads anything that isn't there yet. The most recently
+ * drained chunk is kept as a spare for the next push that needs one.
+ *
+ * Mirrored buffers:
+ *
+ * A pipe made with pipe_new_mirrored is a normal locking pipe, except that its
+ * buffer is a memfd mapped twice, back to back:
+ *
+ *     buffer                         bufend
+ *       [ ===>            >========= ][ ===>            >========= ]
+ *                       begin              ^ the same pages again
+ *
+ * Anything that would wrap around bufend can carry on straight into the second
+ * mapping instead, so every push and pop is a single memcpy, and peeks and
+ * reservations are always one span. Only the pointers stored in the pipe_t are
+ * wrapped. Since the buffer length is rounded up to whole pages, elements may
+ * straddle bufend, so the mirrored paths must never split a copy there.
+ *
+ * Growing the buffer extends the memfd and maps it again, which leaves the
+ * elements where they were. Only the part that used to wrap around has to be
+ * moved, and we move whichever side of the wrap is smaller.
+ *
+ * Broadcast pipes:
+ *
+ * A pipe made with pipe_new_broadcast hands every element to every consumer.
+ * The elements live in a fixed, power-of-two ring, and each consumer handle has
+ * a cursor of its own into it. Positions only ever count up; `enqueue_pos' is
+ * the next one to be pushed, and a consumer at `pos' has everything in
+ * [pos, enqueue_pos) still to read:
+ *
+ *     oldest cursor        another cursor           enqueue_pos
+ *       [   >======================>===================>         ]
+ *
+ * Producers push under end_lock, so there is only ever one writer, and publish
+ * what they've written by bumping enqueue_pos. Consumers never take a lock to
+ * pop. They copy out, then move their own cursor forward.
+ *
+ * Normally, a push may only overwrite what every consumer has read, so the
+ * oldest cursor is where the ring is reclaimed, and the slowest consumer holds
+ * everybody up. The cursors are in a list guarded by begin_lock, which is only
+ * walked when the ring looks full. With PIPE_BROADCAST_DROP, pushes never wait
+ * and overwrite whatever they have to. They advance `lapped' past anything
+ * they're about to overwrite first, so a consumer that checks it after copying
+ * knows whether what it copied was intact. A consumer that's been lapped is
+ * cut off.
+ *
+ * Selecting:
+ *
+ * pipe_select can't sleep on several pipes' just_pushed at once, so it sleeps
+ * on an event of its own, and hangs a selector_t pointing at it onto each
+ * pipe's `selectors' list. Every notify of just_pushed notifies those too.
+ * Without any selectors that costs a single load, of a field on just_pushed's
+ * cache line.
+ *
+ * The eventfds from pipe_consumer_fd and pipe_producer_fd hang off the same
+ * notifies. Writing to one costs a syscall, so each has a flag saying it's
+ * already been written to, and only the notify that sets it writes. The flag
+ * is cleared, and the eventfd drained, when a pipe_try_* call finds it would
+ * block. The flag and the pipe are then checked again, so a push or pop that
+ * slipped in between can't be missed.
+ *
+ * Priority pipes:
+ *
+ * A pipe made with pipe_new_priority is a front for `nlevels' locking pipes,
+ * one per priority level, which it owns a producer and a consumer reference
+ * to. Pushes go straight into a level. Pops take the priority pipe's
+ * begin_lock only to pick a level, and let go of it before popping from that
+ * level under the level's own lock, so consumers don't wait on each other's
+ * copies. Another consumer can empty the level in between, in which case the
+ * pop comes back with nothing, and the consumer picks again. Consumers sleep
+ * on the priority pipe's just_pushed, which every push into a level notifies
+ * as it goes.
+ *
+ * With a starvation quota, `starved' counts how many elements each level has
+ * had served ahead of it while it was waiting, and a level that's waited out
+ * its quota is served next. A pop takes begin_lock again afterwards to keep
+ * score, so with consumers popping at once, the count is only roughly right:
+ * others may pick a level before a pop's score is in, and a level that was
+ * emptied or refilled in between is counted as it is by then. A starved level
+ * can be served a few pops late, or a few early, but never skipped for good.
+ *
+ * Sharded pipes:
+ *
+ * These are built just like priority pipes, out of `nparts' locking pipes, but
+ * each producer handle pushes into a part of its own, which it's given when
+ * it's made. Consumers don't lock the sharded pipe itself at all. They try the
+ * fullest part first, then the rest in turn, and sleep on its just_pushed when
+ * there's nothing in any. A part can only look empty to a pop because it is,
+ * or because another consumer has it locked, so they check again before they
+ * sleep. If the only parts with elements are locked, a blocking pop waits for
+ * the fullest one's lock, since nothing would wake it when they're unlocked.
+ *
+ * Record pipes:
+ *
+ * A pipe made with pipe_new_records is a locking pipe of bytes, holding
+ * records of any size packed back to back, each behind a size_t giving its
+ * length:
+ *
+ *     [ size | record ][ size | rec ][ size | a longer record ]
+ *
+ * A record goes in with a single push under end_lock, and comes out with a
+ * single pop under begin_lock, so nobody ever sees half of one. A producer
+ * waiting for room needs a whole record's worth, not just one byte, so it
+ * leaves the size it's after in `record_room' for has_record_room to check.
+ * Producers waiting at the same time overwrite each other's, but that only
+ * makes them wake up early or late, and every pop wakes them all to look
+ * again.
+ *
  * Complexity:
  *
  * Pushing and popping must run in O(n) where n is the number of elements being
@@ -300,41 +878,398 @@ static void cond_destroy(cond_t* c)
  * into no-ops. Therefore, it is recommended that you compile with -O1 in
  * debug builds as the pipe can easily become a bottleneck.
  */
+// The algorithm used to move elements through a pipe. Fixed at creation.
+typedef enum {
+    ENGINE_LOCKING, // The default: two locks, a growable buffer.
+    ENGINE_SPSC,    // One producer thread, one consumer thread, fixed buffer.
+    ENGINE_MPMC,    // Any number of threads, fixed array of sequenced slots.
+    ENGINE_SEGMENTED, // Two locks, a linked list of fixed-size chunks.
+    ENGINE_BROADCAST, // A fixed ring, with a cursor per consumer.
+    ENGINE_PRIORITY,  // A locking pipe per priority level.
+    ENGINE_SHARDED,   // A locking pipe per shard, a shard per producer handle.
+
+    // Not engines. These mark buffered producer and consumer handles,
+    // broadcast consumer handles, and sharded producer handles, which start
+    // with an engine_t just like a pipe_t does, so that they can be told apart.
+    ENGINE_BUFFERED_PRODUCER,
+    ENGINE_BUFFERED_CONSUMER,
+    ENGINE_BROADCAST_CONSUMER,
+    ENGINE_SHARD_PRODUCER,
+} engine_t;
+
+// One link in a segmented pipe's list of chunks. Each one holds
+// pipe_t::chunk_size bytes of elements.
+typedef struct chunk_t {
+    struct chunk_t* next;
+    char            elems[];
+} chunk_t;
+
+// The buffers behind a pooled pipe, and the pipe that carries them back to the
+// producers once the consumers are done with them. See pipe_new_pooled.
+typedef struct {
+    pipe_producer_t* give; // The two ends of the return pipe. `give' is freed
+    pipe_consumer_t* take; // once the last consumer leaves, so that anybody
+                           // waiting in pipe_pool_acquire stops.
+
+    char*  buffers;        // `count' buffers, each `stride' bytes apart,
+                           // starting on a cache line.
+    char*  block;          // What `buffers' was carved out of, which is
+                           // POOL_BLOCK_SIZE bytes long.
+    size_t count,
+           stride;
+} pool_t;
+
+// Most CPUs move memory around in 64-byte lines. Two threads writing to the
+// same line fight over it even if they never touch the same bytes, so we keep
+// whatever comes before and after one of these on separate lines.
+#define CACHE_LINE_SIZE 64
+
+// pipe_bench.c builds with PIPE_PACKED_LAYOUT to measure what that's worth. It
+// packs the groups back together, and has SPSC pipes read the other side's
+// cursor every time instead of keeping a copy of it.
+#ifdef PIPE_PACKED_LAYOUT
+#define CACHE_PAD(name) char name[1]
+#define CACHE_CURSORS   0
+#else
+#define CACHE_PAD(name) char name[CACHE_LINE_SIZE]
+#define CACHE_CURSORS   1
+#endif
+
+// The fields are grouped by who writes them: the producers, the consumers, or
+// (almost) nobody. Each group gets its own cache lines, so that a push and a
+// pop running at the same time don't slow each other down.
 struct pipe_t {
+    // Read-mostly. These only change when the buffer is resized.
+
+    engine_t engine;   // Read-only after creation. This must come first; see
+                       // pipify.
+
+    // How threads wait for room or elements, and how many times they spin
+    // first with PIPE_WAIT_SPIN_THEN_BLOCK. Set with pipe_set_wait_strategy
+    // before the pipe is shared, and read-only after that.
+    pipe_wait_strategy_t wait_strategy;
+    size_t               spins;
+
     size_t elem_size,  // The size of each element. This is read-only and
                        // therefore does not need to be locked to read.
-           min_cap,    // The smallest sane capacity before the buffer refuses
+           min_cap;    // The smallest sane capacity before the buffer refuses
                        // to shrink because it would just end up growing again.
                        // To modify this variable, you must lock the whole pipe.
-           max_cap;    // The maximum capacity of the pipe before push requests
-                       // are blocked. To read or write to this variable, you
-                       // must hold 'end_lock'.
 
     char*  buffer,     // The internal buffer, holding the enqueued elements.
                        // to modify this variable, you must lock the whole pipe.
-        *  bufend,     // One past the end of the buffer, so that the actual
+        *  bufend;     // One past the end of the buffer, so that the actual
                        // elements are stored in in interval [buffer, bufend).
-        *  begin,      // Always points to the sentinel element. `begin + elem_size`
+
+    // The memfd behind a mirrored buffer, or -1 for a plain malloc'd buffer.
+    // To modify this variable, you must lock the whole pipe.
+    int mirror_fd;
+
+    // Static pipes only. The pipe_t and its buffer are in memory the caller
+    // gave us, which is never resized or freed, and may be locked into RAM.
+    // Read-only after creation.
+    bool fixed,
+         mlocked;
+
+    // Record pipes only. The elements are single bytes, holding
+    // length-prefixed records. Read-only after creation.
+    bool records;
+
+    // Pooled pipes only. Where the buffers whose addresses go through the pipe
+    // come from. Read-only after creation.
+    pool_t* pool;
+
+    // Broadcast pipes only. Whether to cut off consumers that fall a whole ring
+    // behind, instead of waiting for them. Read-only after creation.
+    bool drop_slow;
+
+    // Priority and sharded pipes only. The pipes this one is a front for: one
+    // per level, highest priority first, or one per shard. Read-only after
+    // creation.
+    pipe_t** parts;
+    size_t   nparts;
+
+    // Priority pipes only. How many elements a level may have served ahead of
+    // it before it gets a turn. A quota of 0 means never. Read-only after
+    // creation.
+    size_t quota;
+
+    // MPMC pipes only. `buffer' is an array of slot_mask+1 slots, each
+    // slot_size bytes long.
+    size_t slot_size,
+           slot_mask;
+
+    // Segmented pipes only. The number of bytes of elements in each chunk.
+    size_t chunk_size;
+
+    // Where the pipe_t itself, its buffer and its chunks come from. Read-only
+    // after creation.
+    pipe_allocator_t allocator;
+
+    // How the buffer grows and shrinks. Set with pipe_set_capacity_policy.
+    // To modify this variable, you must lock the whole pipe.
+    pipe_capacity_policy_t policy;
+
+    // When the buffer was last resized, in now_ms() time. Only kept track of
+    // if the policy has a shrink delay.
+    uint64_t last_resize;
+
+    // The biggest `high_water' from the window before this one, and when this
+    // one started. To modify these, you must lock the whole pipe.
+    size_t   prev_high_water;
+    uint64_t high_water_since;
+
+    CACHE_PAD(read_mostly_pad);
+
+    // The consumers' side.
+
+    char*  begin;      // Always points to the sentinel element. `begin + elem_size`
                        // points to the left-most element in the pipe.
                        // To modify this variable, you must lock begin_lock.
-        *  end;        // Always points past the right-most element in the pipe.
+
+    // SPSC pipes only. The consumer's last look at `end', so that it doesn't
+    // have to go and fetch the producer's cache line unless it runs dry.
+    char*  cached_end;
+
+    // Our lovely mutexes: this one and end_lock. To lock the pipe, call
+    // lock_pipe. Depending on what you modify, you may be able to get away with
+    // only locking one of them.
+    mutex_t begin_lock;
+
+    size_t producer_refcount; // Written under begin_lock, with a release store,
+                              // since lock-free pops read it without the lock.
+
+    // Sharded pipes only. The shard the next producer handle gets. Guarded by
+    // begin_lock.
+    size_t next_shard;
+
+    // The number of bytes handed out by pipe_pop_peek, and not yet released.
+    // Guarded by begin_lock, except in SPSC pipes, where only the consumer
+    // touches it.
+    size_t peeked;
+
+    // MPMC pipes only. Always accessed atomically.
+    size_t dequeue_pos;
+
+    // Broadcast pipes only. Every consumer handle's cursor. Guarded by
+    // begin_lock.
+    struct broadcast_consumer_t* cursors;
+
+    // Priority pipes with a quota only. How many elements have been popped
+    // ahead of each level since it was last served, while it had elements of
+    // its own. Guarded by begin_lock, but kept after the pop rather than with
+    // the pick, so it's only roughly right while consumers pop at once.
+    size_t* starved;
+
+    // Sharded pipes only. Where the next pop starts looking, and which shard
+    // wins a tie for the fullest. Bumped with fetch_add, so that consumers
+    // popping at once each start somewhere else.
+    size_t next_pop;
+
+    // Segmented pipes only. The chunk `begin' points into, which is the first
+    // one in the list. Guarded by begin_lock.
+    chunk_t* head;
+
+    CACHE_PAD(consumer_pad);
+
+    // The producers' side.
+
+    char*  end;        // Always points past the right-most element in the pipe.
                        // To modify this variable, you must lock end_lock.
 
-    // The number of producers/consumers in the pipe.
-    size_t producer_refcount, // Guarded by begin_lock.
-           consumer_refcount; // Guarded by end_lock.
+    // SPSC pipes only. The producer's last look at `begin', so that it doesn't
+    // have to go and fetch the consumer's cache line unless it runs out of
+    // room.
+    char*  cached_begin;
 
-    // Our lovely mutexes. To lock the pipe, call lock_pipe. Depending on what
-    // you modify, you may be able to get away with only locking one of them.
-    mutex_t begin_lock,
-            end_lock;
+    mutex_t end_lock;
+
+    size_t consumer_refcount; // Written under end_lock, with a release store,
+                              // since lock-free pushes read it without the lock.
+
+    size_t max_cap;    // The maximum capacity of the pipe before push requests
+                       // are blocked. To read or write to this variable, you
+                       // must hold 'end_lock'.
 
-    cond_t just_pushed, // Signaled immediately after a push.
-           just_popped; // Signaled immediately after a pop.
+    // The number of bytes handed out by pipe_push_reserve, and not yet
+    // committed. Guarded by end_lock, except in SPSC pipes, where only the
+    // producer touches it.
+    size_t reserved;
+
+    // MPMC and broadcast pipes only. Always accessed atomically.
+    size_t enqueue_pos;
+
+    // Broadcast pipes with PIPE_BROADCAST_DROP only. Anything before this
+    // position may have been overwritten. Written under end_lock, but always
+    // accessed atomically, since the consumers check it without it.
+    size_t lapped;
+
+    // Segmented pipes only. The chunk `end' points into, which is the last one
+    // in the list. Guarded by end_lock.
+    chunk_t* tail;
+
+    // Record pipes only. How many bytes the producer that most recently went
+    // to sleep needs free. Written under end_lock, but always accessed
+    // atomically, since spinners read it without the lock.
+    size_t record_room;
+
+    // The most bytes the pipe has held since `high_water_since', if the policy
+    // cares. Written under end_lock, but always accessed atomically, since the
+    // consumers peek at it without it.
+    size_t high_water;
+
+    CACHE_PAD(producer_pad);
+
+    // producer_refcount + consumer_refcount, kept separately. The refcounts say
+    // when a side is gone, but lock-free pops and pushes read them without a
+    // lock, so the other side may see it go and free its own handles while the
+    // last one out is still notifying them. Whoever drops the last reference of
+    // all frees the pipe. Always accessed atomically.
+    size_t handles;
+
+    // Segmented pipes only. These are touched by both sides, and are always
+    // accessed atomically.
+    size_t   used;  // The number of bytes of elements in the pipe.
+    chunk_t* spare; // A drained chunk, kept around for the next one we need.
+
+    CACHE_PAD(shared_pad);
+
+    // Notified immediately after a push/pop, with the number of elements
+    // pushed/popped, so that we wake up no more waiters than can make progress.
+    // Each is written by one side and read by the other, so they get lines of
+    // their own too.
+    event_t just_pushed;
+
+    // The pipe_select calls waiting on this pipe, if any, and pipe_consumer_fd's
+    // eventfd, or -1. Every notify of just_pushed checks for them, so they go on
+    // its line. Guarded by select_lock, but always accessed atomically, since
+    // notifiers look without it first.
+    struct selector_t* selectors;
+    int                readable_fd;
+    mutex_t            select_lock;
+
+    // Whether readable_fd has been written to since a pop last found the pipe
+    // empty. Always accessed atomically.
+    size_t readable_signaled;
+
+    CACHE_PAD(event_pad);
+
+    event_t just_popped;
+
+    // The same for pipe_producer_fd, and a full pipe. Also created under
+    // select_lock.
+    int    writable_fd;
+    size_t writable_signaled;
 };
 
+// A producer handle with a private batch of elements that haven't been pushed
+// yet, made by pipe_producer_new_buffered. Only the thread that owns the handle
+// ever touches it, so none of this needs locking.
+typedef struct {
+    engine_t engine;    // Always ENGINE_BUFFERED_PRODUCER. This must come first.
+    pipe_t*  pipe;
+
+    size_t   pending,   // The number of bytes waiting in `batch'.
+             capacity;  // The number of bytes `batch' can hold.
+
+    // How old the oldest element may get before a push flushes the batch, and
+    // when it came in, in now_ms() time. 0 leaves it to the batch filling up.
+    unsigned flush_age_ms;
+    uint64_t since;
+
+    size_t   shard;     // Which shard of a sharded pipe the batches go into.
+
+    char     batch[];
+} buffered_producer_t;
+
+// Returns the buffered handle behind `handle', or NULL if it's a plain one.
+static inline buffered_producer_t* as_buffered_producer(const void* handle)
+{
+    return unlikely(*(const engine_t*)handle == ENGINE_BUFFERED_PRODUCER)
+         ? (buffered_producer_t*)handle
+         : NULL;
+}
+
+// A producer handle to a sharded pipe, made by pipe_producer_new. Everything it
+// pushes goes into the same shard, so it comes out in the same order.
+typedef struct {
+    engine_t engine;    // Always ENGINE_SHARD_PRODUCER. This must come first.
+    pipe_t*  pipe;
+    size_t   shard;
+} shard_producer_t;
+
+// Returns the sharded handle behind `handle', or NULL if it's another kind.
+static inline shard_producer_t* as_shard_producer(const void* handle)
+{
+    return unlikely(*(const engine_t*)handle == ENGINE_SHARD_PRODUCER)
+         ? (shard_producer_t*)handle
+         : NULL;
+}
+
+// A consumer handle with a private cache of elements that have already been
+// popped, made by pipe_consumer_new_buffered. Like a buffered producer, only
+// its owner ever touches it.
+typedef struct {
+    engine_t engine;    // Always ENGINE_BUFFERED_CONSUMER. This must come first.
+    pipe_t*  pipe;
+
+    size_t   begin,     // The cached elements are the bytes of `batch' in
+             end,       // [begin, end).
+             capacity,  // The number of bytes `batch' can hold.
+             peeked;    // Bytes handed out by pipe_pop_peek from the cache.
+
+    char     batch[];
+} buffered_consumer_t;
+
+// Returns the buffered handle behind `handle', or NULL if it's a plain one.
+static inline buffered_consumer_t* as_buffered_consumer(const void* handle)
+{
+    return unlikely(*(const engine_t*)handle == ENGINE_BUFFERED_CONSUMER)
+         ? (buffered_consumer_t*)handle
+         : NULL;
+}
+
+// A consumer handle to a broadcast pipe, made by pipe_consumer_new. Only its
+// owner moves the cursor, but the producers read it.
+typedef struct broadcast_consumer_t {
+    engine_t engine;    // Always ENGINE_BROADCAST_CONSUMER. This must come first.
+    pipe_t*  pipe;
+
+    size_t   pos;       // The next element to pop. Always accessed atomically.
+    bool     dropped;   // Whether we were lapped with PIPE_BROADCAST_DROP.
+
+    struct broadcast_consumer_t* next; // Guarded by begin_lock.
+} broadcast_consumer_t;
+
+// One pipe_select call's entry in a pipe's list of selectors. Each call has one
+// per consumer it's waiting on, all pointing at the same event.
+typedef struct selector_t {
+    event_t*           ev;
+    struct selector_t* next;
+} selector_t;
+
+// Returns the broadcast handle behind `handle', or NULL if it's another kind.
+static inline broadcast_consumer_t* as_broadcast_consumer(const void* handle)
+{
+    return unlikely(*(const engine_t*)handle == ENGINE_BROADCAST_CONSUMER)
+         ? (broadcast_consumer_t*)handle
+         : NULL;
+}
+
+static inline pipe_t* pipify(const void* handle)
+{
+    switch(*(const engine_t*)handle)
+    {
+    case ENGINE_BUFFERED_PRODUCER:  return ((buffered_producer_t*)handle)->pipe;
+    case ENGINE_BUFFERED_CONSUMER:  return ((buffered_consumer_t*)handle)->pipe;
+    case ENGINE_BROADCAST_CONSUMER: return ((broadcast_consumer_t*)handle)->pipe;
+    case ENGINE_SHARD_PRODUCER:     return ((shard_producer_t*)handle)->pipe;
+    default:                        return (pipe_t*)handle;
+    }
+}
+
 // Converts a pointer to either a producer or consumer into a suitable pipe_t*.
-#define PIPIFY(handle) ((pipe_t*)(handle))
+#define PIPIFY(handle) pipify(handle)
 
 // We wrap elem_size in a function so we can annotate it with PURE, allowing
 // the compiler's CSE to eliminate extraneous memory accesses.
@@ -348,6 +1283,18 @@ size_t pipe_elem_size(pipe_generic_t* p)
     return __pipe_elem_size(PIPIFY(p));
 }
 
+void pipe_set_wait_strategy(pipe_t* p,
+                            pipe_wait_strategy_t strategy,
+                            size_t spins)
+{
+    p->wait_strategy = strategy;
+    p->spins         = spins ? spins : MUTEX_SPINS;
+
+    // Producers wait for room on a pipe's parts, not on the pipe itself.
+    for(size_t i = 0; i < p->nparts; ++i)
+        pipe_set_wait_strategy(p->parts[i], strategy, spins);
+}
+
 
 // Represents a snapshot of a pipe. We often don't need all our values
 // up-to-date (usually only one of begin or end). By passing this around, we
@@ -358,6 +1305,7 @@ typedef struct {
         *   begin,
         *   end;
     size_t elem_size;
+    bool   mirrored;
 } snapshot_t;
 
 static inline snapshot_t make_snapshot(pipe_t* p)
@@ -368,6 +1316,7 @@ static inline snapshot_t make_snapshot(pipe_t* p)
         .begin  = p->begin,
         .end    = p->end,
         .elem_size = __pipe_elem_size(p),
+        .mirrored  = p->mirror_fd >= 0,
     };
 }
 
@@ -379,6 +1328,12 @@ static inline snapshot_t make_snapshot(pipe_t* p)
 #define DEFAULT_MINCAP  32
 #endif
 
+// Double when we run out of room. Halve when we're down to a quarter full.
+#define DEFAULT_POLICY ((pipe_capacity_policy_t) { \
+    .growth_percent = 100,                          \
+    .shrink_percent = 25,                           \
+})
+
 // Returns the maximum number of bytes the buffer can hold, excluding the
 // sentinel element.
 static inline size_t capacity(snapshot_t s)
@@ -484,6 +1439,12 @@ static inline void check_invariants(pipe_t* p)
 {
     if(p == NULL) return;
 
+    // Segmented, priority and sharded pipes don't have a buffer. Their state
+    // is in the chunks and the parts.
+    if(p->engine == ENGINE_SEGMENTED || p->engine == ENGINE_PRIORITY
+    || p->engine == ENGINE_SHARDED)
+        return;
+
     // p->buffer may be NULL. When it is, we must have no issued consumers.
     // It's just a way to save memory when we've deallocated all consumers
     // and people are still trying to push like idiots.
@@ -497,6 +1458,11 @@ static inline void check_invariants(pipe_t* p)
         assertume(p->consumer_refcount != 0);
     }
 
+    // MPMC and broadcast pipes don't use begin/end at all. Their state is in
+    // the slots and the cursors.
+    if(p->engine == ENGINE_MPMC || p->engine == ENGINE_BROADCAST)
+        return;
+
     snapshot_t s = make_snapshot(p);
 
     assertume(s.begin);
@@ -514,592 +1480,4376 @@ static inline void check_invariants(pipe_t* p)
     if(s.begin == s.end)
         assertume(bytes_in_use(s) == capacity(s));
 
+    // SPSC and static pipes are sized exactly to their limit, and never resize.
+    if(p->engine == ENGINE_SPSC || p->fixed)
+        return;
+
+    assertume(p->max_cap % p->elem_size == 0
+            && "The maximum capacity must hold a whole number of elements.");
+
     assertume(in_bounds(DEFAULT_MINCAP*p->elem_size, p->min_cap, p->max_cap));
-    assertume(in_bounds(p->min_cap, capacity(s) + p->elem_size, p->max_cap));
+
+    // Mirrored buffers are rounded up to whole pages, so they may end up a bit
+    // bigger than max_cap. The extra room is never used.
+    if(s.mirrored)
+        assertume(capacity(s) >= p->min_cap);
+    else
+        assertume(in_bounds(p->min_cap, capacity(s), p->max_cap));
 }
 
-static inline void lock_pipe(pipe_t* p)
+#if HAVE_MIRRORING
+
+// Rounds a buffer length up to whole pages, which is all mmap deals in.
+static size_t mirror_length(size_t bytes)
 {
-    // watch the locking order VERY carefully. end_lock must ALWAYS be locked
-    // before begin_lock when dealing with both at once.
-    mutex_lock(&p->end_lock);
-    mutex_lock(&p->begin_lock);
-    check_invariants(p);
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    return (bytes + page - 1) / page * page;
 }
 
-static inline void unlock_pipe(pipe_t* p)
+// Maps the first `len' bytes of `fd' twice in a row, returning NULL on failure.
+static char* map_mirror(int fd, size_t len)
 {
-    check_invariants(p);
-    mutex_unlock(&p->begin_lock);
-    mutex_unlock(&p->end_lock);
-}
+    // Reserve all the address space first, so nothing else can be mapped
+    // in between the two halves.
+    char* addr = mmap(NULL, 2*len, PROT_NONE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-// runs some code while automatically locking and unlocking the pipe. If `break'
-// is used, the pipe will be unlocked before control returns from the macro.
-#define WHILE_LOCKED(stuff) do { \
-    lock_pipe(p);                \
-    do { stuff; } while(0);      \
-    unlock_pipe(p);              \
- } while(0)
+    if(unlikely(addr == MAP_FAILED))
+        return NULL;
 
-pipe_t* pipe_new(size_t elem_size, size_t limit)
+    for(size_t half = 0; half < 2; ++half)
+        if(unlikely(mmap(addr + half*len, len, PROT_READ | PROT_WRITE,
+                         MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED))
+            return munmap(addr, 2*len), NULL;
+
+    return addr;
+}
+
+// Allocates a brand new mirrored buffer `len' bytes long, returning NULL on
+// failure.
+static char* new_mirror(int* fd, size_t len)
 {
-    assertume(elem_size != 0);
+    *fd = memfd_create("pipe", MFD_CLOEXEC);
 
-    if(elem_size == 0)
+    if(unlikely(*fd < 0))
         return NULL;
 
-    pipe_t* p = malloc(sizeof *p);
+    char* buf = ftruncate(*fd, (off_t)len) == 0 ? map_mirror(*fd, len) : NULL;
 
-    assert(DEFAULT_MINCAP >= 1);
+    if(unlikely(buf == NULL))
+        *fd = (close(*fd), -1);
 
-    size_t cap = DEFAULT_MINCAP * elem_size;
-    char*  buf = malloc(cap);
+    return buf;
+}
 
-    // Change the limit from being in "elements" to being in "bytes", and make
-    // room for the sentinel element.
-    limit = (limit + 1) * elem_size;
+static void free_mirror(int fd, char* buf, size_t len)
+{
+    munmap(buf, 2*len);
+    close(fd);
+}
 
-    if(unlikely(p == NULL || buf == NULL))
-        return free(p), free(buf), NULL;
+// The mirrored version of resize_buffer. The pipe must be fully locked, and
+// `new_size' must already be clamped to [min_cap, max_cap].
+static void resize_mirror(pipe_t* p, size_t new_size)
+{
+    snapshot_t s = make_snapshot(p);
 
-    *p = (pipe_t) {
-        .elem_size  = elem_size,
-        .min_cap = cap,
-        .max_cap = limit ? next_pow2(max(limit, cap)) : ~(size_t)0,
+    size_t old_len = s.bufend - s.buffer,
+           new_len = mirror_length(new_size + s.elem_size),
+           // Where the elements (and the sentinel) start, and how long they
+           // are. They're contiguous, as long as we look through the mirror.
+           off     = s.begin - s.buffer,
+           len     = bytes_in_use(s) + s.elem_size;
 
-        .buffer = buf,
-        .bufend = buf + cap,
-        .begin  = buf,
-        .end    = buf + elem_size,
+    if(new_len == old_len)
+        return;
 
-        // Since we're issuing a pipe_t, it counts as both a producer and a
-        // consumer since it can issue new instances of both. Therefore, the
-        // refcounts both start at 1; not the intuitive 0.
-        .producer_refcount = 1,
-        .consumer_refcount = 1,
-    };
+    char* buf;
 
-    mutex_init(&p->begin_lock);
-    mutex_init(&p->end_lock);
+    if(new_len > old_len)
+    {
+        // The elements stay right where they are in the memfd, so growing is
+        // just a matter of extending it and mapping it again.
+        if(unlikely(ftruncate(p->mirror_fd, (off_t)new_len) != 0
+                 || (buf = map_mirror(p->mirror_fd, new_len)) == NULL))
+            abort(); // same as running out of memory in resize_buffer
+
+        // If the elements used to wrap around, the ones at the start of the
+        // memfd now belong past old_len. Either move those forward, or move
+        // the ones before old_len to the new end of the memfd, whichever is
+        // fewer bytes.
+        if(off + len > old_len)
+        {
+            size_t head  = off + len - old_len,
+                   tail  = old_len - off,
+                   extra = new_len - old_len;
+
+            if(head <= min(tail, extra))
+                memcpy(buf + old_len, buf, head);
+            else
+                off = (char*)memmove(buf + new_len - tail, buf + off, tail) - buf;
+        }
 
-    cond_init(&p->just_pushed);
-    cond_init(&p->just_popped);
+        munmap(s.buffer, 2*old_len);
+    }
+    else
+    {
+        // Shrinking would chop the elements off, so start over with a smaller
+        // memfd. If we can't get one, keeping the big one is fine.
+        int fd;
 
-    check_invariants(p);
+        if(unlikely((buf = new_mirror(&fd, new_len)) == NULL))
+            return;
 
-    return p;
-}
+        memcpy(buf, s.begin, len);
+        free_mirror(p->mirror_fd, s.buffer, old_len);
 
-// Instead of allocating a special handle, the pipe_*_new() functions just
-// return the original pipe, cast into a user-friendly form. This saves needless
-// malloc calls. Also, since we have to refcount anyways, it's free.
-pipe_producer_t* pipe_producer_new(pipe_t* p)
-{
-    mutex_lock(&p->begin_lock);
-        p->producer_refcount++;
-    mutex_unlock(&p->begin_lock);
+        p->mirror_fd = fd;
+        off          = 0;
+    }
 
-    return (pipe_producer_t*)p;
+    p->buffer = buf;
+    p->bufend = buf + new_len;
+    p->begin  = buf + off;
+    p->end    = wrap_ptr_if_necessary(buf, p->begin + len, p->bufend);
 }
 
-pipe_consumer_t* pipe_consumer_new(pipe_t* p)
+#endif /* HAVE_MIRRORING */
+
+// The allocator used when none is given: plain old malloc.
+
+static void* default_alloc(void* ctx, size_t size)
 {
-    mutex_lock(&p->end_lock);
-        p->consumer_refcount++;
-    mutex_unlock(&p->end_lock);
+    (void)ctx;
+    return malloc(size);
+}
 
-    return (pipe_consumer_t*)p;
+static void* default_realloc(void* ctx, void* ptr, size_t old_size, size_t size)
+{
+    (void)ctx; (void)old_size;
+    return realloc(ptr, size);
 }
 
-static void deallocate(pipe_t* p)
+static void default_free(void* ctx, void* ptr, size_t size)
 {
-    assertume(p->producer_refcount == 0);
-    assertume(p->consumer_refcount == 0);
+    (void)ctx; (void)size;
+    free(ptr);
+}
 
-    mutex_destroy(&p->begin_lock);
-    mutex_destroy(&p->end_lock);
+static const pipe_allocator_t default_allocator = {
+    .alloc   = default_alloc,
+    .realloc = default_realloc,
+    .free    = default_free,
+};
 
-    cond_destroy(&p->just_pushed);
-    cond_destroy(&p->just_popped);
+#if HAVE_PAGE_ALLOCATOR
 
-    free(p->buffer);
-    free(p);
-}
+// pipe_page_allocator's context is just its flags, with the NUMA node (plus one,
+// so that 0 means none) in the bits above them. There's nothing to free.
+#define PAGE_CTX_FLAGS(ctx) ((unsigned)((uintptr_t)(ctx) & 0xff))
+#define PAGE_CTX_NODE(ctx)  ((int)((uintptr_t)(ctx) >> 8) - 1)
 
-void pipe_free(pipe_t* p)
+#define HUGE_PAGE_SIZE (2*1024*1024)
+
+// Blocks smaller than a page aren't worth a mapping of their own, and hugepages
+// are only used for blocks that fill at least one. Since free is told the size
+// too, it can always tell how a block was allocated.
+static size_t page_mapping_length(unsigned flags, size_t size)
 {
-    size_t new_producer_refcount,
-           new_consumer_refcount;
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
 
-    mutex_lock(&p->begin_lock);
-        assertume(p->producer_refcount > 0);
-        new_producer_refcount = --p->producer_refcount;
-    mutex_unlock(&p->begin_lock);
+    if(size < page)
+        return 0;
 
-    mutex_lock(&p->end_lock);
-        assertume(p->consumer_refcount > 0);
-        new_consumer_refcount = --p->consumer_refcount;
-    mutex_unlock(&p->end_lock);
+    if((flags & PIPE_ALLOC_HUGEPAGES) && size >= HUGE_PAGE_SIZE)
+        page = HUGE_PAGE_SIZE;
 
-    if(unlikely(new_consumer_refcount == 0))
-    {
-        p->buffer = (free(p->buffer), NULL);
+    return (size + page - 1) / page * page;
+}
 
-        if(likely(new_producer_refcount > 0))
-            cond_broadcast(&p->just_popped);
-        else
-            deallocate(p);
-    }
-    else if(unlikely(new_producer_refcount == 0))
-        cond_broadcast(&p->just_pushed);
+// Maps `len' bytes of fresh memory. Returns NULL on failure.
+static char* map_pages(size_t len, int extra_flags)
+{
+    char* buf = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | extra_flags, -1, 0);
+
+    return buf == MAP_FAILED ? NULL : buf;
 }
 
-void pipe_producer_free(pipe_producer_t* handle)
+// Like map_pages, but aligned to a hugepage if `len' is a multiple of one, so
+// that transparent hugepages can back all of it.
+static char* map_aligned(size_t len, int extra_flags)
 {
-    pipe_t* p = PIPIFY(handle);
-    size_t new_producer_refcount;
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | extra_flags;
 
-    mutex_lock(&p->begin_lock);
-        assertume(p->producer_refcount > 0);
-        new_producer_refcount = --p->producer_refcount;
-    mutex_unlock(&p->begin_lock);
+    if(len % HUGE_PAGE_SIZE)
+        return map_pages(len, extra_flags);
 
-    if(unlikely(new_producer_refcount == 0))
-    {
-        size_t consumer_refcount;
+    // Over-allocate, then trim off whatever hangs over either end.
+    char* raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                     flags, -1, 0);
 
-        mutex_lock(&p->end_lock);
-            consumer_refcount = p->consumer_refcount;
-        mutex_unlock(&p->end_lock);
+    if(raw == MAP_FAILED)
+        return NULL;
 
-        // If there are still consumers, wake them up if they're waiting on
-        // input from a producer. Otherwise, since we're the last handle
-        // altogether, we can free the pipe.
-        if(likely(consumer_refcount > 0))
-            cond_broadcast(&p->just_pushed);
-        else
-            deallocate(p);
-    }
+    size_t head = (HUGE_PAGE_SIZE - (uintptr_t)raw % HUGE_PAGE_SIZE)
+                % HUGE_PAGE_SIZE;
+
+    if(head)
+        munmap(raw, head);
+
+    munmap(raw + head + len, HUGE_PAGE_SIZE - head);
+
+    return raw + head;
 }
 
-void pipe_consumer_free(pipe_consumer_t* handle)
+static void* page_alloc(void* ctx, size_t size)
 {
-    pipe_t* p = PIPIFY(handle);
-    size_t new_consumer_refcount;
+    unsigned flags = PAGE_CTX_FLAGS(ctx);
+    int      node  = PAGE_CTX_NODE(ctx);
+    size_t   len   = page_mapping_length(flags, size);
 
-    mutex_lock(&p->end_lock);
-        new_consumer_refcount = --p->consumer_refcount;
-    mutex_unlock(&p->end_lock);
+    if(len == 0)
+        return malloc(size);
 
-    if(unlikely(new_consumer_refcount == 0))
+    bool huge     = (flags & PIPE_ALLOC_HUGEPAGES) && len % HUGE_PAGE_SIZE == 0,
+         prefault = flags & PIPE_ALLOC_PREFAULT;
+
+    char* buf = NULL;
+
+#ifdef MAP_HUGETLB
+    // Try the explicitly reserved hugepages first. There usually aren't any.
+    // The kernel always aligns these, and they're huge from the first fault,
+    // so they can be populated right away unless they still need binding.
+    if(huge)
+        buf = map_pages(len, MAP_HUGETLB
+                           | (prefault && node < 0 ? MAP_POPULATE : 0));
+
+    if(buf != NULL)
+        prefault = prefault && node >= 0;
+#endif
+
+    if(buf == NULL)
     {
-        size_t producer_refcount;
+        // Transparent hugepages have to be asked for before the pages are
+        // faulted in, so only plain pages can be populated by mmap.
+        bool populate = prefault && node < 0 && !huge;
 
-        mutex_lock(&p->begin_lock);
-            producer_refcount = p->producer_refcount;
-        mutex_unlock(&p->begin_lock);
+        buf = map_aligned(len, populate ? MAP_POPULATE : 0);
 
-        // If there are still producers, wake them up if they're waiting on
-        // room to free up from a consumer. Otherwise, since we're the last
-        // handle altogether, we can free the pipe.
-        if(likely(producer_refcount > 0))
-            cond_broadcast(&p->just_popped);
-        else
-            deallocate(p);
+        if(buf == NULL)
+            return NULL;
+
+        prefault = prefault && !populate;
+
+#ifdef MADV_HUGEPAGE
+        if(huge)
+            madvise(buf, len, MADV_HUGEPAGE);
+#endif
     }
-}
 
-// Returns the end of the buffer (buf + number_of_bytes_copied).
-static inline char* copy_pipe_into_new_buf(snapshot_t s,
-                                           char* restrict buf)
-{
-    if(wraps_around(s))
+#if HAVE_MBIND
+    // The pages have to be bound to a node before they're faulted in, too.
+    if(node >= 0 && (size_t)node < 1024)
     {
-        buf = offset_memcpy(buf, s.begin, s.bufend - s.begin);
-        buf = offset_memcpy(buf, s.buffer, s.end - s.buffer);
+        unsigned long mask[1024 / (sizeof(unsigned long) * CHAR_BIT)] = { 0 };
+
+        mask[node / (sizeof(unsigned long) * CHAR_BIT)] |=
+            1UL << (node % (sizeof(unsigned long) * CHAR_BIT));
+
+        // Only a preference, so that a full node falls back to the others
+        // instead of failing the fault. If the kernel won't, the pages end up
+        // wherever.
+        syscall(SYS_mbind, buf, len, MPOL_PREFERRED,
+                mask, sizeof mask * CHAR_BIT, 0);
     }
-    else
+#endif
+
+    // Whatever mmap couldn't populate for us, we fault in by hand.
+    if(prefault)
     {
-        buf = offset_memcpy(buf, s.begin, s.end - s.begin);
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+
+        for(size_t i = 0; i < len; i += page)
+            ((volatile char*)buf)[i] = 0;
     }
 
     return buf;
 }
 
-// Resizes the buffer to make room for at least 'new_size' elements, returning
-// an updated snapshot of the pipe state.
-//
-// The new size MUST be bigger than the number of elements currently in the
-// pipe.
-//
-// The pipe must be fully locked on entrance to this function.
-static snapshot_t resize_buffer(pipe_t* p, size_t new_size)
+static void page_free(void* ctx, void* ptr, size_t size)
 {
-    check_invariants(p);
+    size_t len = page_mapping_length(PAGE_CTX_FLAGS(ctx), size);
 
-    const size_t max_cap   = p->max_cap,
-                 min_cap   = p->min_cap,
-                 elem_size = __pipe_elem_size(p);
-
-    assertume(new_size >= bytes_in_use(make_snapshot(p)));
-
-    if(unlikely(new_size >= max_cap))
-        new_size = max_cap;
-
-    if(new_size <= min_cap)
-        return make_snapshot(p);
-
-    char* new_buf = malloc(new_size + elem_size);
-    p->end = copy_pipe_into_new_buf(make_snapshot(p), new_buf);
-
-    p->begin  =
-    p->buffer = (free(p->buffer), new_buf);
+    if(len == 0)
+        free(ptr);
+    else
+        munmap(ptr, len);
+}
 
-    p->bufend = new_buf + new_size + elem_size;
+// The NUMA node the calling thread is running on, or -1 if we can't tell.
+static int current_numa_node(void)
+{
+#if HAVE_MBIND
+    unsigned cpu, node;
 
-    check_invariants(p);
+    if(syscall(SYS_getcpu, &cpu, &node, NULL) == 0)
+        return (int)node;
+#endif
 
-    return make_snapshot(p);
+    return -1;
 }
 
-static inline snapshot_t validate_size(pipe_t* p,
-                                       snapshot_t s,
-                                       size_t new_bytes)
+pipe_allocator_t pipe_page_allocator(unsigned flags)
 {
-    size_t elem_size    = __pipe_elem_size(p),
-           cap          = capacity(s),
-           bytes_needed = bytes_in_use(s) + new_bytes;
+    int node = (flags & PIPE_ALLOC_NUMA_LOCAL) ? current_numa_node() : -1;
 
-    if(unlikely(bytes_needed > cap))
-    {
-        // upgrade our lock, then re-check. By taking both locks (end and begin)
-        // in order, we have an equivalent operation to lock_pipe().
-        { mutex_lock(&p->begin_lock);
+    return (pipe_allocator_t) {
+        .alloc = page_alloc,
+        .free  = page_free,
+        .ctx   = (void*)(((uintptr_t)(node + 1) << 8) | (flags & 0xff)),
+    };
+}
 
-            s            = make_snapshot(p);
-            bytes_needed = bytes_in_use(s) + new_bytes;
-            size_t elems_needed = bytes_needed / elem_size;
+#else
 
-            if(likely(bytes_needed > cap))
-                s = resize_buffer(p, next_pow2(elems_needed)*elem_size);
-        }
+// Without mmap, there's nothing to do but malloc.
+pipe_allocator_t pipe_page_allocator(unsigned flags)
+{
+    (void)flags;
+    return default_allocator;
+}
 
-        // Unlock the pipe if requested.
-        mutex_unlock(&p->begin_lock);
-    }
+#endif /* HAVE_PAGE_ALLOCATOR */
 
-    return s;
+static inline void* alloc_bytes(pipe_t* p, size_t size)
+{
+    return p->allocator.alloc(p->allocator.ctx, size);
 }
 
-// Runs the actual push, assuming there is enough room in the buffer.
-//
-// Returns the new 'end' pointer.
-static inline char* process_push(snapshot_t s,
-                                const void* restrict elems,
-                                size_t bytes_to_copy
-                               )
+// Like free(), this does nothing with NULL.
+static inline void free_bytes(pipe_t* p, void* ptr, size_t size)
 {
-    assertume(bytes_to_copy != 0);
-
-    // This shouldn't be necessary.
-    //s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
-    assertume(s.end != s.bufend);
+    if(ptr)
+        p->allocator.free(p->allocator.ctx, ptr, size);
+}
 
-    // If we currently have a nowrap buffer, we may have to wrap the new
-    // elements. Copy as many as we can at the end, then start copying into the
-    // beginning. This basically reduces the problem to only deal with wrapped
-    // buffers, which can be dealt with using a single offset_memcpy.
-    if(!wraps_around(s))
+// Frees the buffer, however it was allocated.
+static void free_buffer(pipe_t* p)
+{
+    if(p->engine == ENGINE_SEGMENTED)
     {
-        size_t at_end = min(bytes_to_copy, (size_t)(s.bufend - s.end));
+        size_t chunk_bytes = sizeof(chunk_t) + p->chunk_size;
 
-        s.end = offset_memcpy(s.end, elems, at_end);
+        for(chunk_t* c = p->head, * next; c; c = next)
+            next = c->next, free_bytes(p, c, chunk_bytes);
 
-        elems = (const char*)elems + at_end;
-        bytes_to_copy -= at_end;
+        free_bytes(p, p->spare, chunk_bytes);
+        p->head = p->tail = p->spare = NULL;
+        return;
     }
 
-    // Now copy any remaining data...
-    if(unlikely(bytes_to_copy))
+#if HAVE_MIRRORING
+    if(p->mirror_fd >= 0)
     {
-        s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
-        s.end = offset_memcpy(s.end, elems, bytes_to_copy);
+        free_mirror(p->mirror_fd, p->buffer, p->bufend - p->buffer);
+        p->mirror_fd = -1;
+        return;
     }
+#endif
 
-    s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
-
-    // ...and update the end pointer!
-    return s.end;
+    if(p->buffer)
+        free_bytes(p, p->buffer, p->bufend - p->buffer);
 }
 
-// Will spin until there is enough room in the buffer to push any elements.
-// Returns the number of elements currently in the buffer. `end_lock` should be
-// locked on entrance to this function.
-static inline snapshot_t wait_for_room(pipe_t* p, size_t* max_cap)
+static inline void lock_pipe(pipe_t* p)
 {
-    snapshot_t s = make_snapshot(p);
+    // watch the locking order VERY carefully. end_lock must ALWAYS be locked
+    // before begin_lock when dealing with both at once.
+    mutex_lock(&p->end_lock);
+    mutex_lock(&p->begin_lock);
+    check_invariants(p);
+}
 
-    size_t bytes_used = bytes_in_use(s);
+static inline void unlock_pipe(pipe_t* p)
+{
+    check_invariants(p);
+    mutex_unlock(&p->begin_lock);
+    mutex_unlock(&p->end_lock);
+}
+
+// runs some code while automatically locking and unlocking the pipe. If `break'
+// is used, the pipe will be unlocked before control returns from the macro.
+#define WHILE_LOCKED(stuff) do { \
+    lock_pipe(p);                \
+    do { stuff; } while(0);      \
+    unlock_pipe(p);              \
+ } while(0)
+
+// Fills in a fresh locking pipe at `p', around `buf', which has room for
+// `min_cap' bytes of elements plus the sentinel.
+static void init_pipe(pipe_t* p,
+                      size_t elem_size,
+                      size_t min_cap,
+                      size_t max_cap,
+                      char*  buf,
+                      const pipe_allocator_t* allocator)
+{
+    *p = (pipe_t) {
+        .engine     = ENGINE_LOCKING,
+        .elem_size  = elem_size,
+        .allocator  = *allocator,
+
+        .wait_strategy = PIPE_WAIT_BLOCK,
+        .spins         = MUTEX_SPINS,
+        .policy        = DEFAULT_POLICY,
+        .min_cap = min_cap,
+        .max_cap = max_cap,
+
+        .buffer = buf,
+        .bufend = buf + min_cap + elem_size,
+        .begin  = buf,
+        .end    = buf + elem_size,
+
+        // Since we're issuing a pipe_t, it counts as both a producer and a
+        // consumer since it can issue new instances of both. Therefore, the
+        // refcounts both start at 1; not the intuitive 0.
+        .producer_refcount = 1,
+        .consumer_refcount = 1,
+        .handles           = 2,
+
+        .mirror_fd   = -1,
+        .readable_fd = -1,
+        .writable_fd = -1,
+    };
+
+    mutex_init(&p->begin_lock);
+    mutex_init(&p->end_lock);
+    mutex_init(&p->select_lock);
+
+    event_init(&p->just_pushed);
+    event_init(&p->just_popped);
+}
+
+pipe_t* pipe_new(size_t elem_size, size_t limit)
+{
+    return pipe_new_ex(elem_size, limit, NULL);
+}
+
+pipe_t* pipe_new_ex(size_t elem_size,
+                    size_t limit,
+                    const pipe_allocator_t* allocator)
+{
+    assertume(elem_size != 0);
+
+    if(elem_size == 0)
+        return NULL;
+
+    if(allocator == NULL)
+        allocator = &default_allocator;
+
+    assertume(allocator->alloc && allocator->free);
+
+    assert(DEFAULT_MINCAP >= 1);
+
+    // Allocate room for min_cap elements, plus the sentinel.
+    size_t cap = DEFAULT_MINCAP * elem_size;
+
+    pipe_t* p   = allocator->alloc(allocator->ctx, sizeof *p);
+    char*   buf = allocator->alloc(allocator->ctx, cap + elem_size);
+
+    if(unlikely(p == NULL || buf == NULL))
+    {
+        if(p)   allocator->free(allocator->ctx, p, sizeof *p);
+        if(buf) allocator->free(allocator->ctx, buf, cap + elem_size);
+
+        return NULL;
+    }
+
+    // Change the limit from being in "elements" to being in "bytes". It's
+    // rounded down to a whole number of elements, so that pushes are never cut
+    // off halfway through an element.
+    size_t max_cap = limit ? next_pow2(max(limit * elem_size, cap))
+                           : ~(size_t)0;
+
+    max_cap -= max_cap % elem_size;
+
+    init_pipe(p, elem_size, cap, max_cap, buf, allocator);
+
+    check_invariants(p);
+
+    return p;
+}
+
+pipe_t* pipe_new_spsc(size_t elem_size, size_t limit)
+{
+    assertume(limit != 0);
+
+    if(limit == 0)
+        return NULL;
+
+    pipe_t* p = pipe_new(elem_size, 0);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    // Allocate the whole ring now, plus the sentinel, since it will never be
+    // resized.
+    size_t cap = (limit + 1) * elem_size;
+    char*  buf = alloc_bytes(p, cap);
+
+    if(unlikely(buf == NULL))
+        return pipe_free(p), NULL;
+
+    free_buffer(p);
+
+    p->engine  = ENGINE_SPSC;
+    p->min_cap =
+    p->max_cap = cap;
+    p->buffer  =
+    p->begin   =
+    p->cached_begin = buf;
+    p->bufend  = buf + cap;
+    p->end     =
+    p->cached_end = buf + elem_size;
+
+    check_invariants(p);
+
+    return p;
+}
+
+pipe_t* pipe_new_mirrored(size_t elem_size, size_t limit)
+{
+    pipe_t* p = pipe_new(elem_size, limit);
+
+#if HAVE_MIRRORING
+    if(unlikely(p == NULL))
+        return NULL;
+
+    int    fd;
+    size_t len = mirror_length(p->min_cap + elem_size);
+    char*  buf = new_mirror(&fd, len);
+
+    // Without a mirror, this is still a perfectly good pipe.
+    if(unlikely(buf == NULL))
+        return p;
+
+    free_buffer(p);
+
+    p->mirror_fd = fd;
+    p->buffer    =
+    p->begin     = buf;
+    p->bufend    = buf + len;
+    p->end       = buf + elem_size;
+
+    check_invariants(p);
+#endif
+
+    return p;
+}
+
+// Each MPMC slot starts with its sequence number, followed by the element.
+#define SLOT_HEADER sizeof(size_t)
+
+pipe_t* pipe_new_mpmc(size_t elem_size, size_t limit)
+{
+    assertume(limit != 0);
+
+    if(limit == 0)
+        return NULL;
+
+    pipe_t* p = pipe_new(elem_size, 0);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    // Round the slots up so that every sequence number is aligned. We need at
+    // least two of them, or a full slot would look free for the next lap.
+    size_t slot_size = (SLOT_HEADER + elem_size + SLOT_HEADER - 1)
+                     / SLOT_HEADER * SLOT_HEADER,
+           slots     = next_pow2(max(limit, 2));
+
+    char* buf = alloc_bytes(p, slots * slot_size);
+
+    if(unlikely(buf == NULL))
+        return pipe_free(p), NULL;
+
+    free_buffer(p);
+
+    for(size_t i = 0; i < slots; ++i)
+        *(size_t*)(buf + i*slot_size) = i;
+
+    p->engine    = ENGINE_MPMC;
+    p->buffer    =
+    p->begin     =
+    p->end       = buf;
+    p->bufend    = buf + slots*slot_size;
+    p->slot_size = slot_size;
+    p->slot_mask = slots - 1;
+
+    check_invariants(p);
+
+    return p;
+}
+
+// The allocator only promises malloc's alignment, so the pool's buffers are
+// carved out of a block with enough slack to start them on a cache line.
+#define POOL_BLOCK_SIZE(count, stride) ((count) * (stride) + CACHE_LINE_SIZE - 1)
+
+pipe_t* pipe_new_pooled(size_t buf_size, size_t count)
+{
+    assertume(buf_size != 0 && count != 0);
+
+    if(buf_size == 0 || count == 0)
+        return NULL;
+
+    // Neighbouring buffers are usually being written and read by different
+    // threads, so keep them off each other's cache lines.
+    size_t stride = (buf_size + CACHE_LINE_SIZE - 1)
+                  / CACHE_LINE_SIZE * CACHE_LINE_SIZE;
+
+    // Neither pipe can ever hold more than all the buffers, so pushing into
+    // them never waits.
+    pipe_t* p   = pipe_new_mpmc(sizeof(void*), count),
+          * ret = pipe_new_mpmc(sizeof(void*), count);
+
+    pool_t* pool  = p ? alloc_bytes(p, sizeof *pool) : NULL;
+    char*   block = p ? alloc_bytes(p, POOL_BLOCK_SIZE(count, stride)) : NULL;
+
+    if(unlikely(ret == NULL || pool == NULL || block == NULL))
+    {
+        if(p)
+        {
+            free_bytes(p, block, POOL_BLOCK_SIZE(count, stride));
+            free_bytes(p, pool, sizeof *pool);
+            pipe_free(p);
+        }
+
+        if(ret)
+            pipe_free(ret);
+
+        return NULL;
+    }
+
+    char* buffers = block + (CACHE_LINE_SIZE - (uintptr_t)block % CACHE_LINE_SIZE)
+                          % CACHE_LINE_SIZE;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        void* buf = buffers + i*stride;
+        pipe_push((pipe_producer_t*)ret, &buf, 1);
+    }
+
+    *pool = (pool_t) {
+        .give    = pipe_producer_new(ret),
+        .take    = pipe_consumer_new(ret),
+        .buffers = buffers,
+        .block   = block,
+        .count   = count,
+        .stride  = stride,
+    };
+
+    pipe_free(ret);
+
+    p->pool = pool;
+
+    return p;
+}
+
+pipe_t* pipe_new_broadcast(size_t elem_size,
+                           size_t limit,
+                           pipe_broadcast_policy_t policy)
+{
+    assertume(limit != 0);
+
+    if(limit == 0)
+        return NULL;
+
+    pipe_t* p = pipe_new(elem_size, 0);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    size_t slots = next_pow2(limit);
+    char*  buf   = alloc_bytes(p, slots * elem_size);
+
+    if(unlikely(buf == NULL))
+        return pipe_free(p), NULL;
+
+    free_buffer(p);
+
+    p->engine    = ENGINE_BROADCAST;
+    p->buffer    =
+    p->begin     =
+    p->end       = buf;
+    p->bufend    = buf + slots*elem_size;
+    p->slot_mask = slots - 1;
+    p->drop_slow = policy == PIPE_BROADCAST_DROP;
+
+    return p;
+}
+
+// Makes a pipe that's a front for `count' locking pipes of up to `limit'
+// elements each, for priority and sharded pipes.
+static pipe_t* new_parted(size_t elem_size,
+                          size_t count,
+                          size_t limit,
+                          engine_t engine)
+{
+    assertume(count != 0);
+
+    if(count == 0)
+        return NULL;
+
+    pipe_t* p = pipe_new(elem_size, 0);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    pipe_t** parts = alloc_bytes(p, count * sizeof *parts);
+
+    if(unlikely(parts == NULL))
+        return pipe_free(p), NULL;
+
+    free_buffer(p);
+
+    p->engine = engine;
+    p->buffer =
+    p->bufend =
+    p->begin  =
+    p->end    = NULL;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        parts[i] = pipe_new_ex(elem_size, limit, &p->allocator);
+
+        if(unlikely(parts[i] == NULL))
+        {
+            while(i--)
+                pipe_free(parts[i]);
+
+            free_bytes(p, parts, count * sizeof *parts);
+
+            return pipe_free(p), NULL;
+        }
+    }
+
+    p->parts  = parts;
+    p->nparts = count;
+
+    return p;
+}
+
+pipe_t* pipe_new_priority(size_t elem_size,
+                          size_t levels,
+                          size_t limit,
+                          size_t quota)
+{
+    pipe_t* p = new_parted(elem_size, levels, limit, ENGINE_PRIORITY);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    p->quota = quota;
+
+    if(quota)
+    {
+        p->starved = alloc_bytes(p, levels * sizeof *p->starved);
+
+        if(unlikely(p->starved == NULL))
+            return pipe_free(p), NULL;
+
+        memset(p->starved, 0, levels * sizeof *p->starved);
+    }
+
+    return p;
+}
+
+pipe_t* pipe_new_sharded(size_t elem_size, size_t shards, size_t limit)
+{
+    return new_parted(elem_size, shards, limit, ENGINE_SHARDED);
+}
+
+// How big each chunk of a segmented pipe should be. Big enough that we rarely
+// have to go to malloc, small enough that a drained chunk isn't much of a
+// waste.
+#define CHUNK_BYTES (64*1024)
+
+pipe_t* pipe_new_segmented(size_t elem_size, size_t limit)
+{
+    pipe_t* p = pipe_new(elem_size, limit);
+
+    if(unlikely(p == NULL))
+        return NULL;
+
+    size_t   chunk_size = max(CHUNK_BYTES / elem_size, DEFAULT_MINCAP) * elem_size;
+    chunk_t* c          = alloc_bytes(p, sizeof *c + chunk_size);
+
+    if(unlikely(c == NULL))
+        return pipe_free(p), NULL;
+
+    free_buffer(p);
+
+    c->next = NULL;
+
+    p->engine     = ENGINE_SEGMENTED;
+    p->chunk_size = chunk_size;
+    p->buffer     =
+    p->bufend     = NULL;
+    p->head       =
+    p->tail       = c;
+    p->begin      =
+    p->end        = c->elems;
+
+    return p;
+}
+
+// Static pipes never allocate anything. Since this is only ever called to grow
+// the buffer, which static pipes don't do, NULL won't come up.
+
+static void* no_alloc(void* ctx, size_t size)
+{
+    (void)ctx; (void)size;
+    return NULL;
+}
+
+static void no_free(void* ctx, void* ptr, size_t size)
+{
+    (void)ctx; (void)ptr; (void)size;
+}
+
+static const pipe_allocator_t no_allocator = {
+    .alloc = no_alloc,
+    .free  = no_free,
+};
+
+#if defined(_WIN32) || defined(_WIN64)
+#define lock_memory(ptr, len)   (VirtualLock((ptr), (len)) != 0)
+#define unlock_memory(ptr, len) VirtualUnlock((ptr), (len))
+#elif defined(__linux__)
+#define lock_memory(ptr, len)   (mlock((ptr), (len)) == 0)
+#define unlock_memory(ptr, len) munlock((ptr), (len))
+#else
+#define lock_memory(ptr, len)   ((void)(ptr), (void)(len), false)
+#endif
+
+// A static pipe's pipe_t goes at the front of the caller's buffer, and the
+// elements right after it. Each starts on a cache line of its own.
+#define STATIC_HEADER ((sizeof(pipe_t) + CACHE_LINE_SIZE - 1) \
+                       / CACHE_LINE_SIZE * CACHE_LINE_SIZE)
+
+size_t pipe_static_size(size_t elem_size, size_t count)
+{
+    // The sentinel, and the worst case for lining up the pipe_t, come extra.
+    return CACHE_LINE_SIZE - 1 + STATIC_HEADER + (count + 1) * elem_size;
+}
+
+pipe_t* pipe_new_static(size_t elem_size,
+                        void* buf,
+                        size_t buf_bytes,
+                        unsigned flags)
+{
+    assertume(elem_size != 0);
+    assertume(buf != NULL);
+
+    if(elem_size == 0 || buf == NULL)
+        return NULL;
+
+    size_t skip = (CACHE_LINE_SIZE - (uintptr_t)buf % CACHE_LINE_SIZE)
+                % CACHE_LINE_SIZE;
+
+    // We need room for at least one element, plus the sentinel.
+    if(buf_bytes < skip + STATIC_HEADER + 2*elem_size)
+        return NULL;
+
+    char*  base  = (char*)buf + skip;
+    char*  elems = base + STATIC_HEADER;
+    size_t cap   = ((buf_bytes - skip - STATIC_HEADER) / elem_size - 1)
+                 * elem_size;
+
+    if(flags & PIPE_STATIC_MLOCK)
+    {
+        if(!lock_memory(base, STATIC_HEADER + cap + elem_size))
+            return NULL;
+    }
+
+    pipe_t* p = (pipe_t*)base;
+
+    init_pipe(p, elem_size, cap, cap, elems, &no_allocator);
+
+    p->fixed   = true;
+    p->mlocked = (flags & PIPE_STATIC_MLOCK) != 0;
+
+    check_invariants(p);
+
+    return p;
+}
+
+// Instead of allocating a special handle, the pipe_*_new() functions just
+// return the original pipe, cast into a user-friendly form. This saves needless
+// malloc calls. Also, since we have to refcount anyways, it's free.
+// Counts in a new producer, and picks its shard if the pipe is sharded.
+static size_t add_producer(pipe_t* p)
+{
+    size_t shard = 0;
+
+    fetch_add(&p->handles, 1);
+
+    mutex_lock(&p->begin_lock);
+        p->producer_refcount++;
+
+        if(p->engine == ENGINE_SHARDED)
+        {
+            shard = p->next_shard;
+            p->next_shard = (shard + 1) % p->nparts;
+        }
+    mutex_unlock(&p->begin_lock);
+
+    return shard;
+}
+
+pipe_producer_t* pipe_producer_new(pipe_t* p)
+{
+    if(p->engine != ENGINE_SHARDED)
+    {
+        add_producer(p);
+        return (pipe_producer_t*)p;
+    }
+
+    shard_producer_t* h = alloc_bytes(p, sizeof *h);
+
+    if(unlikely(h == NULL))
+        return NULL;
+
+    *h = (shard_producer_t) {
+        .engine = ENGINE_SHARD_PRODUCER,
+        .pipe   = p,
+        .shard  = add_producer(p),
+    };
+
+    return (pipe_producer_t*)h;
+}
+
+// How many elements a buffered handle batches up if it isn't told.
+#define DEFAULT_BATCH 64
+
+pipe_producer_t* pipe_producer_new_buffered(pipe_t* p,
+                                            size_t batch,
+                                            unsigned flush_age_ms)
+{
+    size_t capacity = (batch ? batch : DEFAULT_BATCH) * __pipe_elem_size(p);
+
+    buffered_producer_t* h = alloc_bytes(p, sizeof *h + capacity);
+
+    if(unlikely(h == NULL))
+        return NULL;
+
+    *h = (buffered_producer_t) {
+        .engine       = ENGINE_BUFFERED_PRODUCER,
+        .pipe         = p,
+        .capacity     = capacity,
+        .flush_age_ms = flush_age_ms,
+        .shard        = add_producer(p),
+    };
+
+    return (pipe_producer_t*)h;
+}
+
+pipe_consumer_t* pipe_consumer_new(pipe_t* p)
+{
+    broadcast_consumer_t* c = NULL;
+
+    if(p->engine == ENGINE_BROADCAST)
+    {
+        c = alloc_bytes(p, sizeof *c);
+
+        if(unlikely(c == NULL))
+            return NULL;
+
+        *c = (broadcast_consumer_t) {
+            .engine = ENGINE_BROADCAST_CONSUMER,
+            .pipe   = p,
+        };
+    }
+
+    fetch_add(&p->handles, 1);
+
+    mutex_lock(&p->end_lock);
+        p->consumer_refcount++;
+
+        // New consumers start with the next push. Holding end_lock keeps any
+        // from happening until we're on the list, so the producers can't
+        // overwrite anything we haven't read.
+        if(c)
+        {
+            c->pos = load_relaxed(&p->enqueue_pos);
+
+            mutex_lock(&p->begin_lock);
+                c->next    = p->cursors;
+                p->cursors = c;
+            mutex_unlock(&p->begin_lock);
+        }
+    mutex_unlock(&p->end_lock);
+
+    return c ? (pipe_consumer_t*)c : (pipe_consumer_t*)p;
+}
+
+int pipe_consumer_dropped(pipe_consumer_t* handle)
+{
+    broadcast_consumer_t* c = as_broadcast_consumer(handle);
+    return c && c->dropped;
+}
+
+// How many elements a buffered consumer prefetches if it isn't told.
+#define DEFAULT_BUDGET 64
+
+pipe_consumer_t* pipe_consumer_new_buffered(pipe_t* p, size_t budget)
+{
+    size_t capacity = (budget ? budget : DEFAULT_BUDGET) * __pipe_elem_size(p);
+
+    assertume(p->engine != ENGINE_BROADCAST
+           && "Broadcast pipes can't have buffered consumers.");
+
+    buffered_consumer_t* c = alloc_bytes(p, sizeof *c + capacity);
+
+    if(unlikely(c == NULL))
+        return NULL;
+
+    *c = (buffered_consumer_t) {
+        .engine   = ENGINE_BUFFERED_CONSUMER,
+        .pipe     = p,
+        .capacity = capacity,
+    };
+
+    fetch_add(&p->handles, 1);
+
+    mutex_lock(&p->end_lock);
+        p->consumer_refcount++;
+    mutex_unlock(&p->end_lock);
+
+    return (pipe_consumer_t*)c;
+}
+
+// Wakes every pipe_select call waiting on `p'. The lock keeps them from
+// returning, and taking their events with them, while we're at it.
+static void wake_selectors(pipe_t* p)
+{
+    mutex_lock(&p->select_lock);
+        for(selector_t* s = p->selectors; s; s = s->next)
+            event_notify(s->ev, EVENT_ALL);
+    mutex_unlock(&p->select_lock);
+}
+
+// Makes `fd' readable, unless it already has been since the last rearm_fd.
+static void signal_fd(int fd, size_t* signaled)
+{
+#if HAVE_EVENTFD
+    size_t   expected = 0;
+    uint64_t one      = 1;
+
+    while(expected == 0 && !compare_and_swap(signaled, &expected, 1))
+        ;
+
+    // This only fails if the counter would overflow, which takes 2^64 - 1
+    // writes without a read.
+    if(expected == 0)
+    {
+        ssize_t written = write(fd, &one, sizeof one);
+        (void)written;
+    }
+#else
+    (void)fd; (void)signaled;
+#endif
+}
+
+// Notifies just_pushed, and anybody selecting on the pipe or polling its
+// readable_fd. The fence pairs with the one in pipe_select's event_prepare, and
+// the one in rearm_fd: either we see them waiting, or they see what we pushed.
+// They go first, since a consumer woken up through just_pushed may free the
+// pipe before we get to look at it again.
+static inline void notify_pushed(pipe_t* p, size_t count)
+{
+    full_fence();
+
+    if(unlikely(load_relaxed(&p->selectors) != NULL))
+        wake_selectors(p);
+
+    if(unlikely(load_relaxed(&p->readable_fd) >= 0))
+        signal_fd(p->readable_fd, &p->readable_signaled);
+
+    event_wake(&p->just_pushed, count);
+}
+
+// The same for just_popped and writable_fd.
+static inline void notify_popped(pipe_t* p, size_t count)
+{
+    full_fence();
+
+    if(unlikely(load_relaxed(&p->writable_fd) >= 0))
+        signal_fd(p->writable_fd, &p->writable_signaled);
+
+    event_wake(&p->just_popped, count);
+}
+
+static void deallocate(pipe_t* p)
+{
+    assertume(p->producer_refcount == 0);
+    assertume(p->consumer_refcount == 0);
+
+    mutex_destroy(&p->begin_lock);
+    mutex_destroy(&p->end_lock);
+    mutex_destroy(&p->select_lock);
+
+#if HAVE_EVENTFD
+    if(p->readable_fd >= 0)
+        close(p->readable_fd);
+
+    if(p->writable_fd >= 0)
+        close(p->writable_fd);
+#endif
+
+    event_destroy(&p->just_pushed);
+    event_destroy(&p->just_popped);
+
+#ifdef unlock_memory
+    if(p->mlocked)
+        unlock_memory(p, p->bufend - (char*)p);
+#endif
+
+    if(p->pool)
+    {
+        pipe_consumer_free(p->pool->take);
+        free_bytes(p, p->pool->block,
+                   POOL_BLOCK_SIZE(p->pool->count, p->pool->stride));
+        free_bytes(p, p->pool, sizeof *p->pool);
+    }
+
+    if(p->starved)
+        free_bytes(p, p->starved, p->nparts * sizeof *p->starved);
+
+    free_bytes(p, p->parts, p->nparts * sizeof *p->parts);
+
+    free_buffer(p);
+    free_bytes(p, p, sizeof *p);
+}
+
+// Drops `count' references to the pipe, once we're done touching it. If they
+// were the last ones, both sides are long gone, and we can free the pipe.
+static inline void release_handles(pipe_t* p, size_t count)
+{
+    if(fetch_sub(&p->handles, count) == count)
+        deallocate(p);
+}
+
+// Called once the last consumer is gone. With nobody left to release them,
+// no more buffers will come back, so the producers may as well stop waiting.
+// A priority or sharded pipe's parts lose their consumer too.
+static void consumers_gone(pipe_t* p)
+{
+    if(p->pool)
+        pipe_producer_free(p->pool->give);
+
+    for(size_t i = 0; i < p->nparts; ++i)
+        pipe_consumer_free((pipe_consumer_t*)p->parts[i]);
+}
+
+// Called once the last producer is gone, so that a priority or sharded pipe's
+// parts lose their producer too.
+static void producers_gone(pipe_t* p)
+{
+    for(size_t i = 0; i < p->nparts; ++i)
+        pipe_producer_free((pipe_producer_t*)p->parts[i]);
+}
+
+void pipe_free(pipe_t* p)
+{
+    size_t new_producer_refcount,
+           new_consumer_refcount;
+
+    mutex_lock(&p->begin_lock);
+        assertume(p->producer_refcount > 0);
+        new_producer_refcount = p->producer_refcount - 1;
+        store_release(&p->producer_refcount, new_producer_refcount);
+    mutex_unlock(&p->begin_lock);
+
+    mutex_lock(&p->end_lock);
+        assertume(p->consumer_refcount > 0);
+        new_consumer_refcount = p->consumer_refcount - 1;
+        store_release(&p->consumer_refcount, new_consumer_refcount);
+    mutex_unlock(&p->end_lock);
+
+    if(unlikely(new_consumer_refcount == 0))
+    {
+        // Lock-free producers don't take end_lock to push, so the buffer has
+        // to stay around until they're all gone.
+        if(p->engine == ENGINE_LOCKING)
+            p->buffer = (free_buffer(p), NULL);
+
+        consumers_gone(p);
+
+        if(likely(new_producer_refcount > 0))
+            notify_popped(p, EVENT_ALL);
+        else
+            producers_gone(p);
+    }
+    else if(unlikely(new_producer_refcount == 0))
+    {
+        producers_gone(p);
+        notify_pushed(p, EVENT_ALL);
+    }
+
+    release_handles(p, 2);
+}
+
+static bool flush_pending(buffered_producer_t* h,
+                          const struct timespec* deadline,
+                          bool block);
+
+void pipe_producer_free(pipe_producer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t new_producer_refcount;
+
+    buffered_producer_t* h = as_buffered_producer(handle);
+    shard_producer_t*    s = as_shard_producer(handle);
+
+    // A buffered handle gets everything it was holding on to out first. The
+    // pipe can't go away until we've dropped our reference below.
+    if(h)
+    {
+        flush_pending(h, NULL, true);
+        free_bytes(p, h, sizeof *h + h->capacity);
+    }
+
+    if(s)
+        free_bytes(p, s, sizeof *s);
+
+    mutex_lock(&p->begin_lock);
+        assertume(p->producer_refcount > 0);
+        new_producer_refcount = p->producer_refcount - 1;
+        store_release(&p->producer_refcount, new_producer_refcount);
+    mutex_unlock(&p->begin_lock);
+
+    if(unlikely(new_producer_refcount == 0))
+    {
+        size_t consumer_refcount;
+
+        producers_gone(p);
+
+        mutex_lock(&p->end_lock);
+            consumer_refcount = p->consumer_refcount;
+        mutex_unlock(&p->end_lock);
+
+        // If there are still consumers, wake them up if they're waiting on
+        // input from a producer.
+        if(likely(consumer_refcount > 0))
+            notify_pushed(p, EVENT_ALL);
+    }
+
+    release_handles(p, 1);
+}
+
+void pipe_consumer_free(pipe_consumer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    size_t new_consumer_refcount;
+
+    // Both of these look at the handle, so they have to come before either
+    // one frees it.
+    buffered_consumer_t*  c = as_buffered_consumer(handle);
+    broadcast_consumer_t* b = as_broadcast_consumer(handle);
+
+    // Whatever a buffered handle still has cached is gone for good. It was
+    // already popped, so nobody else could have had it anyway.
+    if(c)
+        free_bytes(p, c, sizeof *c + c->capacity);
+
+    // A broadcast handle takes its cursor out of the running, which may be
+    // what the producers were waiting on.
+    if(b)
+    {
+        mutex_lock(&p->begin_lock);
+            broadcast_consumer_t** link = &p->cursors;
+
+            while(*link != b)
+                link = &(*link)->next;
+
+            *link = b->next;
+        mutex_unlock(&p->begin_lock);
+
+        free_bytes(p, b, sizeof *b);
+        notify_popped(p, EVENT_ALL);
+    }
+
+    mutex_lock(&p->end_lock);
+        new_consumer_refcount = p->consumer_refcount - 1;
+        store_release(&p->consumer_refcount, new_consumer_refcount);
+    mutex_unlock(&p->end_lock);
+
+    if(unlikely(new_consumer_refcount == 0))
+    {
+        size_t producer_refcount;
+
+        consumers_gone(p);
+
+        mutex_lock(&p->begin_lock);
+            producer_refcount = p->producer_refcount;
+        mutex_unlock(&p->begin_lock);
+
+        // If there are still producers, wake them up if they're waiting on
+        // room to free up from a consumer.
+        if(likely(producer_refcount > 0))
+            notify_popped(p, EVENT_ALL);
+    }
+
+    release_handles(p, 1);
+}
+
+// Returns the end of the buffer (buf + number_of_bytes_copied).
+static inline char* copy_pipe_into_new_buf(snapshot_t s,
+                                           char* restrict buf)
+{
+    if(wraps_around(s))
+    {
+        buf = offset_memcpy(buf, s.begin, s.bufend - s.begin);
+        buf = offset_memcpy(buf, s.buffer, s.end - s.buffer);
+    }
+    else
+    {
+        buf = offset_memcpy(buf, s.begin, s.end - s.begin);
+    }
+
+    return buf;
+}
+
+// Resizes the buffer to make room for at least 'new_size' elements, returning
+// an updated snapshot of the pipe state.
+//
+// The new size MUST be bigger than the number of elements currently in the
+// pipe.
+//
+// The pipe must be fully locked on entrance to this function.
+static snapshot_t resize_buffer(pipe_t* p, size_t new_size)
+{
+    check_invariants(p);
+
+    // There's nothing to resize into.
+    if(p->fixed)
+        return make_snapshot(p);
+
+    const size_t max_cap   = p->max_cap,
+                 min_cap   = p->min_cap,
+                 elem_size = __pipe_elem_size(p);
+
+    assertume(new_size >= bytes_in_use(make_snapshot(p)));
+
+    // Consumers are still reading straight out of the buffer.
+    assertume(p->peeked == 0);
+
+    if(unlikely(new_size >= max_cap))
+        new_size = max_cap;
+
+    // Shrinking any further would just end up growing again.
+    if(new_size < min_cap)
+        new_size = min_cap;
+
+    if(new_size == capacity(make_snapshot(p)))
+        return make_snapshot(p);
+
+    if(p->policy.shrink_delay_ms)
+        p->last_resize = now_ms();
+
+#if HAVE_MIRRORING
+    if(p->mirror_fd >= 0)
+    {
+        resize_mirror(p, new_size);
+        check_invariants(p);
+        return make_snapshot(p);
+    }
+#endif
+
+    snapshot_t s        = make_snapshot(p);
+    size_t     old_len  = s.bufend - s.buffer,
+               new_len  = new_size + elem_size;
+    bool       growing  = new_size > capacity(s);
+
+    // If the elements don't wrap around, growing leaves them right where they
+    // are, so the allocator gets a chance to do it in place.
+    if(growing && !wraps_around(s) && p->allocator.realloc)
+    {
+        char* new_buf = p->allocator.realloc(p->allocator.ctx,
+                                             s.buffer, old_len, new_len);
+
+        if(unlikely(new_buf == NULL))
+            abort(); // same as running out of memory below
+
+        p->buffer = new_buf;
+        p->begin  = new_buf + (s.begin - s.buffer);
+        p->end    = new_buf + (s.end   - s.buffer);
+        p->bufend = new_buf + new_len;
+
+        check_invariants(p);
+
+        return make_snapshot(p);
+    }
+
+    char* new_buf = alloc_bytes(p, new_len);
+
+    // We can live without shrinking, but not without growing. The pushes
+    // waiting on us have nowhere else to put their elements.
+    if(unlikely(new_buf == NULL))
+    {
+        if(growing)
+            abort();
+
+        return s;
+    }
+
+    p->end = copy_pipe_into_new_buf(s, new_buf);
+
+    p->begin  =
+    p->buffer = (free_bytes(p, s.buffer, old_len), new_buf);
+
+    p->bufend = new_buf + new_len;
+
+    check_invariants(p);
+
+    return make_snapshot(p);
+}
+
+// How big the buffer should get, growing from `cap' bytes, to fit `needed'
+// bytes. With the default policy, this is the next power of two. The pipe must
+// be fully locked.
+static size_t grown_size(pipe_t* p, size_t cap, size_t needed)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           percent   = p->policy.growth_percent;
+
+    if(percent == 100)
+        return next_pow2(needed / elem_size) * elem_size;
+
+    while(cap < needed)
+    {
+        size_t step = cap / 100 * percent + cap % 100 * percent / 100;
+
+        // Always grow by at least one element, and don't overflow. Past
+        // max_cap, resize_buffer will clamp it anyway.
+        step = max(step - step % elem_size, elem_size);
+
+        if(step > p->max_cap - cap)
+            return p->max_cap;
+
+        cap += step;
+    }
+
+    return cap;
+}
+
+// Grows the buffer so that `new_bytes' more bytes fit, if they don't already.
+// `end_lock' should be locked on entrance to this function. If `block' is
+// false and the consumers are busy, we make do with the room we've already got.
+static inline snapshot_t validate_size(pipe_t* p,
+                                       snapshot_t s,
+                                       size_t new_bytes,
+                                       bool block)
+{
+    size_t cap          = capacity(s),
+           bytes_needed = bytes_in_use(s) + new_bytes;
+
+    if(unlikely(bytes_needed > cap))
+    {
+        // upgrade our lock, then re-check. By taking both locks (end and begin)
+        // in order, we have an equivalent operation to lock_pipe().
+        if(block)
+            mutex_lock(&p->begin_lock);
+        else if(!mutex_trylock(&p->begin_lock))
+            return s;
+
+        s            = make_snapshot(p);
+        bytes_needed = bytes_in_use(s) + new_bytes;
+
+        if(likely(bytes_needed > cap))
+            s = resize_buffer(p, grown_size(p, cap, bytes_needed));
+
+        // Unlock the pipe if requested.
+        mutex_unlock(&p->begin_lock);
+    }
+
+    return s;
+}
+
+// Runs the actual push, assuming there is enough room in the buffer.
+//
+// Returns the new 'end' pointer.
+static inline char* process_push(snapshot_t s,
+                                const void* restrict elems,
+                                size_t bytes_to_copy
+                               )
+{
+    assertume(bytes_to_copy != 0);
+
+    // This shouldn't be necessary.
+    //s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+    assertume(s.end != s.bufend);
+
+    // Past bufend is just the start of the buffer again.
+    if(s.mirrored)
+        return wrap_ptr_if_necessary(s.buffer,
+                                     offset_memcpy(s.end, elems, bytes_to_copy),
+                                     s.bufend);
+
+    // If we currently have a nowrap buffer, we may have to wrap the new
+    // elements. Copy as many as we can at the end, then start copying into the
+    // beginning. This basically reduces the problem to only deal with wrapped
+    // buffers, which can be dealt with using a single offset_memcpy.
+    if(!wraps_around(s))
+    {
+        size_t at_end = min(bytes_to_copy, (size_t)(s.bufend - s.end));
+
+        s.end = offset_memcpy(s.end, elems, at_end);
+
+        elems = (const char*)elems + at_end;
+        bytes_to_copy -= at_end;
+    }
+
+    // Now copy any remaining data...
+    if(unlikely(bytes_to_copy))
+    {
+        s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+        s.end = offset_memcpy(s.end, elems, bytes_to_copy);
+    }
+
+    s.end = wrap_ptr_if_necessary(s.buffer, s.end, s.bufend);
+
+    // ...and update the end pointer!
+    return s.end;
+}
+
+// Why spin_until stopped spinning.
+typedef enum {
+    SPUN_READY,     // `ready' came true, or the other side left.
+    SPUN_OUT,       // We ran out of spins, and should go to sleep.
+    SPUN_TIMED_OUT, // The deadline passed.
+} spin_result_t;
+
+// Waits for `ready' to come true, or for `other_refcount' to drop to zero,
+// without going to sleep, for as long as the pipe's wait strategy allows. No
+// locks should be held, since the other side may need them to make progress.
+static spin_result_t spin_until(pipe_t* p,
+                                bool (*ready)(pipe_t*),
+                                const size_t* other_refcount,
+                                const struct timespec* deadline)
+{
+    pipe_wait_strategy_t strategy = p->wait_strategy;
+    size_t               spins    = p->spins;
+
+    for(size_t i = 0;; ++i)
+    {
+        if(ready(p) || load_relaxed(other_refcount) == 0)
+            return SPUN_READY;
+
+        if(strategy == PIPE_WAIT_SPIN_THEN_BLOCK && i == spins)
+            return SPUN_OUT;
+
+        if(deadline && deadline_passed(deadline))
+            return SPUN_TIMED_OUT;
+
+        if(strategy == PIPE_WAIT_YIELD)
+            thread_yield();
+        else
+            cpu_relax();
+    }
+}
+
+// Snapshots the pipe without taking any locks, for spinning on. If the buffer
+// is being resized, the result is garbage, so it's only good as a hint.
+static inline snapshot_t racy_snapshot(pipe_t* p)
+{
+    return (snapshot_t) {
+        .buffer = load_relaxed(&p->buffer),
+        .bufend = load_relaxed(&p->bufend),
+        .begin  = load_relaxed(&p->begin),
+        .end    = load_relaxed(&p->end),
+        .elem_size = __pipe_elem_size(p),
+    };
+}
+
+static bool has_room(pipe_t* p)
+{
+    return bytes_in_use(racy_snapshot(p)) < load_relaxed(&p->max_cap);
+}
+
+static bool has_elements(pipe_t* p)
+{
+    return bytes_in_use(racy_snapshot(p)) > 0;
+}
+
+// Waits on `ev' until `ready' comes true, the other side leaves, or `deadline'
+// passes, in whichever way the pipe's wait strategy says to. `lock' must be
+// locked on entrance, and will be locked again on exit, but is dropped in
+// between. `other_refcount' must be guarded by `lock'. Returns false if the
+// deadline passed.
+static bool wait_on(pipe_t* p,
+                    bool (*ready)(pipe_t*),
+                    mutex_t* lock,
+                    event_t* ev,
+                    const size_t* other_refcount,
+                    const struct timespec* deadline)
+{
+    if(p->wait_strategy != PIPE_WAIT_BLOCK)
+    {
+        // Spinning with the lock held would keep the other side from leaving.
+        mutex_unlock(lock);
+        spin_result_t spun = spin_until(p, ready, other_refcount, deadline);
+        mutex_lock(lock);
+
+        if(spun != SPUN_OUT)
+            return spun == SPUN_READY;
+    }
+
+    // Nobody can resize the buffer while we hold `lock', so `ready' is
+    // reliable here, and anything that happens after it is checked will bump
+    // the key.
+    unsigned key = event_prepare(ev);
+
+    if(ready(p) || *other_refcount == 0)
+    {
+        event_cancel(ev);
+        return true;
+    }
+
+    mutex_unlock(lock);
+    bool woken = event_wait(ev, key, deadline);
+    mutex_lock(lock);
+
+    return woken;
+}
+
+// Will spin until there is enough room in the buffer to push any elements, or
+// until `deadline' (if there is one). Returns the number of elements currently
+// in the buffer. `end_lock` should be locked on entrance to this function.
+static inline snapshot_t wait_for_room(pipe_t* p,
+                                       size_t* max_cap,
+                                       const struct timespec* deadline)
+{
+    snapshot_t s = make_snapshot(p);
+
+    size_t bytes_used = bytes_in_use(s);
+
+    size_t consumer_refcount = p->consumer_refcount;
+
+    *max_cap = p->max_cap;
+
+    for(bool woken = true;
+        woken && unlikely(bytes_used == *max_cap) && likely(consumer_refcount > 0);
+          s                 = make_snapshot(p),
+          bytes_used        = bytes_in_use(s),
+          consumer_refcount = p->consumer_refcount,
+          *max_cap          = p->max_cap)
+        woken = wait_on(p, has_room, &p->end_lock, &p->just_popped,
+                        &p->consumer_refcount, deadline);
+
+    return s;
+}
+
+// Keeps track of the most bytes the pipe has held, if the policy cares.
+// `end_lock' must be held.
+static inline void note_high_water(pipe_t* p, size_t bytes)
+{
+    if(unlikely(p->policy.high_water_ms) && bytes > p->high_water)
+        store_relaxed(&p->high_water, bytes);
+}
+
+// Pushes as many of the `count' bytes as fit in one go, waiting for room if
+// there is none. Returns the number of bytes pushed, which is 0 if all the
+// consumers left or `deadline' passed first. Nobody is notified; that's up to
+// the caller.
+static size_t push_some(pipe_t* p,
+                        const void* restrict elems,
+                        size_t count,
+                        const struct timespec* deadline)
+{
+    size_t pushed = 0;
+
+    { mutex_lock(&p->end_lock);
+        size_t max_cap;
+        snapshot_t s = wait_for_room(p, &max_cap, deadline);
+
+        // if no more consumers, or we ran out of time...
+        if(unlikely(p->consumer_refcount == 0 || bytes_in_use(s) == max_cap))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        s = validate_size(p, s, count, true);
+
+        // Finally, we can now begin with pushing as many elements into the
+        // queue as possible.
+        p->end = process_push(s, elems,
+                     pushed = min(count, max_cap - bytes_in_use(s)));
+
+        note_high_water(p, bytes_in_use(s) + pushed);
+    } mutex_unlock(&p->end_lock);
+
+    assertume(pushed > 0);
+
+    return pushed;
+}
+
+// Returns the number of bytes pushed, which is less than `count' if all the
+// consumers leave or `deadline' passes first.
+static size_t __pipe_push(pipe_t* p,
+                          const void* restrict elems,
+                          size_t count,
+                          const struct timespec* deadline)
+{
+    if(unlikely(count == 0))
+        return 0;
+
+    size_t pushed = push_some(p, elems, count, deadline);
+
+    if(unlikely(pushed == 0))
+        return 0;
+
+    // Wake up as many consumers as we've given elements to.
+    notify_pushed(p, pushed / __pipe_elem_size(p));
+
+    // We might not be done pushing. If the max_cap was reached, we'll need to
+    // recurse.
+    size_t bytes_remaining = count - pushed;
+
+    if(unlikely(bytes_remaining))
+        pushed += __pipe_push(p, (const char*)elems + pushed, bytes_remaining,
+                              deadline);
+
+    return pushed;
+}
+
+// The non-blocking version of __pipe_push. Returns the number of bytes pushed,
+// or PIPE_WOULD_BLOCK if the pipe is full or another producer has the lock.
+static size_t __pipe_try_push(pipe_t* p,
+                              const void* restrict elems,
+                              size_t count)
+{
+    size_t elem_size = __pipe_elem_size(p);
+    size_t pushed;
+
+    if(!mutex_trylock(&p->end_lock))
+        return PIPE_WOULD_BLOCK;
+
+    { snapshot_t s = make_snapshot(p);
+
+        if(unlikely(p->consumer_refcount == 0))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        if(unlikely(bytes_in_use(s) == p->max_cap))
+        {
+            mutex_unlock(&p->end_lock);
+            return PIPE_WOULD_BLOCK;
+        }
+
+        // If the consumers have the buffer, this might not grow it, so we can
+        // only push as much as currently fits. The buffer may also be bigger
+        // than the limit (mirrored ones are whole pages), so that caps it too.
+        s      = validate_size(p, s, count, false);
+        pushed = min(count, min(capacity(s), p->max_cap) - bytes_in_use(s));
+
+        if(unlikely(pushed == 0))
+        {
+            mutex_unlock(&p->end_lock);
+            return PIPE_WOULD_BLOCK;
+        }
+
+        p->end = process_push(s, elems, pushed);
+
+        note_high_water(p, bytes_in_use(s) + pushed);
+    } mutex_unlock(&p->end_lock);
+
+    notify_pushed(p, pushed / elem_size);
+
+    return pushed;
+}
+
+/*
+#ifdef PIPE_DEBUG
+// For testing/debugging only, and is only available in debug mode. Assuming a
+// pipe of ints, prints them out. This function is not included or documented
+// in the header file!
+
+#include <stdio.h>
+
+void pipe_debug(pipe_t* p, const char* id)
+{
+    printf("%s: [ ", id);
+    for(int* ptr = (int*)p->buffer; ptr != (int*)p->bufend; ++ptr)
+        printf("%i ", *ptr);
+    printf("]\n");
+    printf("begin: %lu    end: %lu\n", p->begin - p->buffer, p->end - p->buffer);
+}
+#endif
+*/
+
+// Waits for at least one element to be in the pipe, or until `deadline' (if
+// there is one). p->begin_lock must be locked when entering this function, and
+// a new, valid snapshot is returned.
+static inline snapshot_t wait_for_elements(pipe_t* p,
+                                           const struct timespec* deadline)
+{
+    snapshot_t s = make_snapshot(p);
+
+    size_t bytes_used = bytes_in_use(s);
+
+    for(bool woken = true;
+        woken && unlikely(bytes_used == 0) && likely(p->producer_refcount > 0);
+          s = make_snapshot(p),
+          bytes_used = bytes_in_use(s))
+        woken = wait_on(p, has_elements, &p->begin_lock, &p->just_pushed,
+                        &p->producer_refcount, deadline);
+
+    return s;
+}
+
+// wow, I didn't even intend for the name to work like that...
+// returns a new snapshot, with the updated changes also reflected onto the
+// pipe.
+static inline snapshot_t pop_without_locking(snapshot_t s,
+                                             void* restrict target,
+                                             size_t bytes_to_copy,
+                                             char** begin // [out]
+                                            )
+{
+    assertume(s.begin != s.bufend);
+
+    size_t elem_size = s.elem_size;
+
+    // Past bufend is just the start of the buffer again. The first element
+    // may even start there, if the sentinel straddles bufend.
+    if(s.mirrored)
+    {
+        memcpy(target, s.begin + elem_size, bytes_to_copy);
+
+        *begin = s.begin = wrap_ptr_if_necessary(s.buffer,
+                                                 s.begin + bytes_to_copy,
+                                                 s.bufend);
+        return s;
+    }
+
+    // Copy either as many bytes as requested, or the available bytes in the RHS
+    // of a wrapped buffer - whichever is smaller.
+    {
+        size_t first_bytes_to_copy = min(bytes_to_copy, (size_t)(s.bufend - s.begin - elem_size));
+
+        target = offset_memcpy(target, s.begin + elem_size, first_bytes_to_copy);
+
+        bytes_to_copy -= first_bytes_to_copy;
+
+        s.begin       += first_bytes_to_copy;
+        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    }
+
+    if(unlikely(bytes_to_copy > 0))
+    {
+        s.begin += elem_size;
+        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+
+        memcpy(target, s.begin, bytes_to_copy);
+
+        s.begin += bytes_to_copy;
+        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+
+        s.begin -= elem_size;
+        s.begin = rev_wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    }
+
+    // Since we cached begin on the stack, we need to reflect our changes back
+    // on the pipe.
+    *begin = s.begin;
+
+    return s;
+}
+
+// If the buffer is shrunk to something a lot smaller than our current
+// capacity, resize it to something sane. This function must be entered with
+// only p->begin_lock locked, and will automatically unlock p->begin_lock on
+// exit. If `block' is false and the producers are busy, the buffer is left
+// alone until next time.
+// Starts a new high-water window, remembering the last one's peak. The pipe
+// must be fully locked.
+static void roll_high_water(pipe_t* p, uint64_t now)
+{
+    p->prev_high_water  = load_relaxed(&p->high_water);
+    p->high_water_since = now;
+
+    store_relaxed(&p->high_water, bytes_in_use(make_snapshot(p)));
+}
+
+// Whether the policy wants the buffer shrunk to `new_cap'. `begin_lock' must be
+// held, and if `locked', `end_lock' too.
+static bool should_shrink(pipe_t* p, snapshot_t s, size_t new_cap, bool locked)
+{
+    size_t used    = bytes_in_use(s),
+           cap     = capacity(s),
+           percent = p->policy.shrink_percent;
+
+    // The common case, so keep it cheap: we have a sane size.
+    if(likely(percent == 0 || p->fixed || used > cap / 100 * percent
+                                   + cap % 100 * percent / 100))
+        return false;
+
+    // Shrinking any further would just end up growing again.
+    if(cap <= p->min_cap)
+        return false;
+
+    if(!p->policy.shrink_delay_ms && !p->policy.high_water_ms)
+        return true;
+
+    uint64_t now = now_ms();
+
+    if(now - p->last_resize < p->policy.shrink_delay_ms)
+        return false;
+
+    if(!p->policy.high_water_ms)
+        return true;
+
+    // Rolling the window over needs the whole pipe locked, so come back with
+    // it. That's once per window at most.
+    if(now - p->high_water_since >= p->policy.high_water_ms)
+    {
+        if(!locked)
+            return true;
+
+        roll_high_water(p, now);
+    }
+
+    return max(load_relaxed(&p->high_water), p->prev_high_water) <= new_cap;
+}
+
+static inline void trim_buffer(pipe_t* p, snapshot_t s, bool block)
+{
+    // We have a sane size. We're done here.
+    if(likely(!should_shrink(p, s, capacity(s) / 2, false)))
+    {
+        mutex_unlock(&p->begin_lock);
+        return;
+    }
+
+    // Okay, we need to resize now. Upgrade our lock so we can check again. The
+    // weird lock/unlock order is to make sure we always acquire the end_lock
+    // before begin_lock. Deadlock can arise otherwise. A trylock never waits,
+    // so it can't deadlock, and we get to keep begin_lock.
+    if(block)
+    {
+        mutex_unlock(&p->begin_lock);
+        mutex_lock(&p->end_lock);
+        mutex_lock(&p->begin_lock);
+    }
+    else if(!mutex_trylock(&p->end_lock))
+    {
+        mutex_unlock(&p->begin_lock);
+        return;
+    }
+
+    s = make_snapshot(p);
+
+    // To conserve space like the good computizens we are, we'll shrink our
+    // buffer if our memory usage efficiency drops below what the policy allows
+    // (25% by default). However, since shrinking/growing the buffer is the most
+    // expensive part of a push or pop, we only shrink it by half, bringing us
+    // up to 50% with the default policy. A common pipe usage pattern is sudden
+    // bursts of pushes and pops. This ensures it doesn't get too
+    // time-inefficient, and the policy can hold off even longer.
+    if(likely(should_shrink(p, s, capacity(s) / 2, true)))
+        resize_buffer(p, capacity(s) / 2);
+
+    // All done. Unlock the pipe. The reason we don't let the calling function
+    // unlock begin_lock is so that we can do it BEFORE end_lock. This prevents
+    // the lock order from being fudged.
+    mutex_unlock(&p->begin_lock);
+    mutex_unlock(&p->end_lock);
+}
+
+// Performs the actual pop, except `requested' is now in bytes as opposed to
+// elements.
+//
+// This will behave eagerly, returning as many elements that it can into
+// `target' as it can fill right now. If `deadline' passes while the pipe is
+// empty, PIPE_WOULD_BLOCK is returned.
+static inline size_t __pipe_pop(pipe_t* p,
+                                void* restrict target,
+                                size_t requested,
+                                const struct timespec* deadline)
+{
+    if(unlikely(requested == 0))
+        return 0;
+
+    size_t popped = 0;
+
+    { mutex_lock(&p->begin_lock);
+        snapshot_t s      = wait_for_elements(p, deadline);
+        size_t bytes_used = bytes_in_use(s);
+
+        if(unlikely(bytes_used == 0))
+        {
+            size_t producer_refcount = p->producer_refcount;
+            mutex_unlock(&p->begin_lock);
+
+            return producer_refcount > 0 ? PIPE_WOULD_BLOCK : 0;
+        }
+
+        check_invariants(p);
+
+        s = pop_without_locking(s, target,
+                                popped = min(requested, bytes_used),
+                                &p->begin
+        );
+
+        check_invariants(p);
+
+        trim_buffer(p, s, true);
+    } // p->begin_lock was unlocked by trim_buffer.
+
+    assertume(popped);
+
+    notify_popped(p, popped / __pipe_elem_size(p));
+
+    return popped;
+}
+
+// Pops whatever is in the pipe right now, without waiting for more. If `block'
+// is false, it doesn't wait for the lock either. Returns the number of bytes
+// popped, or PIPE_WOULD_BLOCK if the pipe is empty or another consumer has the
+// lock.
+static size_t pop_available(pipe_t* p,
+                            void* restrict target,
+                            size_t requested,
+                            bool block)
+{
+    if(block)
+        mutex_lock(&p->begin_lock);
+    else if(!mutex_trylock(&p->begin_lock))
+        return PIPE_WOULD_BLOCK;
+
+    snapshot_t s      = make_snapshot(p);
+    size_t bytes_used = bytes_in_use(s);
+
+    if(unlikely(bytes_used == 0))
+    {
+        size_t producer_refcount = p->producer_refcount;
+        mutex_unlock(&p->begin_lock);
+
+        return producer_refcount > 0 ? PIPE_WOULD_BLOCK : 0;
+    }
+
+    size_t popped = min(requested, bytes_used);
+
+    s = pop_without_locking(s, target, popped, &p->begin);
+
+    check_invariants(p);
+
+    trim_buffer(p, s, block);
+
+    notify_popped(p, popped / __pipe_elem_size(p));
+
+    return popped;
+}
+
+// The non-blocking version of __pipe_pop.
+static size_t __pipe_try_pop(pipe_t* p,
+                             void* restrict target,
+                             size_t requested)
+{
+    return pop_available(p, target, requested, false);
+}
+
+// The lock-free engines sleep on the eventcounts directly, without taking any
+// locks. If the pipe's wait strategy says so, we may spin for a while first, or
+// never sleep at all. Returns false if `deadline' passed first. A NULL deadline
+// never passes.
+static bool sleep_until(pipe_t* p,
+                        bool (*ready)(pipe_t*),
+                        event_t* ev,
+                        const size_t* other_refcount,
+                        const struct timespec* deadline)
+{
+    if(p->wait_strategy != PIPE_WAIT_BLOCK)
+    {
+        spin_result_t spun = spin_until(p, ready, other_refcount, deadline);
+
+        if(spun != SPUN_OUT)
+            return spun == SPUN_READY;
+    }
+
+    for(;;)
+    {
+        unsigned key = event_prepare(ev);
+
+        if(ready(p) || load_acquire(other_refcount) == 0)
+        {
+            event_cancel(ev);
+            return true;
+        }
+
+        if(!event_wait(ev, key, deadline))
+            return false;
+    }
+}
+
+// Sleeps until `has_room' is true, all the consumers are gone, or `deadline'
+// passes.
+static inline bool sleep_until_room(pipe_t* p,
+                                    bool (*has_room)(pipe_t*),
+                                    const struct timespec* deadline)
+{
+    return sleep_until(p, has_room, &p->just_popped, &p->consumer_refcount,
+                       deadline);
+}
+
+// Sleeps until `has_elements' is true, all the producers are gone, or
+// `deadline' passes.
+static inline bool sleep_until_elements(pipe_t* p,
+                                        bool (*has_elements)(pipe_t*),
+                                        const struct timespec* deadline)
+{
+    return sleep_until(p, has_elements, &p->just_pushed, &p->producer_refcount,
+                       deadline);
+}
+
+// Both cursors of an SPSC pipe are published with release stores, so whenever
+// we read the other side's, it has to be with an acquire load.
+//
+// The producer's view of an SPSC pipe. Its own `end' is always up to date, but
+// `begin' is only fetched from the consumer's side when the last one we saw
+// doesn't leave room for `wanted' bytes. Since begin only ever moves forward,
+// an old one can only make the pipe look fuller than it is.
+static inline snapshot_t spsc_producer_snapshot(pipe_t* p, size_t wanted)
+{
+    snapshot_t s = {
+        .buffer = p->buffer,
+        .bufend = p->bufend,
+        .begin  = p->cached_begin,
+        .end    = p->end,
+        .elem_size = __pipe_elem_size(p),
+    };
+
+    if(!CACHE_CURSORS || capacity(s) - bytes_in_use(s) < wanted)
+        s.begin = p->cached_begin = load_acquire(&p->begin);
+
+    return s;
+}
+
+// The consumer's view of an SPSC pipe. It's spsc_producer_snapshot the other
+// way around: `end' is only fetched when the last one we saw doesn't give us
+// `wanted' bytes.
+static inline snapshot_t spsc_consumer_snapshot(pipe_t* p, size_t wanted)
+{
+    snapshot_t s = {
+        .buffer = p->buffer,
+        .bufend = p->bufend,
+        .begin  = p->begin,
+        .end    = p->cached_end,
+        .elem_size = __pipe_elem_size(p),
+    };
+
+    if(!CACHE_CURSORS || bytes_in_use(s) < wanted)
+        s.end = p->cached_end = load_acquire(&p->end);
+
+    return s;
+}
+
+static bool spsc_has_room(pipe_t* p)
+{
+    snapshot_t s = spsc_producer_snapshot(p, __pipe_elem_size(p));
+    return bytes_in_use(s) < capacity(s);
+}
+
+static bool spsc_has_elements(pipe_t* p)
+{
+    return bytes_in_use(spsc_consumer_snapshot(p, __pipe_elem_size(p))) > 0;
+}
+
+// The SPSC version of __pipe_push. `count' is in bytes.
+static size_t spsc_push(pipe_t* p,
+                        const char* restrict elems,
+                        size_t count,
+                        const struct timespec* deadline)
+{
+    size_t total = 0;
+
+    while(count > 0)
+    {
+        if(unlikely(load_relaxed(&p->consumer_refcount) == 0))
+            break;
+
+        snapshot_t s = spsc_producer_snapshot(p, count);
+
+        if(unlikely(bytes_in_use(s) == capacity(s)))
+        {
+            sleep_until_room(p, spsc_has_room, deadline);
+            s = spsc_producer_snapshot(p, count);
+
+            // Still full? Then there's nobody left to pop, or we're out of
+            // time.
+            if(bytes_in_use(s) == capacity(s))
+                break;
+        }
+
+        size_t pushed = min(count, capacity(s) - bytes_in_use(s));
+
+        store_release(&p->end, process_push(s, elems, pushed));
+        notify_pushed(p, pushed / s.elem_size);
+
+        elems += pushed;
+        count -= pushed;
+        total += pushed;
+    }
+
+    return total;
+}
+
+// The SPSC version of __pipe_pop. `requested' is in bytes.
+static size_t spsc_pop(pipe_t* p,
+                       void* restrict target,
+                       size_t requested,
+                       const struct timespec* deadline)
+{
+    if(unlikely(requested == 0))
+        return 0;
+
+    snapshot_t s = spsc_consumer_snapshot(p, requested);
+
+    if(unlikely(bytes_in_use(s) == 0))
+    {
+        sleep_until_elements(p, spsc_has_elements, deadline);
+
+        // Check on the producer before looking, so that anything it pushed
+        // on its way out is visible.
+        bool closed = load_acquire(&p->producer_refcount) == 0;
+        s = spsc_consumer_snapshot(p, requested);
+
+        // Still empty? Then there's nobody left to push, or we're out of time.
+        if(bytes_in_use(s) == 0)
+            return closed ? 0 : PIPE_WOULD_BLOCK;
+    }
+
+    size_t popped = min(requested, bytes_in_use(s));
+    char*  begin;
+
+    pop_without_locking(s, target, popped, &begin);
+
+    store_release(&p->begin, begin);
+    notify_popped(p, popped / s.elem_size);
+
+    return popped;
+}
+
+// The non-blocking version of spsc_push.
+static size_t spsc_try_push(pipe_t* p, const char* restrict elems, size_t count)
+{
+    if(unlikely(load_relaxed(&p->consumer_refcount) == 0))
+        return 0;
+
+    snapshot_t s = spsc_producer_snapshot(p, count);
+
+    size_t pushed = min(count, capacity(s) - bytes_in_use(s));
+
+    if(unlikely(pushed == 0))
+        return PIPE_WOULD_BLOCK;
+
+    store_release(&p->end, process_push(s, elems, pushed));
+    notify_pushed(p, pushed / s.elem_size);
+
+    return pushed;
+}
+
+// The non-blocking version of spsc_pop.
+static size_t spsc_try_pop(pipe_t* p, void* restrict target, size_t requested)
+{
+    snapshot_t s = spsc_consumer_snapshot(p, requested);
+
+    if(unlikely(bytes_in_use(s) == 0))
+    {
+        // The producer may have pushed something right before it left, so
+        // once it's gone we have to look one last time.
+        if(load_acquire(&p->producer_refcount) > 0)
+            return PIPE_WOULD_BLOCK;
+
+        s = spsc_consumer_snapshot(p, requested);
+
+        if(bytes_in_use(s) == 0)
+            return 0;
+    }
+
+    size_t popped = min(requested, bytes_in_use(s));
+    char*  begin;
+
+    pop_without_locking(s, target, popped, &begin);
+
+    store_release(&p->begin, begin);
+    notify_popped(p, popped / s.elem_size);
+
+    return popped;
+}
+
+static inline char* mpmc_slot(pipe_t* p, size_t pos)
+{
+    return p->buffer + (pos & p->slot_mask)*p->slot_size;
+}
+
+// Where the slot at `pos' is in its lap, relative to `expected'. Zero means it's
+// ready for us, negative means it hasn't been released by the other side yet,
+// and positive means somebody else beat us to it.
+static inline intptr_t mpmc_lap(pipe_t* p, size_t pos, size_t expected)
+{
+    return (intptr_t)(load_acquire((size_t*)mpmc_slot(p, pos)) - expected);
+}
+
+static bool mpmc_has_room(pipe_t* p)
+{
+    size_t pos = load_relaxed(&p->enqueue_pos);
+    return mpmc_lap(p, pos, pos) >= 0;
+}
+
+static bool mpmc_has_elements(pipe_t* p)
+{
+    size_t pos = load_relaxed(&p->dequeue_pos);
+    return mpmc_lap(p, pos, pos + 1) >= 0;
+}
+
+// Pushes a single element, returning false if the ring is full.
+static inline bool mpmc_push_one(pipe_t* p, const void* restrict elem)
+{
+    size_t pos = load_relaxed(&p->enqueue_pos);
+
+    for(;;)
+    {
+        intptr_t lap = mpmc_lap(p, pos, pos);
+
+        if(lap == 0)
+        {
+            if(compare_and_swap(&p->enqueue_pos, &pos, pos + 1))
+                break;
+        }
+        else if(lap < 0)
+            return false;
+        else
+            pos = load_relaxed(&p->enqueue_pos);
+    }
+
+    char* slot = mpmc_slot(p, pos);
+
+    memcpy(slot + SLOT_HEADER, elem, __pipe_elem_size(p));
+    store_release((size_t*)slot, pos + 1);
+
+    return true;
+}
+
+// Pops a single element, returning false if the ring is empty.
+static inline bool mpmc_pop_one(pipe_t* p, void* restrict target)
+{
+    size_t pos = load_relaxed(&p->dequeue_pos);
+
+    for(;;)
+    {
+        intptr_t lap = mpmc_lap(p, pos, pos + 1);
+
+        if(lap == 0)
+        {
+            if(compare_and_swap(&p->dequeue_pos, &pos, pos + 1))
+                break;
+        }
+        else if(lap < 0)
+            return false;
+        else
+            pos = load_relaxed(&p->dequeue_pos);
+    }
+
+    char* slot = mpmc_slot(p, pos);
+
+    memcpy(target, slot + SLOT_HEADER, __pipe_elem_size(p));
+    store_release((size_t*)slot, pos + p->slot_mask + 1);
+
+    return true;
+}
+
+// The MPMC version of __pipe_push. `count' is in bytes.
+static size_t mpmc_push(pipe_t* p,
+                        const char* restrict elems,
+                        size_t count,
+                        const struct timespec* deadline)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           pushed    = 0,
+           total     = 0;
+
+    while(count > 0)
+    {
+        if(unlikely(load_relaxed(&p->consumer_refcount) == 0))
+            break;
+
+        if(likely(mpmc_push_one(p, elems)))
+        {
+            elems  += elem_size;
+            count  -= elem_size;
+            pushed += elem_size;
+            continue;
+        }
+
+        // Full. Let the consumers know about what we've pushed so far before
+        // we go to sleep.
+        notify_pushed(p, pushed / elem_size);
+
+        total += pushed;
+        pushed = 0;
+
+        if(!sleep_until_room(p, mpmc_has_room, deadline))
+            break;
+    }
+
+    notify_pushed(p, pushed / elem_size);
+
+    return total + pushed;
+}
+
+// The MPMC version of __pipe_pop. `requested' is in bytes.
+static size_t mpmc_pop(pipe_t* p,
+                       void* restrict target,
+                       size_t requested,
+                       const struct timespec* deadline)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           popped    = 0;
+    bool   closed    = false;
+
+    while(popped < requested)
+    {
+        if(likely(mpmc_pop_one(p, (char*)target + popped)))
+        {
+            popped += elem_size;
+            continue;
+        }
+
+        // We're eager. Return whatever we've got, or wait for at least one.
+        if(popped > 0 || closed)
+            break;
+
+        // The producers may have pushed something right before they left, so
+        // once they're gone we have to look one last time. Until then, an
+        // empty ring only means another consumer beat us to it.
+        if(load_acquire(&p->producer_refcount) == 0)
+            closed = true;
+        else if(!sleep_until_elements(p, mpmc_has_elements, deadline))
+            return PIPE_WOULD_BLOCK;
+    }
+
+    notify_popped(p, popped / elem_size);
+
+    return popped;
+}
+
+// The non-blocking version of mpmc_push.
+static size_t mpmc_try_push(pipe_t* p, const char* restrict elems, size_t count)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           pushed    = 0;
+
+    if(unlikely(load_relaxed(&p->consumer_refcount) == 0))
+        return 0;
+
+    while(pushed < count && mpmc_push_one(p, elems + pushed))
+        pushed += elem_size;
+
+    if(unlikely(pushed == 0))
+        return PIPE_WOULD_BLOCK;
+
+    notify_pushed(p, pushed / elem_size);
+
+    return pushed;
+}
+
+// The non-blocking version of mpmc_pop.
+static size_t mpmc_try_pop(pipe_t* p, void* restrict target, size_t requested)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           popped    = 0;
+    bool   closed    = false;
+
+    for(;;)
+    {
+        while(popped < requested
+           && mpmc_pop_one(p, (char*)target + popped))
+            popped += elem_size;
+
+        if(popped > 0 || closed)
+            break;
+
+        // The producers may have pushed something right before they left, so
+        // once they're gone we have to look one last time.
+        if(load_acquire(&p->producer_refcount) > 0)
+            return PIPE_WOULD_BLOCK;
+
+        closed = true;
+    }
+
+    notify_popped(p, popped / elem_size);
+
+    return popped;
+}
+
+// Takes the spare chunk if there is one, so a pipe that's being drained about
+// as fast as it's filled doesn't go to malloc at all.
+static chunk_t* new_chunk(pipe_t* p)
+{
+    chunk_t* c = exchange_ptr(&p->spare, NULL);
+
+    if(c == NULL
+    && unlikely((c = alloc_bytes(p, sizeof *c + p->chunk_size)) == NULL))
+        abort(); // same as running out of memory in resize_buffer
+
+    c->next = NULL;
+
+    return c;
+}
+
+// Keeps a drained chunk around for new_chunk, freeing whichever one was there
+// before.
+static void release_chunk(pipe_t* p, chunk_t* c)
+{
+    free_bytes(p, exchange_ptr(&p->spare, c), sizeof *c + p->chunk_size);
+}
+
+static bool seg_has_room(pipe_t* p)
+{
+    return load_relaxed(&p->used) < load_relaxed(&p->max_cap);
+}
+
+static bool seg_has_elements(pipe_t* p)
+{
+    return load_relaxed(&p->used) > 0;
+}
+
+// Appends `bytes' bytes after `end', linking new chunks onto the tail as they
+// fill up. The elements already in the pipe are never touched. `end_lock' must
+// be held, and the bytes aren't visible to consumers until `used' is bumped.
+static void seg_copy_in(pipe_t* p, const char* restrict elems, size_t bytes)
+{
+    while(bytes > 0)
+    {
+        char* chunk_end = p->tail->elems + p->chunk_size;
+
+        if(p->end == chunk_end)
+        {
+            chunk_t* c = new_chunk(p);
+
+            store_release(&p->tail->next, c);
+
+            p->tail   = c;
+            p->end    = c->elems;
+            chunk_end = c->elems + p->chunk_size;
+        }
+
+        size_t n = min(bytes, (size_t)(chunk_end - p->end));
+
+        memcpy(p->end, elems, n);
+
+        p->end += n;
+        elems  += n;
+        bytes  -= n;
+    }
+}
+
+// Copies `bytes' bytes out from `begin', releasing chunks as they're drained.
+// `begin_lock' must be held, and at least `bytes' bytes must be in `used'.
+static void seg_copy_out(pipe_t* p, char* restrict target, size_t bytes)
+{
+    while(bytes > 0)
+    {
+        char* chunk_end = p->head->elems + p->chunk_size;
+
+        // The producer always links the next chunk before publishing anything
+        // in it, so if there's more to read it must be there.
+        if(p->begin == chunk_end)
+        {
+            chunk_t* drained = p->head;
+
+            p->head   = load_acquire(&drained->next);
+            p->begin  = p->head->elems;
+            chunk_end = p->begin + p->chunk_size;
+
+            assertume(p->head != NULL);
+
+            release_chunk(p, drained);
+        }
+
+        size_t n = min(bytes, (size_t)(chunk_end - p->begin));
+
+        memcpy(target, p->begin, n);
+
+        p->begin += n;
+        target   += n;
+        bytes    -= n;
+    }
+}
+
+// The segmented version of __pipe_push. `count' is in bytes.
+static size_t seg_push(pipe_t* p,
+                       const char* restrict elems,
+                       size_t count,
+                       const struct timespec* deadline)
+{
+    size_t elem_size = __pipe_elem_size(p);
+
+    if(unlikely(count == 0))
+        return 0;
+
+    size_t pushed;
+
+    { mutex_lock(&p->end_lock);
+        for(bool woken = true;
+            woken && unlikely(!seg_has_room(p)) && likely(p->consumer_refcount > 0);)
+            woken = wait_on(p, seg_has_room, &p->end_lock, &p->just_popped,
+                            &p->consumer_refcount, deadline);
+
+        // if no more consumers, or we ran out of time...
+        if(unlikely(p->consumer_refcount == 0 || !seg_has_room(p)))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        seg_copy_in(p, elems,
+            pushed = min(count, p->max_cap - load_acquire(&p->used)));
+
+        fetch_add(&p->used, pushed);
+    } mutex_unlock(&p->end_lock);
+
+    notify_pushed(p, pushed / elem_size);
+
+    // Only bounded pipes can run out of room halfway through.
+    size_t bytes_remaining = count - pushed;
+
+    if(unlikely(bytes_remaining))
+        pushed += seg_push(p, elems + pushed, bytes_remaining, deadline);
+
+    return pushed;
+}
+
+// The segmented version of __pipe_pop. `requested' is in bytes.
+static size_t seg_pop(pipe_t* p,
+                      void* restrict target,
+                      size_t requested,
+                      const struct timespec* deadline)
+{
+    if(unlikely(requested == 0))
+        return 0;
+
+    size_t popped;
+
+    { mutex_lock(&p->begin_lock);
+        for(bool woken = true;
+            woken && unlikely(!seg_has_elements(p)) && likely(p->producer_refcount > 0);)
+            woken = wait_on(p, seg_has_elements, &p->begin_lock, &p->just_pushed,
+                            &p->producer_refcount, deadline);
+
+        size_t bytes_used = load_acquire(&p->used);
+
+        if(unlikely(bytes_used == 0))
+        {
+            size_t producer_refcount = p->producer_refcount;
+            mutex_unlock(&p->begin_lock);
+
+            return producer_refcount > 0 ? PIPE_WOULD_BLOCK : 0;
+        }
+
+        seg_copy_out(p, target, popped = min(requested, bytes_used));
+
+        fetch_sub(&p->used, popped);
+    } mutex_unlock(&p->begin_lock);
+
+    notify_popped(p, popped / __pipe_elem_size(p));
+
+    return popped;
+}
+
+// The non-blocking version of seg_push.
+static size_t seg_try_push(pipe_t* p, const char* restrict elems, size_t count)
+{
+    size_t pushed;
+
+    if(!mutex_trylock(&p->end_lock))
+        return PIPE_WOULD_BLOCK;
+
+    if(unlikely(p->consumer_refcount == 0))
+    {
+        mutex_unlock(&p->end_lock);
+        return 0;
+    }
+
+    pushed = min(count, p->max_cap - load_acquire(&p->used));
+
+    if(unlikely(pushed == 0))
+    {
+        mutex_unlock(&p->end_lock);
+        return PIPE_WOULD_BLOCK;
+    }
+
+    seg_copy_in(p, elems, pushed);
+    fetch_add(&p->used, pushed);
+
+    mutex_unlock(&p->end_lock);
+
+    notify_pushed(p, pushed / __pipe_elem_size(p));
+
+    return pushed;
+}
+
+// The non-blocking version of seg_pop.
+static size_t seg_try_pop(pipe_t* p, void* restrict target, size_t requested)
+{
+    if(!mutex_trylock(&p->begin_lock))
+        return PIPE_WOULD_BLOCK;
+
+    size_t bytes_used = load_acquire(&p->used);
+
+    if(unlikely(bytes_used == 0))
+    {
+        size_t producer_refcount = p->producer_refcount;
+        mutex_unlock(&p->begin_lock);
+
+        return producer_refcount > 0 ? PIPE_WOULD_BLOCK : 0;
+    }
+
+    size_t popped = min(requested, bytes_used);
+
+    seg_copy_out(p, target, popped);
+    fetch_sub(&p->used, popped);
+
+    mutex_unlock(&p->begin_lock);
+
+    notify_popped(p, popped / __pipe_elem_size(p));
+
+    return popped;
+}
+
+static inline size_t bcast_capacity(pipe_t* p)
+{
+    return p->slot_mask + 1;
+}
+
+// How far behind enqueue_pos the slowest consumer is, in elements.
+// `begin_lock' must be held.
+static size_t bcast_lag(pipe_t* p)
+{
+    size_t end = load_relaxed(&p->enqueue_pos),
+           lag = 0;
+
+    for(broadcast_consumer_t* c = p->cursors; c; c = c->next)
+    {
+        size_t behind = end - load_acquire(&c->pos);
+        lag = max(lag, behind);
+    }
+
+    return lag;
+}
+
+static bool bcast_has_room(pipe_t* p)
+{
+    mutex_lock(&p->begin_lock);
+        bool room = bcast_lag(p) < bcast_capacity(p);
+    mutex_unlock(&p->begin_lock);
+
+    return room;
+}
+
+// How many elements may be pushed right now, without waiting on anybody.
+// `end_lock' must be held.
+static inline size_t bcast_room(pipe_t* p)
+{
+    if(p->drop_slow)
+        return bcast_capacity(p);
+
+    mutex_lock(&p->begin_lock);
+        size_t lag = bcast_lag(p);
+    mutex_unlock(&p->begin_lock);
+
+    return bcast_capacity(p) - lag;
+}
+
+// Copies `count' elements into the ring at `pos' and publishes them.
+// `end_lock' must be held, and there must be room.
+static void bcast_copy_in(pipe_t* p, const char* restrict elems, size_t count)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           pos       = load_relaxed(&p->enqueue_pos),
+           index     = pos & p->slot_mask,
+           at_end    = min(count, bcast_capacity(p) - index);
+
+    // Let any consumer that's still reading what we're about to overwrite know
+    // before we start.
+    if(p->drop_slow && pos + count > bcast_capacity(p))
+    {
+        store_relaxed(&p->lapped, pos + count - bcast_capacity(p));
+        full_fence();
+    }
+
+    memcpy(p->buffer + index*elem_size, elems, at_end*elem_size);
+    memcpy(p->buffer, elems + at_end*elem_size, (count - at_end)*elem_size);
+
+    store_release(&p->enqueue_pos, pos + count);
+}
+
+// The broadcast version of __pipe_push. `count' is in bytes.
+static size_t bcast_push(pipe_t* p,
+                         const char* restrict elems,
+                         size_t count,
+                         const struct timespec* deadline)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           pushed    = 0;
+
+    mutex_lock(&p->end_lock);
+
+    while(pushed < count && likely(p->consumer_refcount > 0))
+    {
+        size_t room = bcast_room(p);
+
+        if(unlikely(room == 0))
+        {
+            if(!wait_on(p, bcast_has_room, &p->end_lock, &p->just_popped,
+                        &p->consumer_refcount, deadline))
+                break;
+
+            continue;
+        }
+
+        size_t n = min(room, (count - pushed) / elem_size);
+
+        bcast_copy_in(p, elems + pushed, n);
+        pushed += n*elem_size;
+
+        // Every consumer wants every element.
+        notify_pushed(p, EVENT_ALL);
+    }
+
+    mutex_unlock(&p->end_lock);
+
+    return pushed;
+}
+
+// The non-blocking version of bcast_push.
+static size_t bcast_try_push(pipe_t* p, const char* restrict elems, size_t count)
+{
+    size_t elem_size = __pipe_elem_size(p);
+
+    if(!mutex_trylock(&p->end_lock))
+        return PIPE_WOULD_BLOCK;
+
+    if(unlikely(p->consumer_refcount == 0))
+    {
+        mutex_unlock(&p->end_lock);
+        return 0;
+    }
+
+    size_t room = bcast_room(p),
+           n    = min(room, count / elem_size);
+
+    if(likely(n > 0))
+        bcast_copy_in(p, elems, n);
+
+    mutex_unlock(&p->end_lock);
+
+    if(unlikely(n == 0))
+        return PIPE_WOULD_BLOCK;
+
+    notify_pushed(p, EVENT_ALL);
+
+    return n*elem_size;
+}
+
+static inline bool bcast_has_elements(broadcast_consumer_t* c)
+{
+    return load_acquire(&c->pipe->enqueue_pos) != c->pos
+        || load_acquire(&c->pipe->producer_refcount) == 0;
+}
+
+// Like sleep_until_elements, except that what we're waiting for depends on the
+// handle, not just the pipe.
+static bool bcast_sleep(broadcast_consumer_t* c, const struct timespec* deadline)
+{
+    pipe_t* p = c->pipe;
+
+    pipe_wait_strategy_t strategy = p->wait_strategy;
+
+    for(size_t i = 0; strategy != PIPE_WAIT_BLOCK; ++i)
+    {
+        if(bcast_has_elements(c))
+            return true;
+
+        if(strategy == PIPE_WAIT_SPIN_THEN_BLOCK && i == p->spins)
+            break;
+
+        if(deadline && deadline_passed(deadline))
+            return false;
+
+        if(strategy == PIPE_WAIT_YIELD)
+            thread_yield();
+        else
+            cpu_relax();
+    }
+
+    for(;;)
+    {
+        unsigned key = event_prepare(&p->just_pushed);
+
+        if(bcast_has_elements(c))
+        {
+            event_cancel(&p->just_pushed);
+            return true;
+        }
+
+        if(!event_wait(&p->just_pushed, key, deadline))
+            return false;
+    }
+}
+
+// Pops up to `requested' bytes from `c''s cursor. Returns what pop_bytes would,
+// and 0 once `c' has been cut off.
+static size_t bcast_pop(broadcast_consumer_t* c,
+                        char* restrict target,
+                        size_t requested,
+                        const struct timespec* deadline,
+                        bool block)
+{
+    pipe_t* p = c->pipe;
+
+    size_t elem_size = __pipe_elem_size(p),
+           pos       = c->pos;
+
+    if(unlikely(c->dropped))
+        return 0;
+
+    size_t available = load_acquire(&p->enqueue_pos) - pos;
+
+    // We're more than a whole ring behind, so some of it is already gone.
+    if(unlikely(available > bcast_capacity(p)))
+    {
+        c->dropped = true;
+        return 0;
+    }
+
+    // The producers may have pushed something right before they left, so look
+    // one last time once they're gone.
+    if(available == 0)
+    {
+        size_t producer_refcount = load_acquire(&p->producer_refcount);
+
+        if(producer_refcount > 0 && block && !bcast_sleep(c, deadline))
+            return PIPE_WOULD_BLOCK;
+
+        available = load_acquire(&p->enqueue_pos) - pos;
+
+        if(available == 0)
+            return block || producer_refcount == 0 ? 0 : PIPE_WOULD_BLOCK;
+    }
+
+    size_t n      = min(available, requested / elem_size),
+           index  = pos & p->slot_mask,
+           at_end = min(n, bcast_capacity(p) - index);
+
+    memcpy(target, p->buffer + index*elem_size, at_end*elem_size);
+    memcpy(target + at_end*elem_size, p->buffer, (n - at_end)*elem_size);
+
+    // If a producer got to any of it while we were copying, it's garbage, and
+    // we've missed elements besides.
+    if(p->drop_slow)
+    {
+        full_fence();
+
+        if(unlikely(load_relaxed(&p->lapped) > pos))
+        {
+            c->dropped = true;
+            return 0;
+        }
+    }
+
+    store_release(&c->pos, pos + n);
+
+    if(!p->drop_slow)
+        notify_popped(p, n);
+
+    return n*elem_size;
+}
+
+// Pushes into one level of a priority pipe, or one shard of a sharded pipe.
+// Nobody ever waits on the part itself for elements, so the consumers of `p'
+// are told about each piece that gets in as it does. Otherwise a producer
+// waiting for room half way through would leave them asleep with elements to
+// pop.
+//
+// A blocking push waits for the part's end_lock, and grows its buffer under
+// it, just like __pipe_push. A trylock would come back with PIPE_WOULD_BLOCK
+// whenever another producer or a consumer was busy with the part, with room to
+// spare, and there'd be nothing to sleep on until they were done.
+static size_t part_push(pipe_t* p,
+                        size_t part,
+                        const char* restrict elems,
+                        size_t count,
+                        const struct timespec* deadline,
+                        bool block)
+{
+    pipe_t* l = p->parts[part];
+
+    size_t elem_size = __pipe_elem_size(p),
+           pushed    = 0;
+
+    while(pushed < count)
+    {
+        size_t n = block
+                 ? push_some(l, elems + pushed, count - pushed, deadline)
+                 : __pipe_try_push(l, elems + pushed, count - pushed);
+
+        if(unlikely(n == 0))
+            break;
+
+        if(n == PIPE_WOULD_BLOCK)
+            return pushed ? pushed : n;
+
+        pushed += n;
+        notify_pushed(p, n / elem_size);
+    }
+
+    return pushed;
+}
+
+static bool parts_have_elements(pipe_t* p)
+{
+    for(size_t i = 0; i < p->nparts; ++i)
+        if(has_elements(p->parts[i]))
+            return true;
+
+    return false;
+}
+
+// Picks the level to pop from next, or returns nlevels if they're all empty.
+// That's the highest one with elements, unless a lower one has used up its
+// quota. `begin_lock' must be held.
+static size_t prio_pick(pipe_t* p)
+{
+    size_t first = 0;
+
+    while(first < p->nparts && !has_elements(p->parts[first]))
+        ++first;
+
+    if(p->quota == 0 || first == p->nparts)
+        return first;
+
+    for(size_t i = first + 1; i < p->nparts; ++i)
+        if(p->starved[i] >= p->quota && has_elements(p->parts[i]))
+            return i;
+
+    return first;
+}
+
+// The priority version of __pipe_pop. Returns what pop_bytes would.
+//
+// `begin_lock' only covers picking the level and keeping score for the quota.
+// The elements are copied out under the level's own lock, so consumers popping
+// from different levels, or one after another from the same one, don't wait
+// on each other's copies.
+static size_t prio_pop(pipe_t* p,
+                       void* restrict target,
+                       size_t requested,
+                       const struct timespec* deadline,
+                       bool block)
+{
+    size_t elem_size = __pipe_elem_size(p),
+           level,
+           popped;
+
+    for(;;)
+    {
+        if(block)
+            mutex_lock(&p->begin_lock);
+        else if(!mutex_trylock(&p->begin_lock))
+            return PIPE_WOULD_BLOCK;
+
+        // The producers may have pushed something right before they left, so
+        // look one last time once they're gone.
+        while((level = prio_pick(p)) == p->nparts)
+        {
+            size_t producer_refcount = p->producer_refcount;
+
+            if(producer_refcount == 0 || !block
+            || !wait_on(p, parts_have_elements, &p->begin_lock, &p->just_pushed,
+                        &p->producer_refcount, deadline))
+            {
+                if(producer_refcount == 0 && (level = prio_pick(p)) < p->nparts)
+                    break;
+
+                mutex_unlock(&p->begin_lock);
+                return producer_refcount == 0 ? 0 : PIPE_WOULD_BLOCK;
+            }
+        }
+
+        mutex_unlock(&p->begin_lock);
+
+        popped = block ? pop_available(p->parts[level], target, requested, true)
+                       : __pipe_try_pop(p->parts[level], target, requested);
+
+        if(likely(popped != PIPE_WOULD_BLOCK && popped != 0))
+            break;
+
+        // Another consumer emptied the level first, or just had it locked.
+        if(!block && popped == PIPE_WOULD_BLOCK)
+            return PIPE_WOULD_BLOCK;
+    }
+
+    if(p->quota)
+    {
+        mutex_lock(&p->begin_lock);
+            p->starved[level] = 0;
+
+            for(size_t i = level + 1; i < p->nparts; ++i)
+                if(has_elements(p->parts[i]))
+                    p->starved[i] += popped / elem_size;
+        mutex_unlock(&p->begin_lock);
+    }
+
+    // Nobody waits on this, but pipe_producer_fd may be watching it.
+    notify_popped(p, popped / elem_size);
+
+    return popped;
+}
+
+// Returns the shard with the most elements in it, by a racy look at each. Ties
+// go to whichever comes first from `start'.
+static size_t fullest_part(pipe_t* p, size_t start)
+{
+    size_t nparts  = p->nparts,
+           fullest = start % nparts,
+           most    = 0;
+
+    for(size_t i = 0; i < nparts; ++i)
+    {
+        size_t part = (start + i) % nparts,
+               used = bytes_in_use(racy_snapshot(p->parts[part]));
+
+        if(used > most)
+        {
+            most    = used;
+            fullest = part;
+        }
+    }
+
+    return fullest;
+}
+
+// The sharded version of __pipe_pop. Pops from the fullest shard, so that a
+// busy shard doesn't pile up while the consumers take turns with quiet ones.
+// If another consumer has that one locked, or gets to it first, the rest are
+// swept instead, for the first one with elements that isn't busy. If they all
+// are, a blocking pop waits for the fullest one's lock. Ties, and the sweep,
+// start one shard further along each time, so that no shard is always looked
+// at last. Returns what pop_bytes would.
+static size_t shard_pop(pipe_t* p,
+                        void* restrict target,
+                        size_t requested,
+                        const struct timespec* deadline,
+                        bool block)
+{
+    if(unlikely(requested == 0))
+        return 0;
+
+    size_t elem_size = __pipe_elem_size(p),
+           nparts    = p->nparts;
+
+    for(;;)
+    {
+        size_t start = fetch_add(&p->next_pop, 1);
+
+        // If the producers are gone by now, everything they pushed is too.
+        size_t producer_refcount = load_acquire(&p->producer_refcount);
+
+        size_t fullest = fullest_part(p, start);
+
+        for(size_t i = 0; i <= nparts; ++i)
+        {
+            size_t part = i == 0 ? fullest : (start + i - 1) % nparts;
+
+            if(i > 0 && part == fullest)
+                continue;
+
+            size_t popped = __pipe_try_pop(p->parts[part], target, requested);
+
+            if(popped != PIPE_WOULD_BLOCK && popped != 0)
+            {
+                notify_popped(p, popped / elem_size);
+                return popped;
+            }
+        }
+
+        // A shard another consumer had locked may still have elements left.
+        if(producer_refcount == 0 && !parts_have_elements(p))
+            return 0;
+
+        if(!block)
+            return PIPE_WOULD_BLOCK;
+
+        // If anything's left, it's in shards other consumers have locked, and
+        // nothing will wake us up when they let go. Wait for the fullest one's
+        // lock instead of sweeping them all again.
+        if(parts_have_elements(p))
+        {
+            fullest = fullest_part(p, start);
+
+            size_t popped = pop_available(p->parts[fullest], target, requested,
+                                          true);
+
+            if(popped != PIPE_WOULD_BLOCK && popped != 0)
+            {
+                notify_popped(p, popped / elem_size);
+                return popped;
+            }
+
+            continue;
+        }
+
+        if(!sleep_until_elements(p, parts_have_elements, deadline))
+            return PIPE_WOULD_BLOCK;
+    }
+}
+
+// Pops as many bytes as are available, up to `requested', with whichever
+// engine the pipe was created with. If `deadline' passes while the pipe is
+// empty, PIPE_WOULD_BLOCK is returned.
+static inline size_t pop_bytes(pipe_t* p,
+                               void* restrict target,
+                               size_t requested,
+                               const struct timespec* deadline)
+{
+    switch(p->engine)
+    {
+    case ENGINE_SPSC: return spsc_pop(p, target, requested, deadline);
+    case ENGINE_MPMC: return mpmc_pop(p, target, requested, deadline);
+    case ENGINE_SEGMENTED:
+                      return seg_pop(p, target, requested, deadline);
+    case ENGINE_PRIORITY:
+                      return prio_pop(p, target, requested, deadline, true);
+    case ENGINE_SHARDED:
+                      return shard_pop(p, target, requested, deadline, true);
+    default:          return __pipe_pop(p, target, requested, deadline);
+    }
+}
+
+// Pops as many bytes as are available right now, up to `requested', with
+// whichever engine the pipe was created with. Returns the number of bytes
+// popped, 0 if the producers are gone, or PIPE_WOULD_BLOCK.
+static inline size_t try_pop_bytes(pipe_t* p,
+                                   void* restrict target,
+                                   size_t requested)
+{
+    switch(p->engine)
+    {
+    case ENGINE_SPSC: return spsc_try_pop(p, target, requested);
+    case ENGINE_MPMC: return mpmc_try_pop(p, target, requested);
+    case ENGINE_SEGMENTED:
+                      return seg_try_pop(p, target, requested);
+    case ENGINE_PRIORITY:
+                      return prio_pop(p, target, requested, NULL, false);
+    case ENGINE_SHARDED:
+                      return shard_pop(p, target, requested, NULL, false);
+    default:          return __pipe_try_pop(p, target, requested);
+    }
+}
+
+// Pops up to `requested' bytes through a buffered handle. They come out of the
+// cache if there's anything in it. Otherwise the cache is refilled with a
+// single pop of up to a whole budget's worth, which takes the consumer lock
+// once instead of once per call. Returns what pop_bytes would.
+static size_t buffered_pop(buffered_consumer_t* c,
+                           char* restrict target,
+                           size_t requested,
+                           const struct timespec* deadline,
+                           bool block)
+{
+    pipe_t* p = c->pipe;
+
+    assertume(c->peeked == 0
+           && "Popping from a buffered handle with a peek outstanding.");
+
+    if(c->begin == c->end)
+    {
+        // Too big to be worth caching. The cache is empty, so this can go
+        // straight into `target' without anything overtaking it.
+        if(unlikely(requested >= c->capacity))
+            return block ? pop_bytes(p, target, requested, deadline)
+                         : try_pop_bytes(p, target, requested);
+
+        size_t popped = block ? pop_bytes(p, c->batch, c->capacity, deadline)
+                              : try_pop_bytes(p, c->batch, c->capacity);
+
+        if(popped == 0 || popped == PIPE_WOULD_BLOCK)
+            return popped;
+
+        c->begin = 0;
+        c->end   = popped;
+    }
+
+    size_t bytes = min(requested, c->end - c->begin);
+
+    memcpy(target, c->batch + c->begin, bytes);
+    c->begin += bytes;
+
+    return bytes;
+}
+
+// Pops from any kind of consumer handle, waiting if `block' says to. Returns
+// what pop_bytes or try_pop_bytes would.
+static inline size_t handle_pop_bytes(pipe_consumer_t* handle,
+                                      void* restrict target,
+                                      size_t requested,
+                                      const struct timespec* deadline,
+                                      bool block)
+{
+    switch(*(const engine_t*)handle)
+    {
+    case ENGINE_BUFFERED_CONSUMER:
+        return buffered_pop((buffered_consumer_t*)handle, target, requested,
+                            deadline, block);
+
+    case ENGINE_BROADCAST_CONSUMER:
+        return bcast_pop((broadcast_consumer_t*)handle, target, requested,
+                         deadline, block);
 
-    size_t consumer_refcount = p->consumer_refcount;
+    case ENGINE_BROADCAST:
+        assertume(!"A broadcast pipe_t has no cursor to pop from. Make a "
+                   "consumer handle.");
+        return 0;
 
-    *max_cap = p->max_cap;
+    default:
+        return block ? pop_bytes((pipe_t*)handle, target, requested, deadline)
+                     : try_pop_bytes((pipe_t*)handle, target, requested);
+    }
+}
 
-    for(; unlikely(bytes_used == *max_cap) && likely(consumer_refcount > 0);
-          s                 = make_snapshot(p),
-          bytes_used        = bytes_in_use(s),
-          consumer_refcount = p->consumer_refcount,
-          *max_cap          = p->max_cap)
-        cond_wait(&p->just_popped, &p->end_lock);
+// Pushes all `count' bytes with whichever engine the pipe was created with,
+// unless the consumers leave or `deadline' passes first. Returns the number of
+// bytes pushed.
+static inline size_t push_bytes(pipe_t* p,
+                                const void* restrict elems,
+                                size_t count,
+                                const struct timespec* deadline)
+{
+    switch(p->engine)
+    {
+    case ENGINE_SPSC: return spsc_push(p, elems, count, deadline);
+    case ENGINE_MPMC: return mpmc_push(p, elems, count, deadline);
+    case ENGINE_SEGMENTED:
+                      return seg_push(p, elems, count, deadline);
+    case ENGINE_BROADCAST:
+                      return bcast_push(p, elems, count, deadline);
+    case ENGINE_PRIORITY:
+                      return part_push(p, p->nparts - 1, elems, count,
+                                       deadline, true);
+    case ENGINE_SHARDED:
+                      return part_push(p, 0, elems, count, deadline, true);
+    default:          return __pipe_push(p, elems, count, deadline);
+    }
+}
+
+// Pushes as many of the `count' bytes as fit right now, with whichever engine
+// the pipe was created with. Returns the number of bytes pushed, 0 if the
+// consumers are gone, or PIPE_WOULD_BLOCK.
+static inline size_t try_push_bytes(pipe_t* p,
+                                    const void* restrict elems,
+                                    size_t count)
+{
+    switch(p->engine)
+    {
+    case ENGINE_SPSC: return spsc_try_push(p, elems, count);
+    case ENGINE_MPMC: return mpmc_try_push(p, elems, count);
+    case ENGINE_SEGMENTED:
+                      return seg_try_push(p, elems, count);
+    case ENGINE_BROADCAST:
+                      return bcast_try_push(p, elems, count);
+    case ENGINE_PRIORITY:
+                      return part_push(p, p->nparts - 1, elems, count,
+                                       NULL, false);
+    case ENGINE_SHARDED:
+                      return part_push(p, 0, elems, count, NULL, false);
+    default:          return __pipe_try_push(p, elems, count);
+    }
+}
+
+// Pushes `count' bytes into shard `shard' of a sharded pipe, or just into the
+// pipe if it isn't one. Returns what push_bytes or try_push_bytes would.
+static inline size_t push_to(pipe_t* p,
+                             size_t shard,
+                             const void* restrict elems,
+                             size_t count,
+                             const struct timespec* deadline,
+                             bool block)
+{
+    if(p->engine == ENGINE_SHARDED)
+        return part_push(p, shard, elems, count, deadline, block);
+
+    return block ? push_bytes(p, elems, count, deadline)
+                 : try_push_bytes(p, elems, count);
+}
+
+// Pushes everything pending in `h' into its pipe. Returns false if `deadline'
+// passed first, or if `block' is false and the pipe was full or busy. Whatever
+// didn't get in stays pending. If the consumers are gone, the pending elements
+// are dropped, just like a push would drop them.
+static bool flush_pending(buffered_producer_t* h,
+                          const struct timespec* deadline,
+                          bool block)
+{
+    if(h->pending == 0)
+        return true;
+
+    size_t pushed = push_to(h->pipe, h->shard, h->batch, h->pending, deadline,
+                            block);
+
+    if(pushed == PIPE_WOULD_BLOCK)
+        return false;
+
+    if(likely(pushed == h->pending)
+    || load_acquire(&h->pipe->consumer_refcount) == 0)
+    {
+        h->pending = 0;
+        return true;
+    }
+
+    memmove(h->batch, h->batch + pushed, h->pending - pushed);
+    h->pending -= pushed;
+
+    return false;
+}
+
+// Pushes `count' bytes through a buffered handle. They're only copied into the
+// batch, unless that fills it up or the oldest pending element is at least
+// flush_age_ms old, in which case the whole batch goes into the pipe in one go.
+// Returns the number of bytes taken, 0 if the consumers are gone, or
+// PIPE_WOULD_BLOCK if the batch couldn't be made room in.
+static size_t buffered_push(buffered_producer_t* h,
+                            const char* restrict elems,
+                            size_t count,
+                            const struct timespec* deadline,
+                            bool block)
+{
+    pipe_t* p = h->pipe;
+
+    // Only look at the consumers once per batch. Their refcount is on the same
+    // cache line as end_lock, which all the other producers are hammering.
+    if(h->pending + count > h->capacity)
+    {
+        if(!flush_pending(h, deadline, block))
+            return PIPE_WOULD_BLOCK;
+
+        // Nobody's listening, so there's no point holding on to anything.
+        if(unlikely(load_acquire(&p->consumer_refcount) == 0))
+            return 0;
+    }
+
+    // Too big to be worth batching. The batch is empty by now, so this can go
+    // straight in without jumping the queue.
+    if(unlikely(count >= h->capacity))
+        return push_to(p, h->shard, elems, count, deadline, block);
+
+    // Reading the clock is cheap, but not free, so only do it if we have to.
+    uint64_t now = h->flush_age_ms ? now_ms() : 0;
+
+    if(h->pending == 0)
+        h->since = now;
+
+    memcpy(h->batch + h->pending, elems, count);
+    h->pending += count;
+
+    // The elements are ours now, whether or not they make it all the way in
+    // yet. If they don't, they're first in line next time.
+    if(h->pending == h->capacity
+    || (h->flush_age_ms && now - h->since >= h->flush_age_ms))
+        flush_pending(h, deadline, block);
+
+    return count;
+}
+
+// Pushes `count' bytes through whatever kind of handle `handle' is. Returns
+// what push_bytes or try_push_bytes would.
+static inline size_t handle_push_bytes(pipe_producer_t* handle,
+                                       const void* restrict elems,
+                                       size_t count,
+                                       const struct timespec* deadline,
+                                       bool block)
+{
+    buffered_producer_t* h = as_buffered_producer(handle);
+    shard_producer_t*    s = as_shard_producer(handle);
+
+    if(h)
+        return buffered_push(h, elems, count, deadline, block);
+
+    return push_to(PIPIFY(handle), s ? s->shard : 0, elems, count, deadline,
+                   block);
+}
+
+void pipe_push(pipe_producer_t* handle, const void* restrict elems, size_t count)
+{
+    handle_push_bytes(handle, elems, count * __pipe_elem_size(PIPIFY(handle)),
+                      NULL, true);
+}
+
+size_t pipe_push_priority(pipe_producer_t* handle,
+                          size_t level,
+                          const void* restrict elems,
+                          size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    assertume(p->engine == ENGINE_PRIORITY);
+    assertume(level < p->nparts);
+
+    if(unlikely(p->engine != ENGINE_PRIORITY || level >= p->nparts))
+        return 0;
+
+    size_t elem_size = __pipe_elem_size(p);
+
+    return part_push(p, level, elems, count * elem_size, NULL, true)
+         / elem_size;
+}
+
+void pipe_producer_flush(pipe_producer_t* handle)
+{
+    buffered_producer_t* h = as_buffered_producer(handle);
+
+    if(h)
+        flush_pending(h, NULL, true);
+}
+
+size_t pipe_push_timed(pipe_producer_t* handle,
+                       const void* restrict elems,
+                       size_t count,
+                       const struct timespec* deadline)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t elem_size = __pipe_elem_size(p);
+
+    if(unlikely(count == 0))
+        return 0;
+
+    size_t pushed = handle_push_bytes(handle, elems, count*elem_size, deadline,
+                                      true);
+
+    if(pushed == PIPE_WOULD_BLOCK)
+        return pushed;
+
+    pushed /= elem_size;
+
+    // Nothing got in. Did we run out of time, or are the consumers gone?
+    if(unlikely(pushed == 0) && load_acquire(&p->consumer_refcount) > 0)
+        return PIPE_WOULD_BLOCK;
+
+    return pushed;
+}
+
+// For pipe_try_push and pipe_try_pop. See pipe_producer_fd.
+static bool readable(pipe_t* p);
+static bool writable(pipe_t* p);
+static void rearm_fd(pipe_t* p,
+                     int fd,
+                     size_t* signaled,
+                     bool (*ready)(pipe_t*));
+
+size_t pipe_try_push(pipe_producer_t* handle,
+                     const void* restrict elems,
+                     size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t elem_size = __pipe_elem_size(p),
+           pushed;
+
+    if(unlikely(count == 0))
+        return 0;
+
+    count *= elem_size;
+
+    pushed = handle_push_bytes(handle, elems, count, NULL, false);
+
+    if(pushed == PIPE_WOULD_BLOCK)
+    {
+        if(unlikely(load_relaxed(&p->writable_fd) >= 0))
+            rearm_fd(p, p->writable_fd, &p->writable_signaled, writable);
+
+        return pushed;
+    }
+
+    return pushed / elem_size;
+}
+
+// Whether reservations and peeks work on `p'. The other engines don't keep
+// their elements in one buffer between begin and end.
+static inline bool has_spans(pipe_t* p)
+{
+    return p->engine == ENGINE_LOCKING || p->engine == ENGINE_SPSC;
+}
+
+// Describes the free space right after `s.end', which must be at least `bytes'
+// long. It wraps around to the start of the buffer if it has to.
+static inline void free_spans(snapshot_t s,
+                              size_t bytes,
+                              pipe_span_t* first,
+                              pipe_span_t* second)
+{
+    size_t at_end = wraps_around(s) || s.mirrored
+                  ? bytes
+                  : min(bytes, (size_t)(s.bufend - s.end));
+
+    *first  = (pipe_span_t) {
+        .data  = s.end,
+        .count = at_end / s.elem_size,
+    };
+
+    *second = (pipe_span_t) {
+        .data  = bytes > at_end ? s.buffer : NULL,
+        .count = (bytes - at_end) / s.elem_size,
+    };
+}
+
+size_t pipe_push_reserve(pipe_producer_t* handle,
+                         size_t count,
+                         pipe_span_t* first,
+                         pipe_span_t* second)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t elem_size = __pipe_elem_size(p),
+           bytes     = count * elem_size;
+
+    *first = *second = (pipe_span_t) { NULL, 0 };
+
+    assertume(has_spans(p)
+           && "Only locking and SPSC pipes can hand out spans of their buffer.");
+
+    if(unlikely(count == 0 || !has_spans(p)))
+        return 0;
+
+    // The reserved elements go in after whatever a buffered handle is holding
+    // on to, so that has to go in first.
+    buffered_producer_t* h = as_buffered_producer(handle);
+
+    if(h)
+        flush_pending(h, NULL, true);
+
+    snapshot_t s;
+
+    if(p->engine == ENGINE_SPSC)
+    {
+        s = spsc_producer_snapshot(p, bytes);
+
+        if(unlikely(bytes_in_use(s) == capacity(s)))
+        {
+            sleep_until_room(p, spsc_has_room, NULL);
+            s = spsc_producer_snapshot(p, bytes);
+        }
+
+        if(unlikely(load_relaxed(&p->consumer_refcount) == 0))
+            return 0;
+
+        bytes = min(bytes, capacity(s) - bytes_in_use(s));
+    }
+    else
+    {
+        mutex_lock(&p->end_lock);
+
+        size_t max_cap;
+        s = wait_for_room(p, &max_cap, NULL);
+
+        if(unlikely(p->consumer_refcount == 0))
+        {
+            mutex_unlock(&p->end_lock);
+            return 0;
+        }
+
+        s     = validate_size(p, s, bytes, true);
+        bytes = min(bytes, max_cap - bytes_in_use(s));
+
+        // end_lock stays locked until pipe_push_commit. This keeps out the
+        // other producers, as well as anybody trying to resize the buffer.
+    }
+
+    free_spans(s, bytes, first, second);
+    p->reserved = bytes;
+
+    return bytes / elem_size;
+}
+
+void pipe_push_commit(pipe_producer_t* handle, size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t elem_size = __pipe_elem_size(p),
+           bytes     = count * elem_size;
+
+    assertume(bytes <= p->reserved
+           && "Committing more elements than were reserved.");
+
+    p->reserved = 0;
+
+    char* end = wrap_ptr_if_necessary(p->buffer, p->end + bytes, p->bufend);
+
+    if(p->engine == ENGINE_SPSC)
+    {
+        store_release(&p->end, end);
+        notify_pushed(p, count);
+
+        return;
+    }
+
+    p->end = end;
+    check_invariants(p);
+
+    note_high_water(p, bytes_in_use(make_snapshot(p)));
+
+    mutex_unlock(&p->end_lock);
+
+    notify_pushed(p, count);
+}
+
+// Describes the first `bytes' bytes of elements in the pipe, which come right
+// after the sentinel. They wrap around to the start of the buffer if they have
+// to.
+static inline void used_spans(snapshot_t s,
+                              size_t bytes,
+                              pipe_const_span_t* first,
+                              pipe_const_span_t* second)
+{
+    char* start = s.begin + s.elem_size;
+
+    if(!s.mirrored)
+        start = wrap_ptr_if_necessary(s.buffer, start, s.bufend);
+
+    size_t at_end = s.mirrored
+                  ? bytes
+                  : min(bytes, (size_t)(s.bufend - start));
+
+    *first  = (pipe_const_span_t) {
+        .data  = start,
+        .count = at_end / s.elem_size,
+    };
+
+    *second = (pipe_const_span_t) {
+        .data  = bytes > at_end ? s.buffer : NULL,
+        .count = (bytes - at_end) / s.elem_size,
+    };
+}
+
+size_t pipe_pop_peek(pipe_consumer_t* handle,
+                     size_t count,
+                     pipe_const_span_t* first,
+                     pipe_const_span_t* second)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t elem_size = __pipe_elem_size(p),
+           bytes     = count * elem_size;
+
+    *first = *second = (pipe_const_span_t) { NULL, 0 };
+
+    // A buffered handle shows what it has cached before anything in the pipe.
+    // That works with every engine, since the cache is always contiguous.
+    buffered_consumer_t* c = as_buffered_consumer(handle);
+
+    if(c && c->begin != c->end && count > 0)
+    {
+        c->peeked = min(bytes, c->end - c->begin);
+
+        *first = (pipe_const_span_t) {
+            .data  = c->batch + c->begin,
+            .count = c->peeked / elem_size,
+        };
+
+        return first->count;
+    }
+
+    assertume(has_spans(p)
+           && "Only locking and SPSC pipes can hand out spans of their buffer.");
+
+    if(unlikely(count == 0 || !has_spans(p)))
+        return 0;
+
+    snapshot_t s;
+
+    if(p->engine == ENGINE_SPSC)
+    {
+        s = spsc_consumer_snapshot(p, bytes);
+
+        if(unlikely(bytes_in_use(s) == 0))
+        {
+            sleep_until_elements(p, spsc_has_elements, NULL);
+            s = spsc_consumer_snapshot(p, bytes);
+        }
+    }
+    else
+    {
+        mutex_lock(&p->begin_lock);
+
+        s = wait_for_elements(p, NULL);
+
+        if(unlikely(bytes_in_use(s) == 0))
+        {
+            mutex_unlock(&p->begin_lock);
+            return 0;
+        }
+
+        // begin_lock stays locked until pipe_pop_release. This keeps out the
+        // other consumers, as well as anybody trying to resize the buffer.
+    }
+
+    bytes = min(bytes, bytes_in_use(s));
+
+    used_spans(s, bytes, first, second);
+    p->peeked = bytes;
+
+    return bytes / elem_size;
+}
+
+void pipe_pop_release(pipe_consumer_t* handle, size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t elem_size = __pipe_elem_size(p),
+           bytes     = count * elem_size;
+
+    buffered_consumer_t* c = as_buffered_consumer(handle);
+
+    if(c && c->peeked)
+    {
+        assertume(bytes <= c->peeked
+               && "Releasing more elements than were peeked at.");
+
+        c->begin += bytes;
+        c->peeked = 0;
+
+        return;
+    }
+
+    assertume(bytes <= p->peeked
+           && "Releasing more elements than were peeked at.");
+
+    p->peeked = 0;
+
+    // Moving the sentinel forward by `bytes' is exactly what
+    // pop_without_locking does, minus the copying.
+    char* begin = wrap_ptr_if_necessary(p->buffer, p->begin + bytes, p->bufend);
+
+    if(p->engine == ENGINE_SPSC)
+    {
+        store_release(&p->begin, begin);
+        notify_popped(p, count);
+
+        return;
+    }
+
+    p->begin = begin;
+    check_invariants(p);
+
+    // Now that nobody is looking at the old elements, the buffer may shrink.
+    trim_buffer(p, make_snapshot(p), true);
+
+    notify_popped(p, count);
+}
+
+// Keeps popping until `target' is full, the producers are gone, or `deadline'
+// passes. Returns the number of elements popped, or PIPE_WOULD_BLOCK if the
+// deadline passed before there were any.
+static size_t pop_until(pipe_consumer_t* handle,
+                        void* target,
+                        size_t count,
+                        const struct timespec* deadline)
+{
+    size_t elem_size = __pipe_elem_size(PIPIFY(handle));
+
+    size_t bytes_left  = count*elem_size;
+    size_t bytes_popped = 0;
+    size_t ret = -1;
+
+    do {
+        ret = handle_pop_bytes(handle, target, bytes_left, deadline, true);
+
+        if(unlikely(ret == PIPE_WOULD_BLOCK))
+            return bytes_popped ? bytes_popped / elem_size : ret;
+
+        target = (void*)((char*)target + ret);
+        bytes_popped += ret;
+        bytes_left   -= ret;
+    } while(ret != 0 && bytes_left);
+
+    return bytes_popped / elem_size;
+}
+
+size_t pipe_pop(pipe_consumer_t* p, void* target, size_t count)
+{
+    return pop_until(p, target, count, NULL);
+}
+
+size_t pipe_pop_timed(pipe_consumer_t* p,
+                      void* target,
+                      size_t count,
+                      const struct timespec* deadline)
+{
+    return pop_until(p, target, count, deadline);
+}
 
-    return s;
+size_t pipe_pop_eager(pipe_consumer_t* p, void* target, size_t count)
+{
+    size_t elem_size = __pipe_elem_size(PIPIFY(p));
+    return handle_pop_bytes(p, target, count*elem_size, NULL, true) / elem_size;
 }
 
-void __pipe_push(pipe_t* p,
-                 const void* restrict elems,
-                 size_t count)
+size_t pipe_pop_eager_timed(pipe_consumer_t* p,
+                            void* target,
+                            size_t count,
+                            const struct timespec* deadline)
 {
-    size_t elem_size = __pipe_elem_size(p);
+    size_t elem_size = __pipe_elem_size(PIPIFY(p)),
+           popped    = handle_pop_bytes(p, target, count*elem_size, deadline,
+                                        true);
 
-    if(unlikely(count == 0))
-        return;
+    return popped == PIPE_WOULD_BLOCK ? popped : popped / elem_size;
+}
 
-    size_t pushed = 0;
+size_t pipe_try_pop(pipe_consumer_t* handle, void* target, size_t count)
+{
+    pipe_t* p = PIPIFY(handle);
 
-    { mutex_lock(&p->end_lock);
-        size_t max_cap;
-        snapshot_t s = wait_for_room(p, &max_cap);
+    size_t elem_size = __pipe_elem_size(p),
+           popped;
 
-        // if no more consumers...
-        if(unlikely(p->consumer_refcount == 0))
-        {
-            mutex_unlock(&p->end_lock);
-            return;
-        }
+    if(unlikely(count == 0))
+        return 0;
 
-        s = validate_size(p, s, count);
+    popped = handle_pop_bytes(handle, target, count * elem_size, NULL, false);
 
-        // Finally, we can now begin with pushing as many elements into the
-        // queue as possible.
-        p->end = process_push(s, elems,
-                     pushed = min(count, max_cap - bytes_in_use(s)));
-    } mutex_unlock(&p->end_lock);
+    if(popped == PIPE_WOULD_BLOCK)
+    {
+        if(unlikely(load_relaxed(&p->readable_fd) >= 0))
+            rearm_fd(p, p->readable_fd, &p->readable_signaled, readable);
 
-    assertume(pushed > 0);
+        return popped;
+    }
 
-    // Signal if we've only pushed one element, broadcast if we've pushed more.
-    if(unlikely(pushed == elem_size))
-        cond_signal(&p->just_pushed);
-    else
-        cond_broadcast(&p->just_pushed);
+    return popped / elem_size;
+}
 
-    // We might not be done pushing. If the max_cap was reached, we'll need to
-    // recurse.
-    size_t bytes_remaining = count - pushed;
+// Whether popping from `p' would return without waiting, because it has
+// elements, or because it never will again.
+static bool readable(pipe_t* p)
+{
+    if(load_acquire(&p->producer_refcount) == 0)
+        return true;
 
-    if(unlikely(bytes_remaining))
-        __pipe_push(p, (const char*)elems + pushed, bytes_remaining);
+    switch(p->engine)
+    {
+    case ENGINE_SPSC:      return spsc_has_elements(p);
+    case ENGINE_MPMC:      return mpmc_has_elements(p);
+    case ENGINE_SEGMENTED: return seg_has_elements(p);
+    case ENGINE_PRIORITY:
+    case ENGINE_SHARDED:   return parts_have_elements(p);
+    case ENGINE_BROADCAST: return false; // Pops need a handle.
+    default:               return has_elements(p);
+    }
 }
 
-void pipe_push(pipe_producer_t* p, const void* restrict elems, size_t count)
+// Whether pushing into `p' would return without waiting, because it has room,
+// or because nobody's left to pop. For priority pipes, that's room in the
+// lowest level, since that's where plain pushes, the only ones that can be
+// tried, go. For sharded pipes, it's room in any shard, since every handle
+// pushes into a different one.
+static bool writable(pipe_t* p)
 {
-    pipe_t* p0 = PIPIFY(p);
-    count *= __pipe_elem_size(p0);
-    __pipe_push(p0, elems, count);
+    if(load_acquire(&p->consumer_refcount) == 0)
+        return true;
+
+    switch(p->engine)
+    {
+    case ENGINE_SPSC:      return spsc_has_room(p);
+    case ENGINE_MPMC:      return mpmc_has_room(p);
+    case ENGINE_SEGMENTED: return seg_has_room(p);
+    case ENGINE_BROADCAST: return bcast_has_room(p);
+    case ENGINE_PRIORITY:  return has_room(p->parts[p->nparts - 1]);
+    case ENGINE_SHARDED:
+        for(size_t i = 0; i < p->nparts; ++i)
+            if(has_room(p->parts[i]))
+                return true;
+
+        return false;
+    default:               return has_room(p);
+    }
 }
 
-/*
-#ifdef PIPE_DEBUG
-// For testing/debugging only, and is only available in debug mode. Assuming a
-// pipe of ints, prints them out. This function is not included or documented
-// in the header file!
+// The same for `handle', which may have elements of its own.
+static bool consumer_ready(pipe_consumer_t* handle)
+{
+    buffered_consumer_t*  c = as_buffered_consumer(handle);
+    broadcast_consumer_t* b = as_broadcast_consumer(handle);
 
-#include <stdio.h>
+    if(c && c->begin != c->end)
+        return true;
 
-void pipe_debug(pipe_t* p, const char* id)
-{
-    printf("%s: [ ", id);
-    for(int* ptr = (int*)p->buffer; ptr != (int*)p->bufend; ++ptr)
-        printf("%i ", *ptr);
-    printf("]\n");
-    printf("begin: %lu    end: %lu\n", p->begin - p->buffer, p->end - p->buffer);
+    if(b)
+        return b->dropped || bcast_has_elements(b);
+
+    return readable(PIPIFY(handle));
 }
-#endif
-*/
 
-// Waits for at least one element to be in the pipe. p->begin_lock must be
-// locked when entering this function, and a new, valid snapshot is returned.
-static inline snapshot_t wait_for_elements(pipe_t* p)
+// Fills in `ready' for every consumer, and returns how many are.
+static size_t scan_consumers(pipe_consumer_t* const* consumers,
+                             size_t count,
+                             int* ready)
 {
-    snapshot_t s = make_snapshot(p);
-
-    size_t bytes_used = bytes_in_use(s);
+    size_t n = 0;
 
-    for(; unlikely(bytes_used == 0) && likely(p->producer_refcount > 0);
-          s = make_snapshot(p),
-          bytes_used = bytes_in_use(s))
-        cond_wait(&p->just_pushed, &p->begin_lock);
+    for(size_t i = 0; i < count; ++i)
+        n += ready[i] = consumer_ready(consumers[i]);
 
-    return s;
+    return n;
 }
 
-// wow, I didn't even intend for the name to work like that...
-// returns a new snapshot, with the updated changes also reflected onto the
-// pipe.
-static inline snapshot_t pop_without_locking(snapshot_t s,
-                                             void* restrict target,
-                                             size_t bytes_to_copy,
-                                             char** begin // [out]
-                                            )
+// Most selects are over a handful of pipes, so their selectors go on the stack
+// up to this many.
+#define SELECT_STACK 16
+
+size_t pipe_select(pipe_consumer_t* const* consumers,
+                   size_t count,
+                   int* ready,
+                   const struct timespec* deadline)
 {
-    assertume(s.begin != s.bufend);
+    size_t n = scan_consumers(consumers, count, ready);
 
-    size_t elem_size = s.elem_size;
+    if(n || count == 0)
+        return n;
 
-    // Copy either as many bytes as requested, or the available bytes in the RHS
-    // of a wrapped buffer - whichever is smaller.
+    selector_t  local[SELECT_STACK];
+    selector_t* selectors = local;
+
+    if(count > SELECT_STACK)
     {
-        size_t first_bytes_to_copy = min(bytes_to_copy, (size_t)(s.bufend - s.begin - elem_size));
+        selectors = alloc_bytes(PIPIFY(consumers[0]), count * sizeof *selectors);
 
-        target = offset_memcpy(target, s.begin + elem_size, first_bytes_to_copy);
+        if(unlikely(selectors == NULL))
+            return PIPE_WOULD_BLOCK;
+    }
 
-        bytes_to_copy -= first_bytes_to_copy;
+    event_t ev;
+    event_init(&ev);
 
-        s.begin       += first_bytes_to_copy;
-        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+    for(size_t i = 0; i < count; ++i)
+    {
+        pipe_t* p = PIPIFY(consumers[i]);
+
+        mutex_lock(&p->select_lock);
+            selectors[i] = (selector_t) { .ev = &ev, .next = p->selectors };
+            store_relaxed(&p->selectors, &selectors[i]);
+        mutex_unlock(&p->select_lock);
     }
 
-    if(unlikely(bytes_to_copy > 0))
+    // Every push into any of the pipes from here on wakes us up, so look again
+    // and sleep until one does.
+    for(;;)
     {
-        s.begin += elem_size;
-        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+        unsigned key = event_prepare(&ev);
 
-        memcpy(target, s.begin, bytes_to_copy);
+        if((n = scan_consumers(consumers, count, ready)))
+        {
+            event_cancel(&ev);
+            break;
+        }
 
-        s.begin += bytes_to_copy;
-        s.begin = wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+        if(!event_wait(&ev, key, deadline))
+        {
+            if((n = scan_consumers(consumers, count, ready)) == 0)
+                n = PIPE_WOULD_BLOCK;
 
-        s.begin -= elem_size;
-        s.begin = rev_wrap_ptr_if_necessary(s.buffer, s.begin, s.bufend);
+            break;
+        }
     }
 
-    // Since we cached begin on the stack, we need to reflect our changes back
-    // on the pipe.
-    *begin = s.begin;
+    for(size_t i = 0; i < count; ++i)
+    {
+        pipe_t* p = PIPIFY(consumers[i]);
 
-    return s;
+        mutex_lock(&p->select_lock);
+            selector_t** link = &p->selectors;
+
+            while(*link != &selectors[i])
+                link = &(*link)->next;
+
+            store_relaxed(link, selectors[i].next);
+        mutex_unlock(&p->select_lock);
+    }
+
+    event_destroy(&ev);
+
+    if(selectors != local)
+        free_bytes(PIPIFY(consumers[0]), selectors, count * sizeof *selectors);
+
+    return n;
 }
 
-// If the buffer is shrunk to something a lot smaller than our current
-// capacity, resize it to something sane. This function must be entered with
-// only p->begin_lock locked, and will automatically unlock p->begin_lock on
-// exit.
-static inline void trim_buffer(pipe_t* p, snapshot_t s)
+// Hands out `*fd', making it first if need be. A new one starts out readable if
+// `ready' already is.
+static int watch_fd(pipe_t* p,
+                    int* fd,
+                    size_t* signaled,
+                    bool (*ready)(pipe_t*))
 {
-    size_t cap = capacity(s);
+#if HAVE_EVENTFD
+    int result;
 
-    // We have a sane size. We're done here.
-    if(likely(bytes_in_use(s) > cap / 4))
-    {
-        mutex_unlock(&p->begin_lock);
-        return;
-    }
+    mutex_lock(&p->select_lock);
+        if(*fd < 0)
+        {
+            int created = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
 
-    // Okay, we need to resize now. Upgrade our lock so we can check again. The
-    // weird lock/unlock order is to make sure we always acquire the end_lock
-    // before begin_lock. Deadlock can arise otherwise.
-    mutex_unlock(&p->begin_lock);
-    mutex_lock(&p->end_lock);
-    mutex_lock(&p->begin_lock);
+            if(created >= 0)
+            {
+                store_relaxed(fd, created);
+                full_fence();
 
-    s   = make_snapshot(p);
-    cap = capacity(s);
+                if(ready(p))
+                    signal_fd(created, signaled);
+            }
+        }
 
-    // To conserve space like the good computizens we are, we'll shrink
-    // our buffer if our memory usage efficiency drops below 25%. However,
-    // since shrinking/growing the buffer is the most expensive part of a push
-    // or pop, we only shrink it to bring us up to a 50% efficiency. A common
-    // pipe usage pattern is sudden bursts of pushes and pops. This ensures it
-    // doesn't get too time-inefficient.
-    if(likely(bytes_in_use(s) <= cap / 4))
-        resize_buffer(p, cap / 2);
+        result = *fd;
+    mutex_unlock(&p->select_lock);
 
-    // All done. Unlock the pipe. The reason we don't let the calling function
-    // unlock begin_lock is so that we can do it BEFORE end_lock. This prevents
-    // the lock order from being fudged.
-    mutex_unlock(&p->begin_lock);
-    mutex_unlock(&p->end_lock);
+    return result;
+#else
+    (void)p; (void)fd; (void)signaled; (void)ready;
+    return -1;
+#endif
 }
 
-// Performs the actual pop, except `requested' is now in bytes as opposed to
-// elements.
-//
-// This will behave eagerly, returning as many elements that it can into
-// `target' as it can fill right now.
-static inline size_t __pipe_pop(pipe_t* p,
-                                void* restrict target,
-                                size_t requested)
+// Called when a pipe_try_* call would have blocked. Drains `fd', so that it
+// only comes up again once `ready' might have changed, unless it already has.
+// The fence pairs with the one in notify_pushed and notify_popped.
+static void rearm_fd(pipe_t* p,
+                     int fd,
+                     size_t* signaled,
+                     bool (*ready)(pipe_t*))
 {
-    if(unlikely(requested == 0))
+#if HAVE_EVENTFD
+    uint64_t count;
+    ssize_t  drained = read(fd, &count, sizeof count);
+    (void)drained;
+
+    store_relaxed(signaled, 0);
+    full_fence();
+
+    if(ready(p))
+        signal_fd(fd, signaled);
+#else
+    (void)p; (void)fd; (void)signaled; (void)ready;
+#endif
+}
+
+int pipe_consumer_fd(pipe_consumer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    // Every broadcast consumer sees something different.
+    if(p->engine == ENGINE_BROADCAST)
+        return -1;
+
+    return watch_fd(p, &p->readable_fd, &p->readable_signaled, readable);
+}
+
+int pipe_producer_fd(pipe_producer_t* handle)
+{
+    pipe_t* p = PIPIFY(handle);
+    return watch_fd(p, &p->writable_fd, &p->writable_signaled, writable);
+}
+
+// Whether there's room for the record a producer is waiting to push. See
+// `record_room'.
+static bool has_record_room(pipe_t* p)
+{
+    return bytes_in_use(racy_snapshot(p)) + load_relaxed(&p->record_room)
+        <= load_relaxed(&p->max_cap);
+}
+
+pipe_t* pipe_new_records(size_t limit)
+{
+    pipe_t* p = pipe_new(1, limit);
+
+    if(likely(p))
+        p->records = true;
+
+    return p;
+}
+
+size_t pipe_push_record(pipe_producer_t* handle,
+                        const void* restrict record,
+                        size_t size)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t needed = sizeof size + size;
+
+    assertume(p->records && !as_buffered_producer(handle)
+           && "Records can only be pushed through a plain handle to a record pipe.");
+
+    if(unlikely(size == 0 || needed > p->max_cap))
         return 0;
 
-    size_t popped = 0;
+    { mutex_lock(&p->end_lock);
+        snapshot_t s = make_snapshot(p);
 
-    { mutex_lock(&p->begin_lock);
-        snapshot_t s      = wait_for_elements(p);
-        size_t bytes_used = bytes_in_use(s);
+        while(unlikely(bytes_in_use(s) + needed > p->max_cap)
+           && likely(p->consumer_refcount > 0))
+        {
+            store_relaxed(&p->record_room, needed);
 
-        if(unlikely(bytes_used == 0))
+            wait_on(p, has_record_room, &p->end_lock, &p->just_popped,
+                    &p->consumer_refcount, NULL);
+
+            s = make_snapshot(p);
+        }
+
+        if(unlikely(p->consumer_refcount == 0))
         {
-            mutex_unlock(&p->begin_lock);
+            mutex_unlock(&p->end_lock);
             return 0;
         }
 
-        check_invariants(p);
+        s = validate_size(p, s, needed, true);
 
-        s = pop_without_locking(s, target,
-                                popped = min(requested, bytes_used),
-                                &p->begin
-        );
+        size_t used = bytes_in_use(s);
 
+        s.end  = process_push(s, &size, sizeof size);
+        p->end = process_push(s, record, size);
         check_invariants(p);
 
-        trim_buffer(p, s);
-    } // p->begin_lock was unlocked by trim_buffer.
+        note_high_water(p, used + needed);
+    } mutex_unlock(&p->end_lock);
 
-    assertume(popped);
+    notify_pushed(p, 1);
 
-    if(unlikely(popped == __pipe_elem_size(p)))
-        cond_signal(&p->just_popped);
-    else
-        cond_broadcast(&p->just_popped);
+    return size;
+}
 
-    return popped;
+size_t pipe_pop_record(pipe_consumer_t* handle, void* restrict target, size_t max)
+{
+    pipe_t* p = PIPIFY(handle);
+
+    size_t size;
+    char*  begin;
+
+    assertume(p->records && !as_buffered_consumer(handle)
+           && "Records can only be popped through a plain handle to a record pipe.");
+
+    mutex_lock(&p->begin_lock);
+
+    snapshot_t s = wait_for_elements(p, NULL);
+
+    if(unlikely(bytes_in_use(s) == 0))
+    {
+        mutex_unlock(&p->begin_lock);
+        return 0;
+    }
+
+    // Read the size without moving `begin', so that a record too big for
+    // `target' can stay where it is.
+    s = pop_without_locking(s, &size, sizeof size, &begin);
+
+    if(unlikely(size > max))
+    {
+        mutex_unlock(&p->begin_lock);
+        return size;
+    }
+
+    s = pop_without_locking(s, target, size, &p->begin);
+    check_invariants(p);
+
+    trim_buffer(p, s, true);
+
+    notify_popped(p, sizeof size + size);
+
+    return size;
 }
 
-size_t pipe_pop(pipe_consumer_t* p, void* target, size_t count)
+void* pipe_pool_acquire(pipe_producer_t* handle)
 {
-    size_t elem_size = __pipe_elem_size(PIPIFY(p));
+    pool_t* pool = PIPIFY(handle)->pool;
+    void*   buf;
 
-    size_t bytes_left  = count*elem_size;
-    size_t bytes_popped = 0;
-    size_t ret = -1;
+    assertume(pool && "Not a pooled pipe.");
 
-    do {
-        ret = __pipe_pop(PIPIFY(p), target, bytes_left);
-        target = (void*)((char*)target + ret);
-        bytes_popped += ret;
-        bytes_left   -= ret;
-    } while(ret != 0 && bytes_left);
+    return pipe_pop(pool->take, &buf, 1) ? buf : NULL;
+}
 
-    return bytes_popped / elem_size;
+void pipe_pool_release(pipe_consumer_t* handle, void* buf)
+{
+    pool_t* pool = PIPIFY(handle)->pool;
+
+    assertume(pool && "Not a pooled pipe.");
+
+    assertume(in_bounds(pool->buffers, (char*)buf,
+                        pool->buffers + (pool->count - 1) * pool->stride)
+           && ((char*)buf - pool->buffers) % pool->stride == 0
+           && "Releasing a buffer that didn't come from this pool.");
+
+    pipe_push(pool->give, &buf, 1);
 }
 
-size_t pipe_pop_eager(pipe_consumer_t* p, void* target, size_t count)
+void pipe_set_capacity_policy(pipe_generic_t* gen,
+                              const pipe_capacity_policy_t* policy)
 {
-    size_t elem_size = __pipe_elem_size(PIPIFY(p));
-    return __pipe_pop(PIPIFY(p), target, count*elem_size) / elem_size;
+    pipe_t* p = PIPIFY(gen);
+
+    assertume(policy->growth_percent != 0);
+    assertume(policy->shrink_percent <= 50);
+
+    WHILE_LOCKED(
+        p->policy = *policy;
+
+        if(p->policy.growth_percent == 0)
+            p->policy.growth_percent = DEFAULT_POLICY.growth_percent;
+
+        // Any more, and halving the buffer might not leave room for what's
+        // already in it.
+        p->policy.shrink_percent = min(p->policy.shrink_percent, 50);
+
+        // Start both clocks fresh, so that the new policy doesn't act on what
+        // happened under the old one.
+        p->last_resize      =
+        p->high_water_since = now_ms();
+        p->prev_high_water  = 0;
+
+        // Locking pipes are the only ones that ever resize.
+        if(p->engine == ENGINE_LOCKING)
+            store_relaxed(&p->high_water, bytes_in_use(make_snapshot(p)));
+    );
+
+    // The parts of a priority or sharded pipe are what actually grow and shrink.
+    for(size_t i = 0; i < p->nparts; ++i)
+        pipe_set_capacity_policy(PIPE_GENERIC(p->parts[i]), policy);
+}
+
+pipe_capacity_policy_t pipe_get_capacity_policy(pipe_generic_t* gen)
+{
+    pipe_t* p = PIPIFY(gen);
+    pipe_capacity_policy_t policy;
+
+    WHILE_LOCKED(policy = p->policy;);
+
+    return policy;
 }
 
 void pipe_reserve(pipe_generic_t* gen, size_t count)
@@ -1109,7 +5859,12 @@ void pipe_reserve(pipe_generic_t* gen, size_t count)
     count *= __pipe_elem_size(p); // now `count' is in "bytes" instead of "elements".
 
     if(count == 0)
-        count = DEFAULT_MINCAP;
+        count = DEFAULT_MINCAP * __pipe_elem_size(p);
+
+    // The lock-free and static pipes are allocated at their full size from the
+    // start, and segmented pipes grow a chunk at a time.
+    if(p->engine != ENGINE_LOCKING || p->fixed)
+        return;
 
     size_t max_cap = p->max_cap;
 
@@ -1117,8 +5872,10 @@ void pipe_reserve(pipe_generic_t* gen, size_t count)
         if(unlikely(count <= bytes_in_use(make_snapshot(p))))
             break;
 
-        p->min_cap = min(count, max_cap);
+        // resize_buffer checks the invariants on the way in, so the new
+        // minimum can't go in until the buffer is big enough for it.
         resize_buffer(p, count);
+        p->min_cap = min(count, max_cap);
     );
 }
 
@@ -153,18 +153,336 @@ typedef struct pipe_generic_t  pipe_generic_t;
  */
 pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new(size_t elem_size, size_t limit);
 
+/*
+ * Where a pipe gets its memory from. `alloc' and `free' are required, and
+ * `realloc' may be NULL, in which case growing always allocates a new buffer
+ * and copies into it. Each function is passed `ctx' first. `free' and
+ * `realloc' are also told how big the block was when it was allocated, so
+ * arenas and pools don't have to keep track themselves.
+ *
+ * Memory from `alloc' and `realloc' must be aligned like malloc's. They may
+ * return NULL, but running out of memory while growing a pipe is fatal, just
+ * like with malloc. They may be called from any thread that uses the pipe,
+ * possibly at the same time, so they must be thread-safe.
+ */
+typedef struct {
+    void* (*alloc)  (void* ctx, size_t size);
+    void* (*realloc)(void* ctx, void* ptr, size_t old_size, size_t size);
+    void  (*free)   (void* ctx, void* ptr, size_t size);
+    void*   ctx;
+} pipe_allocator_t;
+
+/*
+ * Initializes a new pipe exactly like pipe_new, except that its memory comes
+ * from `allocator'. This includes the pipe_t itself, and every buffer it ever
+ * has. The allocator is copied, but `ctx' must stay valid until the last handle
+ * to the pipe is freed. If `allocator' is NULL, malloc is used, just like
+ * pipe_new.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT
+    pipe_new_ex(size_t elem_size, size_t limit, const pipe_allocator_t*);
+
+/*
+ * Flags for pipe_page_allocator.
+ */
+#define PIPE_ALLOC_HUGEPAGES  0x1 /* Back blocks of 2MB or more with hugepages. */
+#define PIPE_ALLOC_PREFAULT   0x2 /* Fault every page in up front.             */
+#define PIPE_ALLOC_NUMA_LOCAL 0x4 /* Prefer the caller's NUMA node for pages.   */
+
+/*
+ * Returns an allocator for pipe_new_ex that maps big buffers straight from the
+ * kernel. This is for big pipes, where TLB misses and page faults on the first
+ * burst of pushes show up as latency spikes. pipe_reserve the pipe up front to
+ * get all of its memory allocated at once.
+ *
+ * With PIPE_ALLOC_HUGEPAGES, explicitly reserved hugepages are used if there
+ * are any, and transparent hugepages otherwise. With PIPE_ALLOC_NUMA_LOCAL,
+ * the memory comes from the NUMA node of the thread calling this function, so
+ * call it from the consumer's thread. If that node runs out, it comes from
+ * another one instead.
+ *
+ * Blocks smaller than a page still come from malloc. The flags are only
+ * honored on Linux; elsewhere, this is the same as plain malloc.
+ */
+pipe_allocator_t pipe_page_allocator(unsigned flags);
+
+/*
+ * Initializes a new pipe, exactly like pipe_new, but on a buffer that is mapped
+ * into memory twice in a row. Elements never have to be split in two where the
+ * buffer wraps around, so every push and pop is a single copy, reservations and
+ * peeks always fit in `first', and growing the buffer doesn't copy elements.
+ * This is worth it for big batched pushes and pops.
+ *
+ * The buffer is rounded up to whole pages. Mirroring is only available on
+ * Linux; elsewhere, or if the kernel refuses, this is the same as pipe_new.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_mirrored(size_t elem_size,
+                                                         size_t limit);
+
+/*
+ * Initializes a new single-producer/single-consumer pipe. It is used exactly
+ * like a pipe from pipe_new, but at most one thread may be pushing and at most
+ * one thread may be popping at any given time. In exchange, pushes and pops
+ * don't take any locks unless the pipe is empty or full.
+ *
+ * `limit' must be nonzero. The whole buffer is allocated up front and never
+ * grows or shrinks, so pipe_reserve does nothing on these pipes.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_spsc(size_t elem_size,
+                                                     size_t limit);
+
+/*
+ * Initializes a new lock-free multi-producer/multi-consumer pipe. It is used
+ * exactly like a pipe from pipe_new, and has the same guarantees, but pushes
+ * and pops never take a lock unless they have to sleep because the pipe is
+ * full or empty. This is a good choice when many threads hammer the same pipe.
+ *
+ * `limit' must be nonzero, and is rounded up to a power of two. All the memory
+ * is allocated up front and never grows or shrinks, so pipe_reserve does
+ * nothing on these pipes.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_mpmc(size_t elem_size,
+                                                     size_t limit);
+
+/*
+ * Initializes a new pipe that keeps its elements in a list of fixed-size
+ * chunks instead of one buffer. It is used exactly like a pipe from pipe_new,
+ * but growing it just links on another chunk, so elements already in the pipe
+ * are never moved or copied, and drained chunks are given back as the pipe
+ * empties. This is a good choice for unbounded pipes that can get very big.
+ *
+ * `limit' works just like in pipe_new. pipe_reserve does nothing on these
+ * pipes.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_segmented(size_t elem_size,
+                                                          size_t limit);
+
+/*
+ * What a broadcast pipe does about a consumer that can't keep up.
+ */
+typedef enum {
+    PIPE_BROADCAST_BACKPRESSURE, /* Make the producers wait for it.           */
+    PIPE_BROADCAST_DROP,         /* Cut it off once it's a whole ring behind. */
+} pipe_broadcast_policy_t;
+
+/*
+ * Initializes a new pipe that gives every element to every consumer, instead
+ * of to exactly one. Each pipe_consumer_new handle sees everything pushed
+ * after it was made, in order, and nothing is copied more than once on the way
+ * in, no matter how many consumers there are. The elements stay in the pipe
+ * until the slowest consumer has popped them.
+ *
+ * `limit' must be nonzero, and is rounded up to a power of two. All the memory
+ * is allocated up front. With PIPE_BROADCAST_BACKPRESSURE, a full pipe makes
+ * the producers wait for the slowest consumer, just like any other pipe. With
+ * PIPE_BROADCAST_DROP, the producers never wait, and a consumer that falls
+ * `limit' elements behind loses them: its pops return 0 from then on, as if the
+ * pipe had closed, and pipe_consumer_dropped tells the two apart.
+ *
+ * Pops must go through a consumer handle, not the pipe_t, and buffered
+ * consumers aren't supported. Consumer pops never take a lock.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT
+    pipe_new_broadcast(size_t elem_size,
+                       size_t limit,
+                       pipe_broadcast_policy_t policy);
+
+/*
+ * Initializes a new pipe with `levels' priority levels, each of which is a
+ * separate queue of up to `limit' elements (0 for no limit). Level 0 is the
+ * highest priority. Push into a level with pipe_push_priority; plain pushes go
+ * into the lowest one. Pops always come from the highest level that has
+ * anything in it, so elements within a level stay in order, but a busy high
+ * level can keep the lower ones waiting forever.
+ *
+ * Unless `quota' is 0, that's bounded: once a level with elements has had
+ * `quota' elements popped ahead of it, its next pop comes from it instead,
+ * ahead of the higher ones.
+ *
+ * pipe_pop_eager and pipe_try_pop return elements from one level at a time,
+ * and pipe_pop picks again for every piece it fills `target' with.
+ * pipe_push_reserve and pipe_pop_peek aren't supported. A buffered consumer
+ * serves what it has cached before looking at the levels again, so keep its
+ * budget small.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_priority(size_t elem_size,
+                                                         size_t levels,
+                                                         size_t limit,
+                                                         size_t quota);
+
+/*
+ * Initializes a new pipe made of `shards' separate queues of up to `limit'
+ * elements each (0 for no limit), so that producers don't all line up for the
+ * same lock. Each pipe_producer_new or pipe_producer_new_buffered handle sticks
+ * to one shard, handed out round-robin, and pushes through the pipe_t itself go
+ * into the first. Give it at least as many shards as threads pushing at once.
+ *
+ * Consumers pop from the fullest shard, one shard at a time, so a busy shard
+ * doesn't fall behind quiet ones. Elements pushed through the same handle come
+ * out in the order they went in, just like any other pipe, but there is no
+ * order at all between handles.
+ *
+ * pipe_push_reserve and pipe_pop_peek aren't supported.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_sharded(size_t elem_size,
+                                                        size_t shards,
+                                                        size_t limit);
+
+/*
+ * Initializes a new pipe of variable-length records, which are packed back to
+ * back instead of each taking up a fixed-size element. Push and pop them with
+ * pipe_push_record and pipe_pop_record. Each record costs its own size, plus
+ * a sizeof(size_t) header.
+ *
+ * `limit' is in bytes, headers included, and works like in pipe_new
+ * otherwise. pipe_elem_size returns 1, and pipe_reserve takes bytes.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_records(size_t limit);
+
+/*
+ * Initializes a new pipe for passing big payloads around by address instead of
+ * copying them. It comes with a pool of `count' buffers of `buf_size' bytes
+ * each, all allocated up front. The pipe's elements are void* pointers to
+ * those buffers:
+ *
+ *   void* buf = pipe_pool_acquire(producer);
+ *   fill(buf);
+ *   pipe_push(producer, &buf, 1);
+ *
+ *   pipe_pop(consumer, &buf, 1);
+ *   use(buf);
+ *   pipe_pool_release(consumer, buf);
+ *
+ * Released buffers go back to the producers through a second, internal pipe.
+ * Once the pipe is made, nothing is allocated and no payload is ever copied.
+ * Both pipes are MPMC pipes, so the same restrictions apply. The buffers are
+ * freed along with the pipe, so don't hold on to one past the last handle.
+ */
+pipe_t* MALLOC_LIKE WARN_UNUSED_RESULT pipe_new_pooled(size_t buf_size,
+                                                       size_t count);
+
+/*
+ * Flags for pipe_new_static.
+ */
+#define PIPE_STATIC_MLOCK 0x1 /* Lock the pipe into RAM, so it never pages out. */
+
+/*
+ * Initializes a new pipe in `buf', which the caller owns, and which must stay
+ * valid until the last handle to the pipe is freed. Nothing is allocated,
+ * then or ever after: the pipe's bookkeeping goes at the front of `buf', and
+ * the elements fill the rest. The pipe never grows or shrinks, so
+ * pipe_reserve and the capacity policy do nothing on these pipes. Freeing the
+ * pipe leaves `buf' alone.
+ *
+ * Otherwise, it is used exactly like a pipe from pipe_new, with a limit of as
+ * many elements as fit. Use pipe_static_size to find out how big `buf' must be
+ * to hold `count' elements.
+ *
+ * Returns NULL if `buf' is too small for even one element, or if the memory
+ * couldn't be locked with PIPE_STATIC_MLOCK.
+ */
+pipe_t* WARN_UNUSED_RESULT pipe_new_static(size_t elem_size,
+                                           void* buf,
+                                           size_t buf_bytes,
+                                           unsigned flags);
+
+/*
+ * How big a buffer pipe_new_static needs to hold at least `count' elements.
+ */
+size_t pipe_static_size(size_t elem_size, size_t count);
+
+/*
+ * How a thread waits when the pipe is full (to push) or empty (to pop).
+ */
+typedef enum {
+    PIPE_WAIT_BLOCK,           /* Go straight to sleep. This is the default.   */
+    PIPE_WAIT_SPIN_THEN_BLOCK, /* Spin for a while first, then sleep.          */
+    PIPE_WAIT_YIELD,           /* Keep yielding the CPU to other threads.      */
+    PIPE_WAIT_BUSY_SPIN,       /* Keep spinning. Only sane on dedicated cores. */
+} pipe_wait_strategy_t;
+
+/*
+ * Sets how threads wait on this pipe. Sleeping is cheap for the machine but
+ * costly in latency, since the thread has to be woken up by the kernel. The
+ * other strategies trade CPU time for latency. With PIPE_WAIT_SPIN_THEN_BLOCK,
+ * `spins' is how many times to spin before sleeping; pass 0 to let the
+ * implementation decide. It's ignored by the other strategies.
+ *
+ * Call this right after creating the pipe, before making any producer_t or
+ * consumer_t handles.
+ */
+void NO_NULL_POINTERS pipe_set_wait_strategy(pipe_t*,
+                                             pipe_wait_strategy_t strategy,
+                                             size_t spins);
+
 /*
  * Makes a production handle to the pipe, allowing push operations. This
- * function is extremely cheap; it doesn't allocate memory.
+ * function is extremely cheap; it doesn't allocate memory, except on sharded
+ * pipes, where it returns NULL if it can't.
  */
 pipe_producer_t* NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_producer_new(pipe_t*);
 
+/*
+ * Makes a production handle that batches up to `batch' elements (or 64, if
+ * `batch' is 0) before pushing them all into the pipe at once. This takes the
+ * pipe's lock once per batch instead of once per push, which makes a big
+ * difference when lots of threads push one element at a time. Each thread
+ * should have its own buffered handle; they are not thread-safe.
+ *
+ * Elements sitting in the batch aren't visible to consumers until the batch is
+ * flushed. That happens when it fills up, when pipe_producer_flush or
+ * pipe_producer_free is called, and, if `flush_age_ms' is nonzero, on a push
+ * that finds the oldest element in the batch at least that old. There is no
+ * timer: a handle that goes quiet keeps its batch until it's flushed by hand.
+ * Reserving also flushes, as do the timed and try pushes when they need room
+ * in the batch.
+ *
+ * Unlike pipe_producer_new, this allocates, and returns NULL if it can't.
+ */
+pipe_producer_t* NO_NULL_POINTERS WARN_UNUSED_RESULT
+    pipe_producer_new_buffered(pipe_t*, size_t batch, unsigned flush_age_ms);
+
+/*
+ * Pushes everything a buffered handle is holding on to into the pipe, waiting
+ * for room if it has to. Does nothing to other handles.
+ */
+void NO_NULL_POINTERS pipe_producer_flush(pipe_producer_t*);
+
 /*
  * Makes a consumption handle to the pipe, allowing pop operations. This
- * function is extremely cheap; it doesn't allocate memory.
+ * function is extremely cheap; it doesn't allocate memory, except on broadcast
+ * pipes, where it returns NULL if it can't.
  */
 pipe_consumer_t* NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_consumer_new(pipe_t*);
 
+/*
+ * Whether a consumer of a PIPE_BROADCAST_DROP pipe fell so far behind that it
+ * was cut off. Always false for any other consumer.
+ */
+int NO_NULL_POINTERS pipe_consumer_dropped(pipe_consumer_t*);
+
+/*
+ * Makes a consumption handle that pops up to `budget' elements (or 64, if
+ * `budget' is 0) at a time into a private cache, then serves pops out of that
+ * until it runs dry. This takes the pipe's lock once per refill instead of
+ * once per pop. Pops at least as big as the budget skip the cache. Like
+ * buffered producers, these are for one thread each.
+ *
+ * Elements come out of one handle in the order they were pushed. Across
+ * handles, each refill takes a contiguous run, so another consumer may get to
+ * later elements while this one is still working through its cache. A handle
+ * can also sit on up to `budget' elements while the others find the pipe
+ * empty, so keep the budget small if consumers should share work evenly.
+ * Anything still cached when the handle is freed is lost.
+ *
+ * Peeking at a handle with a non-empty cache shows the cache, whatever the
+ * pipe's engine.
+ *
+ * Unlike pipe_consumer_new, this allocates, and returns NULL if it can't.
+ */
+pipe_consumer_t* NO_NULL_POINTERS WARN_UNUSED_RESULT
+    pipe_consumer_new_buffered(pipe_t*, size_t budget);
+
 /*
  * If you call *_new, you must call the corresponding *_free. Failure to do so
  * may result in resource leaks, undefined behavior, and spontaneous combustion.
@@ -177,6 +495,90 @@ void pipe_consumer_free(pipe_consumer_t*);
 /* Copies `count' elements from `elems' into the pipe. */
 void NO_NULL_POINTERS pipe_push(pipe_producer_t*, const void* elems, size_t count);
 
+/*
+ * Pushes `count' elements into level `level' of a pipe made with
+ * pipe_new_priority, waiting for room in that level if it has to. Returns how
+ * many were pushed, which is less than `count' only if all the consumers are
+ * gone. Skips any buffering the handle does.
+ */
+size_t NO_NULL_POINTERS pipe_push_priority(pipe_producer_t*,
+                                           size_t level,
+                                           const void* elems,
+                                           size_t count);
+
+/*
+ * Returned by the pipe_try_* and pipe_*_timed functions when they would have
+ * had to wait (any longer).
+ */
+#define PIPE_WOULD_BLOCK ((size_t)-1)
+
+/*
+ * Like pipe_push, except this never waits for room in the pipe, or for another
+ * thread that is holding it locked. As many of the `count' elements as fit
+ * right now are copied in, and the number pushed is returned. If none of them
+ * could be, PIPE_WOULD_BLOCK is returned instead.
+ *
+ * If this function returns 0, all the consumers are gone and there is no point
+ * in pushing anything.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_try_push(pipe_producer_t*,
+                                                         const void* elems,
+                                                         size_t count);
+
+struct timespec;
+
+/*
+ * Like pipe_push, except this gives up once `deadline' passes. The deadline is
+ * absolute, measured against CLOCK_MONOTONIC (the performance counter on
+ * windows). The number of elements pushed is returned, which is less than
+ * `count' if the deadline passed or all the consumers left part of the way
+ * through. If the deadline passed before any could be pushed, PIPE_WOULD_BLOCK
+ * is returned instead.
+ *
+ * If this function returns 0, all the consumers are gone and there is no point
+ * in pushing anything.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_push_timed(pipe_producer_t*,
+                                                           const void* elems,
+                                                           size_t count,
+                                                           const struct timespec* deadline);
+
+/*
+ * A run of `count' contiguous elements, starting at `data'.
+ */
+typedef struct {
+    void*  data;
+    size_t count;
+} pipe_span_t;
+
+/*
+ * Reserves room for up to `count' elements directly inside the pipe's buffer,
+ * so that they can be written in place instead of copied in with pipe_push.
+ * Like pipe_push, this blocks until there is room for at least one element.
+ *
+ * The number of elements reserved is returned. They are described by `first'
+ * followed by `second', since the free space may wrap around the end of the
+ * buffer. `second' is empty if it doesn't. If 0 is returned, all the consumers
+ * are gone and there is no point in pushing anything.
+ *
+ * Fill in the elements, then make them visible to the consumers with
+ * pipe_push_commit. Until then, no other thread may push into the pipe, so
+ * don't dawdle, and don't call any other push function in between. Not
+ * available on MPMC, segmented or broadcast pipes.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_push_reserve(pipe_producer_t*,
+                                                             size_t count,
+                                                             pipe_span_t* first,
+                                                             pipe_span_t* second);
+
+/*
+ * Pushes the first `count' elements written into the last reservation, which
+ * must be no more than the number reserved. The rest are discarded. This must
+ * be called exactly once after every nonzero pipe_push_reserve, from the same
+ * thread, even if `count' is 0.
+ */
+void NO_NULL_POINTERS pipe_push_commit(pipe_producer_t*, size_t count);
+
 /*
  * Copies `count' elements from `elems' into the pipe.
  *
@@ -230,6 +632,157 @@ size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_eager(pipe_consumer_t*,
                                                           void* target,
                                                           size_t count);
 
+/*
+ * Like pipe_pop_eager, except this never waits for elements to arrive, or for
+ * another thread that is holding the pipe locked. If there is nothing to pop
+ * right now, PIPE_WOULD_BLOCK is returned.
+ *
+ * If this function returns 0, there will be no more elements coming in. Every
+ * subsequent call will return 0.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_try_pop(pipe_consumer_t*,
+                                                        void* target,
+                                                        size_t count);
+
+/*
+ * Waits until at least one of the `count' consumers can pop without waiting,
+ * because it has elements, or because its producers are all gone. Sets
+ * `ready[i]' to nonzero for every one that can, and zero for the rest, and
+ * returns how many can. Gives up once `deadline' passes, if it isn't NULL,
+ * returning PIPE_WOULD_BLOCK. The deadline works like in pipe_pop_timed.
+ *
+ * This lets one thread serve any number of pipes, without a thread per pipe to
+ * wait on it. Nothing is popped; follow up with pipe_try_pop on the ready ones,
+ * which can still come up empty if another consumer got there first.
+ *
+ * Waiting on more than 16 consumers at a time allocates, with the allocator of
+ * the first one's pipe. If that fails, PIPE_WOULD_BLOCK is returned right away.
+ */
+size_t WARN_UNUSED_RESULT pipe_select(pipe_consumer_t* const* consumers,
+                                      size_t count,
+                                      int* ready,
+                                      const struct timespec* deadline);
+
+/*
+ * Return an eventfd for driving the pipe from an event loop, alongside sockets
+ * and other file descriptors. The one from pipe_consumer_fd becomes readable
+ * once a pop could succeed without waiting (the pipe has elements, or all the
+ * producers are gone), and the one from pipe_producer_fd once a push could
+ * (the pipe has room, or all the consumers are gone).
+ *
+ * Either one stays readable until a pipe_try_pop (or pipe_try_push) on the
+ * pipe returns PIPE_WOULD_BLOCK, so keep popping until one does before going
+ * back to epoll. Only the first push after that writes to the descriptor, not
+ * every one, and pipes that nobody asked for a descriptor pay nothing more
+ * than a load per push or pop. There's no need to read from it yourself.
+ *
+ * Every handle to a pipe shares its descriptors, which are made the first time
+ * they're asked for, and closed along with the pipe. Don't close them yourself.
+ * Returns -1 if eventfds aren't available, if one couldn't be made, or, for
+ * pipe_consumer_fd, on broadcast pipes.
+ */
+int NO_NULL_POINTERS pipe_consumer_fd(pipe_consumer_t*);
+int NO_NULL_POINTERS pipe_producer_fd(pipe_producer_t*);
+
+/*
+ * Like pipe_pop, except this gives up once `deadline' passes, returning however
+ * many elements it popped by then. The deadline is absolute, measured against
+ * CLOCK_MONOTONIC (the performance counter on windows). If the deadline passed
+ * before there were any elements to pop, PIPE_WOULD_BLOCK is returned.
+ *
+ * If this function returns 0, there will be no more elements coming in. Every
+ * subsequent call will return 0.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_timed(pipe_consumer_t*,
+                                                          void* target,
+                                                          size_t count,
+                                                          const struct timespec* deadline);
+
+/*
+ * Like pipe_pop_eager, except this gives up once `deadline' passes, returning
+ * PIPE_WOULD_BLOCK if there were no elements by then. It returns as soon as
+ * there are any, without waiting for more. The deadline works like in
+ * pipe_pop_timed.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_eager_timed(pipe_consumer_t*,
+                                                                void* target,
+                                                                size_t count,
+                                                                const struct timespec* deadline);
+
+/*
+ * A read-only run of `count' contiguous elements, starting at `data'.
+ */
+typedef struct {
+    const void* data;
+    size_t      count;
+} pipe_const_span_t;
+
+/*
+ * Looks at up to `count' elements at the front of the pipe without copying
+ * them out. Like pipe_pop_eager, this blocks until there is at least one
+ * element in the pipe, or all producer_t handles have been freed.
+ *
+ * The number of elements available is returned. They are described by `first'
+ * followed by `second', since they may wrap around the end of the buffer.
+ * `second' is empty if they don't. If 0 is returned, there will be no more
+ * elements coming in.
+ *
+ * The elements stay in the pipe until they are popped with pipe_pop_release.
+ * Until then, no other thread may pop from the pipe and the buffer won't be
+ * resized, so don't dawdle, and don't call any other pop function in between.
+ * Not available on MPMC, segmented or broadcast pipes.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_peek(pipe_consumer_t*,
+                                                         size_t count,
+                                                         pipe_const_span_t* first,
+                                                         pipe_const_span_t* second);
+
+/*
+ * Pops the first `count' elements of the last peek, which must be no more than
+ * the number peeked at. The rest stay in the pipe. This must be called exactly
+ * once after every nonzero pipe_pop_peek, from the same thread, even if `count'
+ * is 0.
+ */
+void NO_NULL_POINTERS pipe_pop_release(pipe_consumer_t*, size_t count);
+
+/*
+ * Takes a free buffer from a pooled pipe's pool, waiting until one is
+ * released if they're all in use. Returns NULL once all the consumers are
+ * gone, since no more buffers can come back.
+ */
+void* NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pool_acquire(pipe_producer_t*);
+
+/*
+ * Gives a buffer popped from a pooled pipe back to its pool, for a producer to
+ * acquire again. Each buffer must be released exactly once.
+ */
+void NO_NULL_POINTERS pipe_pool_release(pipe_consumer_t*, void* buf);
+
+/*
+ * Copies the `size'-byte record at `record' into a record pipe, waiting until
+ * there is room for all of it. Records are never split or interleaved. Returns
+ * `size', or 0 if all the consumers are gone. Empty records, and records that
+ * can never fit under the pipe's limit, are refused with 0.
+ *
+ * Buffered handles can't be used with record pipes.
+ */
+size_t NO_NULL_POINTERS pipe_push_record(pipe_producer_t*,
+                                         const void* record,
+                                         size_t size);
+
+/*
+ * Pops the next record from a record pipe into `target', which has room for
+ * `max' bytes, waiting until there is one. Returns the record's size. If that
+ * is more than `max', nothing is copied and the record stays in the pipe, so
+ * call again with a bigger `target'.
+ *
+ * If this function returns 0, there will be no more records coming in. Every
+ * subsequent call will return 0.
+ */
+size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_record(pipe_consumer_t*,
+                                                           void* target,
+                                                           size_t max);
+
 /*
  * Modifies the pipe to have room for at least `count' elements. If more room
  * is already allocated, the call does nothing. This can be useful if requests
@@ -240,6 +793,42 @@ size_t NO_NULL_POINTERS WARN_UNUSED_RESULT pipe_pop_eager(pipe_consumer_t*,
  */
 void NO_NULL_POINTERS pipe_reserve(pipe_generic_t*, size_t count);
 
+/*
+ * How a pipe's buffer grows when it runs out of room and shrinks when it's
+ * mostly empty. Resizing copies the elements and locks the whole pipe, so
+ * bursty traffic is better off with a policy that holds on to memory longer.
+ */
+typedef struct {
+    unsigned growth_percent;  /* How much to grow by, in percent of the old
+                                 size. 100 doubles it. Must be nonzero.     */
+    unsigned shrink_percent;  /* Halve the buffer once it's this full or
+                                 less, in percent. At most 50. 0 never
+                                 shrinks it.                                */
+    unsigned shrink_delay_ms; /* Don't shrink until at least this long after
+                                 the last resize.                           */
+    unsigned high_water_ms;   /* Don't shrink below the most the pipe has
+                                 held in about this long. Peaks are measured
+                                 in windows of this length, so one may be
+                                 remembered for up to twice as long.        */
+} pipe_capacity_policy_t;
+
+/*
+ * Changes the pipe's capacity policy. This may be called at any time, from any
+ * handle. The default is to double when full and halve at 25%, with no delay or
+ * high-water mark. pipe_reserve's minimum still applies on top of the policy.
+ *
+ * Only pipes from pipe_new and pipe_new_mirrored ever resize. Other pipes keep
+ * the policy, but never act on it.
+ */
+void NO_NULL_POINTERS pipe_set_capacity_policy(pipe_generic_t*,
+                                               const pipe_capacity_policy_t*);
+
+/*
+ * Returns the pipe's current capacity policy, for tweaking and setting back.
+ */
+pipe_capacity_policy_t NO_NULL_POINTERS
+    pipe_get_capacity_policy(pipe_generic_t*);
+
 /*
  * Determines the size of a pipe's elements. This can be used for generic
  * pipe-processing algorithms to reserve appropriately-sized buffers.
@@ -248,7 +837,7 @@ size_t PURE NO_NULL_POINTERS pipe_elem_size(pipe_generic_t*);
 
 /*
  * Use this to run the pipe self-test. It will call abort() if anything is
- * wrong. This is usually unnecessary. If this is never called, pipe_test.c
+ * wrong. This is usually unnecessary. If this is never called, pipe_suite.c
  * does not need to be linked.
  */
 void pipe_run_test_suite(void);
@@ -0,0 +1,155 @@
+/* pipe_bench.c - Throughput of the pipe engines, one producer thread against
+ *                one consumer thread, each pinned to a core of its own.
+ *
+ * The MIT License
+ * Copyright (c) 2011 Clark Gaebel <cg.wowus.cg@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#define _GNU_SOURCE // for pthread_setaffinity_np, and clock_gettime
+
+#include "pipe.h"
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+// The layout pipe.c was built with. `make bench' runs both, so they can be
+// compared side by side.
+#ifdef PIPE_PACKED_LAYOUT
+#define LAYOUT "packed"
+#else
+#define LAYOUT "padded"
+#endif
+
+// Enough to drown out thread startup, even with single-element batches.
+#define ELEMS 4000000
+
+typedef struct {
+    pipe_producer_t* prod;
+    size_t           batch;
+} bench_producer_t;
+
+// Whether there are enough cores to give the producer and consumer one each.
+// Without that, they take turns on one core, and never fight over a cache line
+// at all, so the layout can't make a difference.
+static int pinned;
+
+// Pins the calling thread to `cpu', if we're pinning.
+static void pin(int cpu)
+{
+    if(!pinned)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    if(pthread_setaffinity_np(pthread_self(), sizeof set, &set) != 0)
+        abort();
+}
+
+static double now_sec(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (double)t.tv_sec + (double)t.tv_nsec / 1e9;
+}
+
+static void* bench_push(void* arg)
+{
+    bench_producer_t* bp = arg;
+    uint64_t elems[256];
+
+    pin(0);
+
+    for(size_t i = 0; i < bp->batch; ++i)
+        elems[i] = i;
+
+    for(size_t i = 0; i < ELEMS; i += bp->batch)
+        pipe_push(bp->prod, elems, bp->batch);
+
+    pipe_producer_free(bp->prod);
+    return NULL;
+}
+
+// Pushes ELEMS elements through `p' in batches of `batch', and prints how many
+// million elements per second made it out the other side.
+static void bench(const char* name, pipe_t* p, size_t batch)
+{
+    bench_producer_t bp = { pipe_producer_new(p), batch };
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    uint64_t out[256];
+    size_t   popped = 0, n;
+    pthread_t t;
+
+    pin(1);
+
+    double start = now_sec();
+
+    if(pthread_create(&t, NULL, bench_push, &bp) != 0)
+        abort();
+
+    while((n = pipe_pop_eager(cons, out, batch)))
+        popped += n;
+
+    pthread_join(t, NULL);
+
+    double elapsed = now_sec() - start;
+
+    if(popped != ELEMS)
+        abort();
+
+    printf("%-6s %-10s batch %3zu  %8.2f Melem/s\n",
+           LAYOUT, name, batch, ELEMS / elapsed / 1e6);
+
+    pipe_consumer_free(cons);
+}
+
+int main(void)
+{
+    static const size_t batches[] = { 1, 16, 256 };
+
+    pinned = sysconf(_SC_NPROCESSORS_ONLN) >= 2;
+
+    if(!pinned)
+        printf("%s: only one core, so nothing is pinned, and there's no "
+               "false sharing to measure\n", LAYOUT);
+
+    for(size_t i = 0; i < sizeof batches / sizeof *batches; ++i)
+    {
+        size_t b = batches[i];
+
+        bench("locking",  pipe_new(sizeof(uint64_t), 4096),          b);
+        bench("spsc",     pipe_new_spsc(sizeof(uint64_t), 4096),     b);
+        bench("mpmc",     pipe_new_mpmc(sizeof(uint64_t), 4096),     b);
+        bench("mirrored", pipe_new_mirrored(sizeof(uint64_t), 4096), b);
+    }
+
+    return 0;
+}
+
+/* vim: set et ts=4 sw=4 softtabstop=4 textwidth=80: */
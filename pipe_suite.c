@@ -0,0 +1,3401 @@
+/* pipe_suite.c - The pipe self-test. This only needs to be linked if
+ *                pipe_run_test_suite is called.
+ *
+ * The MIT License
+ * Copyright (c) 2011 Clark Gaebel <cg.wowus.cg@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#define _POSIX_C_SOURCE 200112L // for clock_gettime and nanosleep
+
+#include "pipe.h"
+
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// Like assert, except it isn't compiled out with NDEBUG.
+#define check(cond)                                                    \
+    do {                                                               \
+        if(!(cond))                                                    \
+        {                                                              \
+            fprintf(stderr, "\n%s:%d: check failed: %s\n",             \
+                    __FILE__, __LINE__, #cond);                        \
+            abort();                                                   \
+        }                                                              \
+    } while(0)
+
+#define DEF_TEST(name) static void test_##name(void)
+
+#define RUN_TEST(name)                      \
+    do {                                    \
+        printf("%-28s", #name);             \
+        fflush(stdout);                     \
+        test_##name();                      \
+        printf("ok\n");                     \
+    } while(0)
+
+// Makes a pipe of `elem_size'-byte elements that holds at most `limit' of them.
+// The generic checks below run against every engine through one of these.
+typedef pipe_t* (*pipe_ctor_t)(size_t elem_size, size_t limit);
+
+static void sleep_ms(unsigned ms)
+{
+    struct timespec t = { ms / 1000, (long)(ms % 1000) * 1000000 };
+    nanosleep(&t, NULL);
+}
+
+// Milliseconds on CLOCK_MONOTONIC, which is what deadlines are measured against.
+static uint64_t now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (uint64_t)now.tv_sec * 1000 + (uint64_t)now.tv_nsec / 1000000;
+}
+
+static struct timespec deadline_in_ms(unsigned ms)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    t.tv_sec  += ms / 1000;
+    t.tv_nsec += (long)(ms % 1000) * 1000000;
+
+    if(t.tv_nsec >= 1000000000)
+    {
+        t.tv_sec++;
+        t.tv_nsec -= 1000000000;
+    }
+
+    return t;
+}
+
+static pthread_t spawn(void* (*f)(void*), void* arg)
+{
+    pthread_t t;
+    check(pthread_create(&t, NULL, f, arg) == 0);
+    return t;
+}
+
+static void join(pthread_t t)
+{
+    check(pthread_join(t, NULL) == 0);
+}
+
+// Pushes 0, 1, 2, ... in uneven batches, then pops them back in uneven batches
+// from a single thread.
+static void check_fifo(pipe_ctor_t ctor)
+{
+    enum { N = 64 };
+
+    pipe_t* p = ctor(sizeof(int), N);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    int elems[N], out[N];
+
+    for(int i = 0; i < N; ++i)
+        elems[i] = i;
+
+    for(int i = 0, batch = 1; i < N; i += batch, batch = batch % 7 + 1)
+        pipe_push(prod, elems + i, batch < N - i ? batch : N - i);
+
+    for(int i = 0, batch = 1; i < N; i += batch, batch = batch % 5 + 1)
+        check(pipe_pop(cons, out + i, batch < N - i ? batch : N - i)
+              == (size_t)(batch < N - i ? batch : N - i));
+
+    check(memcmp(elems, out, sizeof elems) == 0);
+
+    pipe_producer_free(prod);
+    pipe_consumer_free(cons);
+}
+
+// Once every producer is gone, pops drain what's left and then return 0 for
+// good. Once every consumer is gone, pushes return instead of waiting for
+// room that will never come.
+static void check_close(pipe_ctor_t ctor)
+{
+    int elems[3] = { 1, 2, 3 }, out[8];
+
+    pipe_t* p = ctor(sizeof(int), 4);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    pipe_push(prod, elems, 3);
+    pipe_producer_free(prod);
+
+    check(pipe_pop(cons, out, 8) == 3);
+    check(memcmp(elems, out, sizeof elems) == 0);
+    check(pipe_pop(cons, out, 8) == 0);
+    check(pipe_pop_eager(cons, out, 8) == 0);
+
+    pipe_consumer_free(cons);
+
+    p = ctor(sizeof(int), 4);
+    prod = pipe_producer_new(p);
+    pipe_free(p);
+
+    for(int i = 0; i < 4; ++i)
+        pipe_push(prod, elems, 3);
+
+    pipe_producer_free(prod);
+}
+
+typedef struct {
+    pipe_producer_t* prod;
+    pipe_consumer_t* cons;
+    int*             elems;
+    size_t           count;
+    size_t           result;
+} pusher_popper_t;
+
+static void* pop_in_thread(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    pp->result = pipe_pop(pp->cons, pp->elems, pp->count);
+    return NULL;
+}
+
+static void* push_in_thread(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    pipe_push(pp->prod, pp->elems, pp->count);
+    return NULL;
+}
+
+// A pop on an empty pipe waits for a push, and a push on a full pipe waits for
+// a pop.
+static void check_blocking(pipe_ctor_t ctor)
+{
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[8] = { 0 };
+
+    pipe_t* p = ctor(sizeof(int), 4);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    pusher_popper_t pp = { .cons = cons, .elems = out, .count = 2 };
+    pthread_t t = spawn(pop_in_thread, &pp);
+
+    sleep_ms(20);
+    pipe_push(prod, elems, 1);
+    sleep_ms(20);
+    pipe_push(prod, elems + 1, 1);
+    join(t);
+
+    check(pp.result == 2);
+    check(out[0] == 0 && out[1] == 1);
+
+    // The pipe holds at most 4 (maybe rounded up), so 8 can't all fit.
+    pp = (pusher_popper_t) { .prod = prod, .elems = elems, .count = 8 };
+    t = spawn(push_in_thread, &pp);
+
+    sleep_ms(20);
+    check(pipe_pop(cons, out, 8) == 8);
+    join(t);
+
+    check(memcmp(elems, out, sizeof elems) == 0);
+
+    pipe_producer_free(prod);
+    pipe_consumer_free(cons);
+}
+
+// The try functions move whatever they can right away, and say
+// PIPE_WOULD_BLOCK instead of waiting. 0 still means the other side is gone.
+static void check_try(pipe_ctor_t ctor)
+{
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[64];
+
+    pipe_t* p = ctor(sizeof(int), 4);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_try_pop(cons, out, 4) == PIPE_WOULD_BLOCK);
+
+    check(pipe_try_push(prod, elems, 2) == 2);
+    check(pipe_try_pop(cons, out, 64) == 2);
+    check(out[0] == 0 && out[1] == 1);
+    check(pipe_try_pop(cons, out, 64) == PIPE_WOULD_BLOCK);
+
+    // Fill it up. Most pipes round the limit up, some as far as their smallest
+    // buffer, so it may take more than 4.
+    size_t total = 0, pushed;
+
+    while((pushed = pipe_try_push(prod, elems + total % 8, 1)) == 1)
+        check(++total <= 64);
+
+    check(pushed == PIPE_WOULD_BLOCK);
+    check(total >= 4);
+
+    // A partial push takes as many as fit.
+    check(pipe_try_pop(cons, out, 2) == 2);
+    check(pipe_try_push(prod, elems, 8) == 2);
+
+    size_t popped = 0, n;
+
+    while((n = pipe_try_pop(cons, out + popped, 64 - popped)) != PIPE_WOULD_BLOCK)
+    {
+        check(n > 0);
+        popped += n;
+    }
+
+    check(popped == total);
+
+    for(size_t i = 0; i < total - 2; ++i)
+        check(out[i] == elems[(i + 2) % 8]);
+
+    check(out[total - 2] == 0 && out[total - 1] == 1);
+
+    // Closing either side turns PIPE_WOULD_BLOCK into 0.
+    pipe_producer_free(prod);
+    check(pipe_try_pop(cons, out, 4) == 0);
+    check(pipe_try_pop(cons, out, 4) == 0);
+    pipe_consumer_free(cons);
+
+    p = ctor(sizeof(int), 4);
+    prod = pipe_producer_new(p);
+    pipe_free(p);
+
+    check(pipe_try_push(prod, elems, 2) == 0);
+
+    pipe_producer_free(prod);
+}
+
+static void* push_later(void* arg)
+{
+    pusher_popper_t* pp = arg;
+
+    sleep_ms(20);
+    pipe_push(pp->prod, pp->elems, pp->count);
+
+    return NULL;
+}
+
+// The timed functions give up at the deadline, with whatever they managed to
+// move by then, or with PIPE_WOULD_BLOCK if that was nothing. They don't give
+// up any earlier, and they don't wait past the deadline when they don't have
+// to.
+static void check_timed(pipe_ctor_t ctor)
+{
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[64];
+    struct timespec deadline;
+    uint64_t start;
+
+    pipe_t* p = ctor(sizeof(int), 4);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    start    = now_ms();
+    deadline = deadline_in_ms(30);
+    check(pipe_pop_timed(cons, out, 4, &deadline) == PIPE_WOULD_BLOCK);
+    check(now_ms() - start >= 29);
+
+    // A deadline that has already passed still takes what's there.
+    pipe_push(prod, elems, 2);
+    deadline = deadline_in_ms(0);
+    check(pipe_pop_timed(cons, out, 2, &deadline) == 2);
+    check(out[0] == 0 && out[1] == 1);
+
+    // Like pipe_pop, it waits to fill the target, but only until the deadline.
+    pipe_push(prod, elems, 2);
+    deadline = deadline_in_ms(30);
+    check(pipe_pop_timed(cons, out, 4, &deadline) == 2);
+
+    // The eager one returns whatever is there right away, and times out the
+    // same way when there's nothing.
+    pipe_push(prod, elems, 2);
+    start    = now_ms();
+    deadline = deadline_in_ms(5000);
+    check(pipe_pop_eager_timed(cons, out, 4, &deadline) == 2);
+    check(out[0] == 0 && out[1] == 1);
+    check(now_ms() - start < 4000);
+
+    start    = now_ms();
+    deadline = deadline_in_ms(30);
+    check(pipe_pop_eager_timed(cons, out, 4, &deadline) == PIPE_WOULD_BLOCK);
+    check(now_ms() - start >= 29);
+
+    // A push before the deadline wakes it up.
+    pusher_popper_t pp = { .prod = prod, .elems = elems + 3, .count = 1 };
+    pthread_t t = spawn(push_later, &pp);
+
+    start    = now_ms();
+    deadline = deadline_in_ms(5000);
+    check(pipe_pop_timed(cons, out, 1, &deadline) == 1);
+    check(out[0] == 3);
+    check(now_ms() - start < 4000);
+    join(t);
+
+    // Fill it up, then pushes time out too.
+    size_t total = 0, pushed;
+
+    do
+    {
+        deadline = deadline_in_ms(0);
+        pushed   = pipe_push_timed(prod, elems + total % 8, 1, &deadline);
+    }
+    while(pushed == 1 && ++total <= 64);
+
+    check(pushed == PIPE_WOULD_BLOCK);
+    check(total >= 4);
+
+    start    = now_ms();
+    deadline = deadline_in_ms(30);
+    check(pipe_push_timed(prod, elems, 1, &deadline) == PIPE_WOULD_BLOCK);
+    check(now_ms() - start >= 29);
+
+    // A partial push takes as many as fit by the deadline.
+    check(pipe_pop(cons, out, 2) == 2);
+    deadline = deadline_in_ms(10);
+    check(pipe_push_timed(prod, elems, 8, &deadline) == 2);
+
+    check(pipe_pop(cons, out, total) == total);
+
+    // Closing either side makes them return 0 right away.
+    pipe_producer_free(prod);
+
+    start    = now_ms();
+    deadline = deadline_in_ms(5000);
+    check(pipe_pop_timed(cons, out, 4, &deadline) == 0);
+    check(pipe_pop_eager_timed(cons, out, 4, &deadline) == 0);
+    check(now_ms() - start < 4000);
+
+    pipe_consumer_free(cons);
+
+    p = ctor(sizeof(int), 4);
+    prod = pipe_producer_new(p);
+    pipe_free(p);
+
+    deadline = deadline_in_ms(5000);
+    check(pipe_push_timed(prod, elems, 2, &deadline) == 0);
+
+    pipe_producer_free(prod);
+}
+
+// Writes 0, 1, 2, ... into a reservation, wherever it wraps.
+static void fill_spans(pipe_span_t first, pipe_span_t second, int from)
+{
+    for(size_t i = 0; i < first.count; ++i)
+        ((int*)first.data)[i] = from++;
+
+    for(size_t i = 0; i < second.count; ++i)
+        ((int*)second.data)[i] = from++;
+}
+
+static void* reserve_in_thread(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    pipe_span_t first, second;
+
+    pp->result = pipe_push_reserve(pp->prod, pp->count, &first, &second);
+
+    if(pp->result)
+    {
+        fill_spans(first, second, 100);
+        pipe_push_commit(pp->prod, pp->result);
+    }
+
+    return NULL;
+}
+
+// Pops 0, 1, 2, ... until the pipe closes, and checks that nothing is missing
+// or out of order. pp->result is how many there were.
+static void* pop_sequence(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    int batch[16];
+    size_t n;
+
+    pp->result = 0;
+
+    while((n = pipe_pop_eager(pp->cons, batch, 16)))
+        for(size_t i = 0; i < n; ++i)
+            check(batch[i] == (int)pp->result++);
+
+    return NULL;
+}
+
+#define SEQUENCE_LENGTH 50000
+
+// Pushes 0, 1, 2, ... SEQUENCE_LENGTH-1 in uneven batches, then closes the pipe.
+static void* push_sequence(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    int batch[8];
+
+    for(int i = 0, n = 1; i < SEQUENCE_LENGTH; i += n, n = n % 8 + 1)
+    {
+        n = n < SEQUENCE_LENGTH - i ? n : SEQUENCE_LENGTH - i;
+
+        for(int j = 0; j < n; ++j)
+            batch[j] = i + j;
+
+        pipe_push(pp->prod, batch, n);
+    }
+
+    pipe_producer_free(pp->prod);
+    return NULL;
+}
+
+// Elements written in place come out like pushed ones, only what's committed
+// is pushed, and reserving waits for room.
+static void check_reserve(pipe_ctor_t ctor)
+{
+    pipe_span_t first, second;
+    int out[8];
+
+    pipe_t* p = ctor(sizeof(int), 8);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    // Move the cursors along, so that the next reservation is likely to wrap
+    // around the end of the buffer.
+    for(int i = 0; i < 3; ++i)
+    {
+        size_t reserved = pipe_push_reserve(prod, 5, &first, &second);
+
+        check(reserved > 0 && reserved <= 5);
+        check(first.count + second.count == reserved);
+        check(first.count > 0 && first.data != NULL);
+
+        fill_spans(first, second, 0);
+
+        // Only the first 3 are pushed; the rest are thrown away.
+        size_t committed = reserved < 3 ? reserved : 3;
+        pipe_push_commit(prod, committed);
+
+        check(pipe_pop(cons, out, committed) == committed);
+
+        for(size_t j = 0; j < committed; ++j)
+            check(out[j] == (int)j);
+    }
+
+    // A commit of nothing still ends the reservation.
+    check(pipe_push_reserve(prod, 1, &first, &second) == 1);
+    pipe_push_commit(prod, 0);
+
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 };
+    pipe_push(prod, elems, 8);
+
+    // The pipe is full, so this has to wait for the pop below.
+    pusher_popper_t pp = { .prod = prod, .count = 2 };
+    pthread_t t = spawn(reserve_in_thread, &pp);
+
+    sleep_ms(20);
+    check(pipe_pop(cons, out, 8) == 8);
+    check(memcmp(elems, out, sizeof elems) == 0);
+    join(t);
+
+    check(pp.result > 0);
+    check(pipe_pop(cons, out, pp.result) == pp.result);
+
+    for(size_t j = 0; j < pp.result; ++j)
+        check(out[j] == 100 + (int)j);
+
+    // With the consumers gone, there's nothing to reserve.
+    pipe_consumer_free(cons);
+    check(pipe_push_reserve(prod, 1, &first, &second) == 0);
+    check(first.count == 0 && second.count == 0);
+
+    pipe_producer_free(prod);
+
+    // Commits have to publish what was written in place to a consumer that's
+    // popping at the same time.
+    p    = ctor(sizeof(int), 8);
+    prod = pipe_producer_new(p);
+    pp   = (pusher_popper_t) { .cons = pipe_consumer_new(p) };
+    pipe_free(p);
+
+    t = spawn(pop_sequence, &pp);
+
+    for(int i = 0, n = 1; i < 50000; n = n % 6 + 1)
+    {
+        size_t reserved = pipe_push_reserve(prod, n, &first, &second);
+
+        check(reserved > 0);
+        fill_spans(first, second, i);
+        pipe_push_commit(prod, reserved);
+
+        i += (int)reserved;
+    }
+
+    pipe_producer_free(prod);
+    join(t);
+
+    check(pp.result >= 50000);
+    pipe_consumer_free(pp.cons);
+}
+
+// A record the size of a radio packet, with room for a terminator.
+typedef struct {
+    unsigned seq;
+    char     payload[257];
+} packet_t;
+
+#define PACKETS 100
+
+// Builds each packet straight in the pipe's buffer, one reservation at a time,
+// rather than on the stack to be copied in by pipe_push. A reservation made
+// before finding out there's nothing left to send is let go with an empty
+// commit.
+static void* send_packets(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    pipe_span_t first, second;
+    unsigned seq = 0;
+
+    while(pipe_push_reserve(pp->prod, 1, &first, &second))
+    {
+        if(seq == PACKETS)
+        {
+            pipe_push_commit(pp->prod, 0);
+            break;
+        }
+
+        packet_t* packet = first.data;
+
+        packet->seq = seq;
+        memset(packet->payload, 'a' + seq % 26, 256);
+        packet->payload[256] = '\0';
+
+        pipe_push_commit(pp->prod, 1);
+        ++seq;
+    }
+
+    pipe_producer_free(pp->prod);
+    return NULL;
+}
+
+// Records written in place come out whole and in order.
+static void check_reserve_records(pipe_ctor_t ctor)
+{
+    pipe_t* p = ctor(sizeof(packet_t), 4);
+    pusher_popper_t pp = { .prod = pipe_producer_new(p) };
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    pthread_t t = spawn(send_packets, &pp);
+
+    packet_t packet;
+    unsigned seq = 0;
+
+    while(pipe_pop(cons, &packet, 1))
+    {
+        check(packet.seq == seq);
+        check(strlen(packet.payload) == 256);
+        check(packet.payload[0]   == 'a' + (char)(seq % 26));
+        check(packet.payload[255] == 'a' + (char)(seq % 26));
+        ++seq;
+    }
+
+    check(seq == PACKETS);
+
+    join(t);
+    pipe_consumer_free(cons);
+}
+
+// Checks that a peek shows `count' elements counting up from `from', wherever
+// it wraps.
+static void check_peeked(pipe_const_span_t first,
+                         pipe_const_span_t second,
+                         size_t count,
+                         int from)
+{
+    check(first.count + second.count == count);
+    check(first.count > 0 && first.data != NULL);
+
+    for(size_t i = 0; i < first.count; ++i)
+        check(((const int*)first.data)[i] == from++);
+
+    for(size_t i = 0; i < second.count; ++i)
+        check(((const int*)second.data)[i] == from++);
+}
+
+static void* peek_in_thread(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    pipe_const_span_t first, second;
+
+    pp->result = pipe_pop_peek(pp->cons, pp->count, &first, &second);
+
+    if(pp->result)
+    {
+        pp->elems[0] = *(const int*)first.data;
+        pipe_pop_release(pp->cons, pp->result);
+    }
+
+    return NULL;
+}
+
+// Peeking shows what's at the front without popping it, releasing pops only
+// as much of it as asked, and peeking waits for elements.
+static void check_peek(pipe_ctor_t ctor)
+{
+    pipe_const_span_t first, second;
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[8];
+
+    pipe_t* p = ctor(sizeof(int), 8);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    // Go around the buffer a few times, so that some of the peeks wrap.
+    for(int round = 0; round < 4; ++round)
+    {
+        pipe_push(prod, elems, 5);
+
+        size_t peeked = pipe_pop_peek(cons, 8, &first, &second);
+        check(peeked == 5);
+        check_peeked(first, second, 5, 0);
+
+        // Nothing was popped, so a second look sees the same thing.
+        pipe_pop_release(cons, 0);
+        check(pipe_pop_peek(cons, 8, &first, &second) == 5);
+        check_peeked(first, second, 5, 0);
+
+        pipe_pop_release(cons, 2);
+        check(pipe_pop(cons, out, 3) == 3);
+        check(out[0] == 2 && out[1] == 3 && out[2] == 4);
+    }
+
+    // An empty pipe makes the peek wait for a push.
+    pusher_popper_t pp = { .cons = cons, .elems = out, .count = 4 };
+    pthread_t t = spawn(peek_in_thread, &pp);
+
+    sleep_ms(20);
+    pipe_push(prod, elems + 6, 1);
+    join(t);
+
+    check(pp.result == 1 && out[0] == 6);
+
+    // Once the producers are gone, peeks drain what's left, then return 0.
+    pipe_push(prod, elems, 2);
+    pipe_producer_free(prod);
+
+    check(pipe_pop_peek(cons, 8, &first, &second) == 2);
+    check_peeked(first, second, 2, 0);
+    pipe_pop_release(cons, 2);
+
+    check(pipe_pop_peek(cons, 8, &first, &second) == 0);
+    check(first.count == 0 && second.count == 0);
+
+    pipe_consumer_free(cons);
+
+    // Peeks have to see everything a producer pushing at the same time
+    // published, and releases have to make room for it.
+    p    = ctor(sizeof(int), 8);
+    pp   = (pusher_popper_t) { .prod = pipe_producer_new(p) };
+    cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    t = spawn(push_sequence, &pp);
+
+    size_t peeked;
+    int    next = 0;
+
+    while((peeked = pipe_pop_peek(cons, 7, &first, &second)))
+    {
+        check_peeked(first, second, peeked, next);
+
+        size_t released = (peeked + 1) / 2;
+        pipe_pop_release(cons, released);
+        next += (int)released;
+    }
+
+    join(t);
+    check(next == SEQUENCE_LENGTH);
+
+    pipe_consumer_free(cons);
+}
+
+// Stress tests push elements tagged with who pushed them and in which order.
+#define STRESS_MAX_PRODUCERS 16
+
+#define TAG(producer, seq) (((uint64_t)(producer) << 32) | (uint64_t)(seq))
+#define TAG_PRODUCER(tag)  ((size_t)((tag) >> 32))
+#define TAG_SEQ(tag)       ((uint32_t)(tag))
+
+// Which functions the stress test pushes and pops with.
+typedef enum {
+    STRESS_BLOCKING, // pipe_push and pipe_pop_eager
+    STRESS_TRY,      // pipe_try_push and pipe_try_pop, yielding when they'd block
+    STRESS_TIMED,    // pipe_push_timed and pipe_pop_timed, with 1ms deadlines
+    STRESS_PRIORITY, // pipe_push_priority into level `id' % STRESS_LEVELS,
+                     // and pipe_pop_eager
+} stress_mode_t;
+
+// How many levels a priority pipe needs for STRESS_PRIORITY.
+#define STRESS_LEVELS 3
+
+// How many producers have finished pushing. A pop may only say the pipe is
+// closed once they all have.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t          done;
+} stress_progress_t;
+
+typedef struct {
+    pipe_producer_t*   prod;
+    size_t             id;
+    size_t             count;
+    stress_mode_t      mode;
+    stress_progress_t* progress;
+} stress_producer_t;
+
+typedef struct {
+    pipe_consumer_t*   cons;
+    size_t             producers;
+    size_t             popped[STRESS_MAX_PRODUCERS];
+    uint64_t           seq_sum[STRESS_MAX_PRODUCERS];
+    stress_mode_t      mode;
+    stress_progress_t* progress;
+    bool               dropped; // Cut off from a PIPE_BROADCAST_DROP pipe.
+} stress_consumer_t;
+
+// Pushes all `count' elements, however the mode says to.
+static void stress_push_batch(stress_producer_t* sp,
+                              const uint64_t* batch,
+                              size_t count)
+{
+    size_t pushed;
+
+    switch(sp->mode)
+    {
+    case STRESS_BLOCKING:
+        pipe_push(sp->prod, batch, count);
+        break;
+
+    case STRESS_TRY:
+        while(count > 0)
+        {
+            pushed = pipe_try_push(sp->prod, batch, count);
+
+            // The consumers don't leave until we're done.
+            check(pushed != 0);
+
+            if(pushed == PIPE_WOULD_BLOCK)
+            {
+                sched_yield();
+                continue;
+            }
+
+            check(pushed <= count);
+            batch += pushed;
+            count -= pushed;
+        }
+        break;
+
+    case STRESS_TIMED:
+        while(count > 0)
+        {
+            struct timespec deadline = deadline_in_ms(1);
+            pushed = pipe_push_timed(sp->prod, batch, count, &deadline);
+
+            check(pushed != 0);
+
+            if(pushed == PIPE_WOULD_BLOCK)
+                continue;
+
+            check(pushed <= count);
+            batch += pushed;
+            count -= pushed;
+        }
+        break;
+
+    case STRESS_PRIORITY:
+        pushed = pipe_push_priority(sp->prod, sp->id % STRESS_LEVELS,
+                                    batch, count);
+        check(pushed == count);
+        break;
+    }
+}
+
+// Pops at least one element, however the mode says to, or returns 0 once the
+// pipe is closed.
+static size_t stress_pop_batch(stress_consumer_t* sc,
+                               uint64_t* batch,
+                               size_t count)
+{
+    size_t popped;
+
+    switch(sc->mode)
+    {
+    case STRESS_BLOCKING:
+    case STRESS_PRIORITY:
+        return pipe_pop_eager(sc->cons, batch, count);
+
+    case STRESS_TRY:
+        while((popped = pipe_try_pop(sc->cons, batch, count)) == PIPE_WOULD_BLOCK)
+            sched_yield();
+
+        check(popped <= count);
+        return popped;
+
+    case STRESS_TIMED:
+        do
+        {
+            struct timespec deadline = deadline_in_ms(1);
+            popped = pipe_pop_timed(sc->cons, batch, count, &deadline);
+        }
+        while(popped == PIPE_WOULD_BLOCK);
+
+        check(popped <= count);
+        return popped;
+    }
+
+    abort();
+}
+
+static void* stress_push(void* arg)
+{
+    stress_producer_t* sp = arg;
+    uint64_t batch[16];
+
+    // Batches of 1 to 16, so that both single and bulk pushes get hammered.
+    for(size_t i = 0, n = 1; i < sp->count; i += n, n = n % 16 + 1)
+    {
+        n = n < sp->count - i ? n : sp->count - i;
+
+        for(size_t j = 0; j < n; ++j)
+            batch[j] = TAG(sp->id, i + j);
+
+        stress_push_batch(sp, batch, n);
+    }
+
+    pthread_mutex_lock(&sp->progress->lock);
+        sp->progress->done++;
+    pthread_mutex_unlock(&sp->progress->lock);
+
+    pipe_producer_free(sp->prod);
+    return NULL;
+}
+
+static void* stress_pop(void* arg)
+{
+    stress_consumer_t* sc = arg;
+    uint64_t batch[32];
+    int64_t  last[STRESS_MAX_PRODUCERS];
+    size_t   n;
+
+    for(size_t i = 0; i < sc->producers; ++i)
+        last[i] = -1;
+
+    while((n = stress_pop_batch(sc, batch, 32)))
+    {
+        for(size_t i = 0; i < n; ++i)
+        {
+            size_t   id  = TAG_PRODUCER(batch[i]);
+            uint32_t seq = TAG_SEQ(batch[i]);
+
+            // Each producer's elements reach each consumer in order.
+            check(id < sc->producers);
+            check((int64_t)seq > last[id]);
+
+            last[id] = seq;
+            sc->popped[id]++;
+            sc->seq_sum[id] += seq;
+        }
+    }
+
+    // Another consumer beating us to the last few elements doesn't count, and
+    // neither does being cut off.
+    sc->dropped = pipe_consumer_dropped(sc->cons);
+
+    pthread_mutex_lock(&sc->progress->lock);
+        check(sc->dropped || sc->progress->done == sc->producers);
+    pthread_mutex_unlock(&sc->progress->lock);
+
+    pipe_consumer_free(sc->cons);
+    return NULL;
+}
+
+// Runs `producers' threads pushing `count' elements each against `consumers'
+// threads popping, and checks that every element comes out exactly once, and
+// in order per producer. Unless they're 0, the producers push through handles
+// buffering `batch' elements, and the consumers pop through handles caching
+// `budget'.
+static void check_stress_buffered(pipe_t* p,
+                                  size_t producers,
+                                  size_t consumers,
+                                  size_t count,
+                                  stress_mode_t mode,
+                                  size_t batch,
+                                  size_t budget)
+{
+    stress_producer_t sp[STRESS_MAX_PRODUCERS];
+    stress_consumer_t sc[STRESS_MAX_PRODUCERS];
+    pthread_t         threads[2 * STRESS_MAX_PRODUCERS];
+    stress_progress_t progress = { .done = 0 };
+
+    pthread_mutex_init(&progress.lock, NULL);
+
+    check(producers <= STRESS_MAX_PRODUCERS);
+    check(consumers <= STRESS_MAX_PRODUCERS);
+    check(pipe_elem_size(PIPE_GENERIC(p)) == sizeof(uint64_t));
+
+    for(size_t i = 0; i < producers; ++i)
+    {
+        pipe_producer_t* prod = batch ? pipe_producer_new_buffered(p, batch, 0)
+                                      : pipe_producer_new(p);
+        check(prod != NULL);
+
+        sp[i] = (stress_producer_t) { prod, i, count, mode, &progress };
+    }
+
+    for(size_t i = 0; i < consumers; ++i)
+    {
+        pipe_consumer_t* cons = budget ? pipe_consumer_new_buffered(p, budget)
+                                       : pipe_consumer_new(p);
+        check(cons != NULL);
+
+        sc[i] = (stress_consumer_t) { .cons      = cons,
+                                      .producers = producers,
+                                      .mode      = mode,
+                                      .progress  = &progress };
+    }
+
+    pipe_free(p);
+
+    for(size_t i = 0; i < consumers; ++i)
+        threads[i] = spawn(stress_pop, sc + i);
+
+    for(size_t i = 0; i < producers; ++i)
+        threads[consumers + i] = spawn(stress_push, sp + i);
+
+    for(size_t i = 0; i < producers + consumers; ++i)
+        join(threads[i]);
+
+    for(size_t id = 0; id < producers; ++id)
+    {
+        size_t   popped  = 0;
+        uint64_t seq_sum = 0;
+
+        for(size_t i = 0; i < consumers; ++i)
+        {
+            popped  += sc[i].popped[id];
+            seq_sum += sc[i].seq_sum[id];
+        }
+
+        check(popped == count);
+        check(seq_sum == (uint64_t)count * (count - 1) / 2);
+    }
+
+    pthread_mutex_destroy(&progress.lock);
+}
+
+static void check_stress_with(pipe_t* p,
+                              size_t producers,
+                              size_t consumers,
+                              size_t count,
+                              stress_mode_t mode)
+{
+    check_stress_buffered(p, producers, consumers, count, mode, 0, 0);
+}
+
+static void check_stress(pipe_t* p,
+                         size_t producers,
+                         size_t consumers,
+                         size_t count)
+{
+    check_stress_with(p, producers, consumers, count, STRESS_BLOCKING);
+}
+
+DEF_TEST(pipe_fifo)     { check_fifo(pipe_new);     }
+DEF_TEST(pipe_close)    { check_close(pipe_new);    }
+DEF_TEST(pipe_blocking) { check_blocking(pipe_new); }
+
+DEF_TEST(pipe_stress)
+{
+    check_stress(pipe_new(sizeof(uint64_t), 0),  4, 4, 100000);
+    check_stress(pipe_new(sizeof(uint64_t), 64), 4, 4, 100000);
+}
+
+DEF_TEST(spsc_fifo)     { check_fifo(pipe_new_spsc);     }
+DEF_TEST(spsc_close)    { check_close(pipe_new_spsc);    }
+DEF_TEST(spsc_blocking) { check_blocking(pipe_new_spsc); }
+
+// The ring is small, so the producer keeps catching up with the consumer and
+// both sides keep going to sleep and waking each other up.
+DEF_TEST(spsc_stress)
+{
+    check_stress(pipe_new_spsc(sizeof(uint64_t), 7),    1, 1, 200000);
+    check_stress(pipe_new_spsc(sizeof(uint64_t), 4096), 1, 1, 200000);
+}
+
+DEF_TEST(mpmc_fifo)     { check_fifo(pipe_new_mpmc);     }
+DEF_TEST(mpmc_close)    { check_close(pipe_new_mpmc);    }
+DEF_TEST(mpmc_blocking) { check_blocking(pipe_new_mpmc); }
+
+// Consumers outnumber producers and the ring is tiny, so they keep waking up
+// for an element that another consumer has already taken.
+DEF_TEST(mpmc_stress)
+{
+    check_stress(pipe_new_mpmc(sizeof(uint64_t), 4),    2, 6, 50000);
+    check_stress(pipe_new_mpmc(sizeof(uint64_t), 4),    6, 2, 50000);
+    check_stress(pipe_new_mpmc(sizeof(uint64_t), 1024), 4, 4, 100000);
+}
+
+DEF_TEST(pipe_reserve)  { check_reserve(pipe_new);      }
+DEF_TEST(spsc_reserve)  { check_reserve(pipe_new_spsc); }
+
+DEF_TEST(pipe_reserve_records)  { check_reserve_records(pipe_new);      }
+DEF_TEST(spsc_reserve_records)  { check_reserve_records(pipe_new_spsc); }
+
+DEF_TEST(pipe_peek)     { check_peek(pipe_new);         }
+DEF_TEST(spsc_peek)     { check_peek(pipe_new_spsc);    }
+
+DEF_TEST(mirrored_fifo)     { check_fifo(pipe_new_mirrored);     }
+DEF_TEST(mirrored_close)    { check_close(pipe_new_mirrored);    }
+DEF_TEST(mirrored_blocking) { check_blocking(pipe_new_mirrored); }
+DEF_TEST(mirrored_reserve)  { check_reserve(pipe_new_mirrored);  }
+DEF_TEST(mirrored_peek)     { check_peek(pipe_new_mirrored);     }
+
+// The buffer is mapped twice in a row, so no span ever has to wrap, and
+// growing it keeps the elements already in it in order.
+DEF_TEST(mirrored_spans)
+{
+    enum { N = 3000 };
+
+    pipe_t* p = pipe_new_mirrored(sizeof(int), 0);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    pipe_span_t       first, second;
+    pipe_const_span_t cfirst, csecond;
+
+    int next_in = 0, next_out = 0;
+
+    // Grow from the default size to a few pages, wrapping all along.
+    for(int round = 0; next_in < N; ++round)
+    {
+        size_t reserved = pipe_push_reserve(prod, 64 + round, &first, &second);
+
+        check(reserved > 0 && second.count == 0 && first.count == reserved);
+        fill_spans(first, second, next_in);
+        pipe_push_commit(prod, reserved);
+        next_in += (int)reserved;
+
+        size_t peeked = pipe_pop_peek(cons, 48, &cfirst, &csecond);
+
+        check(peeked > 0 && csecond.count == 0);
+        check_peeked(cfirst, csecond, peeked, next_out);
+        pipe_pop_release(cons, peeked);
+        next_out += (int)peeked;
+    }
+
+    pipe_producer_free(prod);
+
+    int out[64];
+    size_t n;
+
+    while((n = pipe_pop_eager(cons, out, 64)))
+        for(size_t i = 0; i < n; ++i)
+            check(out[i] == next_out++);
+
+    check(next_out == next_in);
+
+    pipe_consumer_free(cons);
+}
+
+DEF_TEST(mirrored_stress)
+{
+    check_stress(pipe_new_mirrored(sizeof(uint64_t), 0),  4, 4, 100000);
+    check_stress(pipe_new_mirrored(sizeof(uint64_t), 16), 4, 4, 50000);
+}
+
+DEF_TEST(pipe_try)     { check_try(pipe_new);          }
+DEF_TEST(spsc_try)     { check_try(pipe_new_spsc);     }
+DEF_TEST(mpmc_try)     { check_try(pipe_new_mpmc);     }
+DEF_TEST(mirrored_try) { check_try(pipe_new_mirrored); }
+
+// Nobody ever sleeps, so this is all about the lock-free paths and trylocks.
+DEF_TEST(try_stress)
+{
+    check_stress_with(pipe_new(sizeof(uint64_t), 16),
+                      4, 4, 50000, STRESS_TRY);
+    check_stress_with(pipe_new_spsc(sizeof(uint64_t), 16),
+                      1, 1, 100000, STRESS_TRY);
+    check_stress_with(pipe_new_mpmc(sizeof(uint64_t), 16),
+                      4, 4, 50000, STRESS_TRY);
+}
+
+DEF_TEST(pipe_timed)     { check_timed(pipe_new);          }
+DEF_TEST(spsc_timed)     { check_timed(pipe_new_spsc);     }
+DEF_TEST(mpmc_timed)     { check_timed(pipe_new_mpmc);     }
+DEF_TEST(mirrored_timed) { check_timed(pipe_new_mirrored); }
+
+// Deadlines keep passing in the middle of waits, while the other side is busy
+// waking us up.
+DEF_TEST(timed_stress)
+{
+    check_stress_with(pipe_new(sizeof(uint64_t), 16),
+                      4, 4, 50000, STRESS_TIMED);
+    check_stress_with(pipe_new_spsc(sizeof(uint64_t), 16),
+                      1, 1, 100000, STRESS_TIMED);
+    check_stress_with(pipe_new_mpmc(sizeof(uint64_t), 16),
+                      4, 4, 50000, STRESS_TIMED);
+}
+
+static void* free_producer_later(void* arg)
+{
+    sleep_ms(20);
+    pipe_producer_free(arg);
+
+    return NULL;
+}
+
+// Spinners and yielders have to notice elements and closes without anyone
+// waking them up, and spin-then-block has to hand over to sleeping cleanly.
+static void check_wait_strategy(pipe_ctor_t ctor,
+                                size_t threads,
+                                pipe_wait_strategy_t strategy,
+                                size_t spins)
+{
+    pipe_t* p = ctor(sizeof(uint64_t), 16);
+    pipe_set_wait_strategy(p, strategy, spins);
+    // Busy spinners burn whole timeslices when there are fewer cores than
+    // threads, so keep their run short.
+    check_stress(p, threads, threads,
+                 strategy == PIPE_WAIT_BUSY_SPIN ? 500 : 5000);
+
+    p = ctor(sizeof(int), 4);
+    pipe_set_wait_strategy(p, strategy, spins);
+
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    int elems[2] = { 1, 2 }, out[4];
+    struct timespec deadline = deadline_in_ms(10);
+
+    check(pipe_pop_timed(cons, out, 1, &deadline) == PIPE_WOULD_BLOCK);
+
+    pipe_push(prod, elems, 2);
+
+    pthread_t t = spawn(free_producer_later, prod);
+    check(pipe_pop(cons, out, 4) == 2);
+    check(out[0] == 1 && out[1] == 2);
+    join(t);
+
+    pipe_consumer_free(cons);
+}
+
+// `threads' producers against as many consumers.
+static void check_wait_strategies(pipe_ctor_t ctor, size_t threads)
+{
+    check_wait_strategy(ctor, threads, PIPE_WAIT_SPIN_THEN_BLOCK, 0);
+    check_wait_strategy(ctor, threads, PIPE_WAIT_SPIN_THEN_BLOCK, 1);
+    check_wait_strategy(ctor, threads, PIPE_WAIT_YIELD,           0);
+    check_wait_strategy(ctor, threads, PIPE_WAIT_BUSY_SPIN,       0);
+}
+
+DEF_TEST(pipe_wait_strategies) { check_wait_strategies(pipe_new,      2); }
+DEF_TEST(spsc_wait_strategies) { check_wait_strategies(pipe_new_spsc, 1); }
+DEF_TEST(mpmc_wait_strategies) { check_wait_strategies(pipe_new_mpmc, 2); }
+
+DEF_TEST(segmented_fifo)     { check_fifo(pipe_new_segmented);     }
+DEF_TEST(segmented_close)    { check_close(pipe_new_segmented);    }
+DEF_TEST(segmented_blocking) { check_blocking(pipe_new_segmented); }
+DEF_TEST(segmented_try)      { check_try(pipe_new_segmented);      }
+DEF_TEST(segmented_timed)    { check_timed(pipe_new_segmented);    }
+
+// Unbounded, so the producers run far ahead and the chunk list keeps growing,
+// then drains back down. Bounded, so pops and pushes keep crossing from one
+// chunk into the next.
+DEF_TEST(segmented_stress)
+{
+    check_stress(pipe_new_segmented(sizeof(uint64_t), 0),  4, 4, 100000);
+    check_stress(pipe_new_segmented(sizeof(uint64_t), 16), 4, 4, 50000);
+    check_stress_with(pipe_new_segmented(sizeof(uint64_t), 16),
+                      4, 4, 50000, STRESS_TRY);
+}
+
+// Fill it up far past one chunk without popping, then drain it, so chunks are
+// linked on and given back.
+DEF_TEST(segmented_grow)
+{
+    enum { N = 100000 };
+
+    pipe_t* p = pipe_new_segmented(sizeof(int), 0);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    for(int round = 0; round < 2; ++round)
+    {
+        for(int i = 0; i < N; ++i)
+            pipe_push(prod, &i, 1);
+
+        int out[97];
+        int next = 0;
+
+        while(next < N)
+        {
+            size_t n = pipe_pop_eager(cons, out, 97);
+
+            for(size_t i = 0; i < n; ++i)
+                check(out[i] == next++);
+        }
+    }
+
+    pipe_producer_free(prod);
+
+    int x;
+    check(pipe_pop(cons, &x, 1) == 0);
+
+    pipe_consumer_free(cons);
+}
+
+// Grows eagerly and shrinks late, then the other way around, while the
+// producers keep the buffer bouncing between big and small.
+DEF_TEST(capacity_policy)
+{
+    pipe_capacity_policy_t policies[] = {
+        { .growth_percent = 25,  .shrink_percent = 50 },
+        { .growth_percent = 300, .shrink_percent = 0  },
+        { .growth_percent = 100, .shrink_percent = 10,
+          .shrink_delay_ms = 1,  .high_water_ms = 2 },
+    };
+
+    for(size_t i = 0; i < sizeof policies / sizeof *policies; ++i)
+    {
+        pipe_t* p = pipe_new(sizeof(uint64_t), 0);
+        pipe_set_capacity_policy(PIPE_GENERIC(p), policies + i);
+
+        pipe_capacity_policy_t got = pipe_get_capacity_policy(PIPE_GENERIC(p));
+
+        check(got.growth_percent  == policies[i].growth_percent);
+        check(got.shrink_percent  == policies[i].shrink_percent);
+        check(got.shrink_delay_ms == policies[i].shrink_delay_ms);
+        check(got.high_water_ms   == policies[i].high_water_ms);
+
+        check_stress(p, 4, 4, 50000);
+    }
+}
+
+// Keeps track of what's outstanding, going by the sizes the pipe reports back
+// when it frees, so a wrong size shows up as a leak or an underflow.
+typedef struct {
+    pthread_mutex_t lock;
+    size_t          allocs;
+    size_t          reallocs;
+    size_t          bytes;
+} counting_allocator_t;
+
+static void* counting_alloc(void* ctx, size_t size)
+{
+    counting_allocator_t* a = ctx;
+
+    pthread_mutex_lock(&a->lock);
+        a->allocs++;
+        a->bytes += size;
+    pthread_mutex_unlock(&a->lock);
+
+    return malloc(size);
+}
+
+static void* counting_realloc(void* ctx, void* ptr, size_t old_size, size_t size)
+{
+    counting_allocator_t* a = ctx;
+
+    pthread_mutex_lock(&a->lock);
+        check(a->bytes >= old_size);
+        a->reallocs++;
+        a->bytes += size - old_size;
+    pthread_mutex_unlock(&a->lock);
+
+    return realloc(ptr, size);
+}
+
+static void counting_free(void* ctx, void* ptr, size_t size)
+{
+    counting_allocator_t* a = ctx;
+
+    pthread_mutex_lock(&a->lock);
+        check(a->bytes >= size);
+        a->bytes -= size;
+    pthread_mutex_unlock(&a->lock);
+
+    free(ptr);
+}
+
+static void check_allocator(bool with_realloc)
+{
+    counting_allocator_t a = { .allocs = 0 };
+    pthread_mutex_init(&a.lock, NULL);
+
+    pipe_allocator_t allocator = {
+        .alloc   = counting_alloc,
+        .realloc = with_realloc ? counting_realloc : NULL,
+        .free    = counting_free,
+        .ctx     = &a,
+    };
+
+    // The pipe_t itself comes from the allocator too.
+    pipe_t* p = pipe_new_ex(sizeof(uint64_t), 0, &allocator);
+    check(a.allocs > 0 && a.bytes > 0);
+
+    // Make the buffer grow, a lot.
+    pipe_reserve(PIPE_GENERIC(p), 100000);
+    check_stress(p, 4, 4, 50000);
+
+    check(with_realloc || a.reallocs == 0);
+    check(a.bytes == 0);
+
+    pthread_mutex_destroy(&a.lock);
+}
+
+DEF_TEST(allocator)
+{
+    check_allocator(true);
+    check_allocator(false);
+}
+
+// Every combination of flags, on buffers below a page, between a page and a
+// hugepage, and past a hugepage. Whatever the kernel here refuses has to fall
+// back quietly.
+DEF_TEST(page_allocator)
+{
+    static const size_t reservations[] = { 0, 4096, 1 << 20 };
+
+    for(unsigned flags = 0; flags < 8; ++flags)
+    for(size_t i = 0; i < sizeof reservations / sizeof *reservations; ++i)
+    {
+        pipe_allocator_t allocator = pipe_page_allocator(flags);
+        pipe_t* p = pipe_new_ex(sizeof(uint64_t), 0, &allocator);
+
+        pipe_reserve(PIPE_GENERIC(p), reservations[i]);
+        check_stress(p, 2, 2, 10000);
+    }
+}
+
+// Static pipes never free their buffers, so the generic checks get theirs from
+// here. None of them has more than two pipes alive at once. Each pipe starts
+// a byte in, so the buffer is never lined up for it.
+static char   static_bufs[4][32768];
+static size_t next_static_buf;
+
+static pipe_t* pipe_new_static_for_test(size_t elem_size, size_t limit)
+{
+    char*  buf  = static_bufs[next_static_buf++ % 4] + 1;
+    size_t size = pipe_static_size(elem_size, limit);
+
+    check(size < sizeof static_bufs[0]);
+
+    pipe_t* p = pipe_new_static(elem_size, buf, size, 0);
+    check(p != NULL);
+
+    return p;
+}
+
+DEF_TEST(static_fifo)     { check_fifo(pipe_new_static_for_test);     }
+DEF_TEST(static_close)    { check_close(pipe_new_static_for_test);    }
+DEF_TEST(static_blocking) { check_blocking(pipe_new_static_for_test); }
+DEF_TEST(static_try)      { check_try(pipe_new_static_for_test);      }
+DEF_TEST(static_timed)    { check_timed(pipe_new_static_for_test);    }
+DEF_TEST(static_reserve)  { check_reserve(pipe_new_static_for_test);  }
+DEF_TEST(static_peek)     { check_peek(pipe_new_static_for_test);     }
+
+DEF_TEST(static_stress)
+{
+    check_stress(pipe_new_static_for_test(sizeof(uint64_t), 16),  4, 4, 50000);
+    check_stress(pipe_new_static_for_test(sizeof(uint64_t), 512), 4, 4, 50000);
+}
+
+// pipe_static_size is enough for exactly what it's asked for, wherever the
+// buffer starts, and the pipe stays inside the buffer and leaves it alone once
+// it's freed.
+DEF_TEST(static_size)
+{
+    enum { N = 100 };
+
+    static char buf[8192];
+    int elems[N + 1];
+
+    for(int i = 0; i <= N; ++i)
+        elems[i] = i;
+
+    for(size_t offset = 0; offset < 64; offset += 7)
+    {
+        size_t size = pipe_static_size(sizeof(int), N);
+
+        check(offset + size + 64 <= sizeof buf);
+        memset(buf, 0xa5, sizeof buf);
+
+        pipe_t* p = pipe_new_static(sizeof(int), buf + offset, size, 0);
+        check(p != NULL);
+
+        pipe_producer_t* prod = pipe_producer_new(p);
+        pipe_consumer_t* cons = pipe_consumer_new(p);
+        pipe_free(p);
+
+        // Holds at least N. Anything more comes from lining up the pipe_t.
+        size_t pushed = 0, n;
+
+        while((n = pipe_try_push(prod, elems, 1)) == 1)
+            check(++pushed <= N + 64 / sizeof(int));
+
+        check(n == PIPE_WOULD_BLOCK);
+        check(pushed >= N);
+
+        pipe_producer_free(prod);
+        pipe_consumer_free(cons);
+
+        for(size_t i = 0; i < offset; ++i)
+            check(buf[i] == (char)0xa5);
+
+        for(size_t i = offset + size; i < sizeof buf; ++i)
+            check(buf[i] == (char)0xa5);
+    }
+
+    // Too small for even the pipe_t, which spans several cache lines.
+    check(pipe_new_static(sizeof(int), buf, 1,   0) == NULL);
+    check(pipe_new_static(sizeof(int), buf, 256, 0) == NULL);
+}
+
+// mlock can be refused, for lack of privileges or over RLIMIT_MEMLOCK, in
+// which case there's no pipe. If there is one, it works.
+DEF_TEST(static_mlock)
+{
+    static char buf[16384];
+
+    pipe_t* p = pipe_new_static(sizeof(uint64_t), buf, sizeof buf,
+                                PIPE_STATIC_MLOCK);
+
+    if(p != NULL)
+        check_stress(p, 2, 2, 10000);
+}
+
+// Buffered elements only show up once the batch fills, the handle is flushed
+// or freed, or a push finds them older than the flush age. Either way, they
+// come out in order.
+static void check_buffered_producer(pipe_ctor_t ctor)
+{
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[16];
+
+    pipe_t* p = ctor(sizeof(int), 64);
+    pipe_producer_t* prod = pipe_producer_new_buffered(p, 4, 0);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+
+    check(prod != NULL);
+
+    pipe_push(prod, elems, 3);
+    check(pipe_try_pop(cons, out, 16) == PIPE_WOULD_BLOCK);
+
+    pipe_producer_flush(prod);
+    check(pipe_try_pop(cons, out, 16) == 3);
+    check(out[0] == 0 && out[1] == 1 && out[2] == 2);
+
+    // Filling the batch flushes it.
+    pipe_push(prod, elems, 2);
+    pipe_push(prod, elems + 2, 2);
+    pipe_push(prod, elems + 4, 1);
+    check(pipe_try_pop(cons, out, 16) == 4);
+    pipe_push(prod, elems + 5, 3);
+    check(pipe_pop(cons, out, 4) == 4);
+    check(out[0] == 4 && out[1] == 5 && out[2] == 6 && out[3] == 7);
+
+    pipe_push(prod, elems, 1);
+    pipe_producer_free(prod);
+    check(pipe_try_pop(cons, out, 16) == 1);
+
+    // Age only counts once there's another push. Nothing flushes on its own.
+    prod = pipe_producer_new_buffered(p, 64, 10);
+    check(prod != NULL);
+
+    pipe_push(prod, elems, 1);
+    sleep_ms(20);
+    check(pipe_try_pop(cons, out, 16) == PIPE_WOULD_BLOCK);
+    pipe_push(prod, elems + 1, 1);
+    check(pipe_try_pop(cons, out, 16) == 2);
+    check(out[0] == 0 && out[1] == 1);
+
+    // Freeing the handle flushes it, and only then is the pipe closed.
+    pipe_free(p);
+
+    pipe_push(prod, elems, 8);
+    check(pipe_try_pop(cons, out, 8) == PIPE_WOULD_BLOCK);
+
+    pipe_producer_free(prod);
+    check(pipe_pop(cons, out, 16) == 8);
+    check(memcmp(elems, out, sizeof elems) == 0);
+    check(pipe_pop(cons, out, 8) == 0);
+    pipe_consumer_free(cons);
+}
+
+DEF_TEST(pipe_buffered_producer) { check_buffered_producer(pipe_new);      }
+DEF_TEST(mpmc_buffered_producer) { check_buffered_producer(pipe_new_mpmc); }
+DEF_TEST(segmented_buffered_producer)
+{
+    check_buffered_producer(pipe_new_segmented);
+}
+
+// Lots of threads pushing a few elements at a time is what buffering is for.
+DEF_TEST(buffered_producer_stress)
+{
+    check_stress_buffered(pipe_new(sizeof(uint64_t), 0),
+                          8, 2, 50000, STRESS_BLOCKING, 16, 0);
+    check_stress_buffered(pipe_new(sizeof(uint64_t), 16),
+                          8, 2, 20000, STRESS_BLOCKING, 64, 0);
+    check_stress_buffered(pipe_new_mpmc(sizeof(uint64_t), 64),
+                          8, 2, 20000, STRESS_TRY, 7, 0);
+    check_stress_buffered(pipe_new_spsc(sizeof(uint64_t), 64),
+                          1, 1, 50000, STRESS_TIMED, 32, 0);
+}
+
+// A buffered consumer takes a whole budget at a time, and serves its pops from
+// that, in order, before it looks at the pipe again, even while other
+// consumers carry on with what's after it.
+static void check_buffered_consumer(pipe_ctor_t ctor, bool peek)
+{
+    int elems[10] = { 0, 1, 2, 3, 4, 5, 6, 7, 8, 9 }, out[16];
+
+    pipe_t* p = ctor(sizeof(int), 64);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new_buffered(p, 4);
+    pipe_consumer_t* other = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(cons != NULL);
+    check(pipe_try_pop(cons, out, 1) == PIPE_WOULD_BLOCK);
+
+    pipe_push(prod, elems, 10);
+
+    check(pipe_pop(cons, out, 1) == 1 && out[0] == 0);
+    check(pipe_try_pop(other, out, 2) == 2 && out[0] == 4 && out[1] == 5);
+
+    // Peeks show the cache.
+    if(peek)
+    {
+        pipe_const_span_t first, second;
+
+        check(pipe_pop_peek(cons, 8, &first, &second) == 3);
+        check(second.count == 0);
+        check(((const int*)first.data)[0] == 1);
+        pipe_pop_release(cons, 1);
+    }
+    else
+    {
+        check(pipe_pop(cons, out, 1) == 1 && out[0] == 1);
+    }
+
+    check(pipe_pop_eager(cons, out, 16) == 2);
+    check(out[0] == 2 && out[1] == 3);
+
+    // Pops at least as big as the budget skip the cache.
+    check(pipe_pop_eager(cons, out, 4) == 4);
+    check(out[0] == 6 && out[3] == 9);
+
+    // Once the producers are gone, the cache still drains before pops say so.
+    pipe_push(prod, elems, 3);
+    pipe_producer_free(prod);
+
+    check(pipe_pop(cons, out, 1) == 1 && out[0] == 0);
+    check(pipe_try_pop(other, out, 16) == 0);
+    check(pipe_pop(cons, out, 16) == 2 && out[0] == 1 && out[1] == 2);
+    check(pipe_pop(cons, out, 16) == 0);
+    check(pipe_try_pop(cons, out, 16) == 0);
+
+    pipe_consumer_free(cons);
+    pipe_consumer_free(other);
+}
+
+DEF_TEST(pipe_buffered_consumer) { check_buffered_consumer(pipe_new,      true);  }
+DEF_TEST(spsc_buffered_consumer) { check_buffered_consumer(pipe_new_spsc, true);  }
+DEF_TEST(mpmc_buffered_consumer) { check_buffered_consumer(pipe_new_mpmc, false); }
+DEF_TEST(segmented_buffered_consumer)
+{
+    check_buffered_consumer(pipe_new_segmented, false);
+}
+
+// Each handle still sees each producer's elements in order, even though the
+// handles' caches overtake each other.
+DEF_TEST(buffered_consumer_stress)
+{
+    check_stress_buffered(pipe_new(sizeof(uint64_t), 0),
+                          2, 8, 50000, STRESS_BLOCKING, 0, 16);
+    check_stress_buffered(pipe_new(sizeof(uint64_t), 16),
+                          4, 4, 20000, STRESS_TRY, 0, 8);
+    check_stress_buffered(pipe_new_mpmc(sizeof(uint64_t), 64),
+                          4, 4, 20000, STRESS_TIMED, 0, 7);
+    check_stress_buffered(pipe_new_segmented(sizeof(uint64_t), 0),
+                          4, 4, 20000, STRESS_BLOCKING, 16, 64);
+}
+
+// Fills `record' with a pattern that says which record it is and how long.
+static void fill_record(unsigned char* record, size_t size, uint32_t id)
+{
+    for(size_t i = 0; i < size; ++i)
+        record[i] = (unsigned char)(id * 31 + size + i);
+}
+
+static bool is_record(const unsigned char* record, size_t size, uint32_t id)
+{
+    for(size_t i = 0; i < size; ++i)
+        if(record[i] != (unsigned char)(id * 31 + size + i))
+            return false;
+
+    return true;
+}
+
+// Records come out whole, in order, and exactly as long as they went in. A
+// record too big for the target stays put until it's asked for again.
+DEF_TEST(records)
+{
+    unsigned char rec[256], out[256];
+
+    pipe_t* p = pipe_new_records(0);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_elem_size(PIPE_GENERIC(prod)) == 1);
+
+    // Empty records aren't allowed.
+    check(pipe_push_record(prod, rec, 0) == 0);
+
+    for(uint32_t size = 1; size <= 256; ++size)
+    {
+        fill_record(rec, size, size);
+        check(pipe_push_record(prod, rec, size) == size);
+    }
+
+    for(uint32_t size = 1; size <= 256; ++size)
+    {
+        if(size > 1)
+            check(pipe_pop_record(cons, out, size - 1) == size);
+
+        check(pipe_pop_record(cons, out, sizeof out) == size);
+        check(is_record(out, size, size));
+    }
+
+    pipe_producer_free(prod);
+    check(pipe_pop_record(cons, out, sizeof out) == 0);
+    pipe_consumer_free(cons);
+}
+
+static void* pop_record_later(void* arg)
+{
+    unsigned char out[64];
+
+    sleep_ms(20);
+    check(pipe_pop_record(arg, out, sizeof out) == 40);
+    check(is_record(out, 40, 1));
+
+    return NULL;
+}
+
+// The limit counts bytes, headers included. A record that could never fit is
+// refused, and one that doesn't fit yet waits for pops to make room for all
+// of it.
+DEF_TEST(records_limit)
+{
+    unsigned char rec[512], out[512];
+
+    pipe_t* p = pipe_new_records(128);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_push_record(prod, rec, sizeof rec) == 0);
+
+    size_t big = 128 - sizeof(size_t);
+
+    fill_record(rec, 40, 1);
+    check(pipe_push_record(prod, rec, 40) == 40);
+
+    // Only fits once the first record is gone.
+    fill_record(rec, big, 2);
+
+    uint64_t start = now_ms();
+    pthread_t t = spawn(pop_record_later, cons);
+
+    check(pipe_push_record(prod, rec, big) == big);
+    check(now_ms() - start >= 15);
+    join(t);
+
+    check(pipe_pop_record(cons, out, sizeof out) == big);
+    check(is_record(out, big, 2));
+
+    // With the consumers gone, pushes give up instead of waiting for room.
+    check(pipe_push_record(prod, rec, 40) == 40);
+    pipe_consumer_free(cons);
+    check(pipe_push_record(prod, rec, big) == 0);
+
+    pipe_producer_free(prod);
+}
+
+#define RECORD_PRODUCERS 4
+#define RECORD_COUNT     20000
+
+// Each record starts with who pushed it and its sequence number, and is as long
+// as the sequence number says.
+#define RECORD_HEADER (2 * sizeof(uint32_t))
+
+static size_t record_size(uint32_t seq)
+{
+    return RECORD_HEADER + seq % 61;
+}
+
+typedef struct {
+    pipe_producer_t* prod;
+    uint32_t         id;
+} record_producer_t;
+
+static void* push_records(void* arg)
+{
+    record_producer_t* rp = arg;
+    unsigned char rec[128];
+
+    for(uint32_t seq = 0; seq < RECORD_COUNT; ++seq)
+    {
+        size_t size = record_size(seq);
+
+        fill_record(rec + RECORD_HEADER, size - RECORD_HEADER, seq);
+        memcpy(rec, &rp->id, sizeof rp->id);
+        memcpy(rec + sizeof rp->id, &seq, sizeof seq);
+
+        check(pipe_push_record(rp->prod, rec, size) == size);
+    }
+
+    pipe_producer_free(rp->prod);
+    return NULL;
+}
+
+typedef struct {
+    pipe_consumer_t* cons;
+    size_t           popped;
+} record_consumer_t;
+
+static void* pop_records(void* arg)
+{
+    record_consumer_t* rc = arg;
+    unsigned char out[128];
+    int64_t last[RECORD_PRODUCERS] = { -1, -1, -1, -1 };
+    size_t size;
+
+    while((size = pipe_pop_record(rc->cons, out, sizeof out)))
+    {
+        uint32_t id, seq;
+
+        check(size >= RECORD_HEADER);
+        memcpy(&id,  out,             sizeof id);
+        memcpy(&seq, out + sizeof id, sizeof seq);
+
+        check(id < RECORD_PRODUCERS);
+        check((int64_t)seq > last[id]);
+        check(size == record_size(seq));
+        check(is_record(out + RECORD_HEADER, size - RECORD_HEADER, seq));
+
+        last[id] = seq;
+        rc->popped++;
+    }
+
+    pipe_consumer_free(rc->cons);
+    return NULL;
+}
+
+// Records of all sizes from several producers, wrapping around a small buffer,
+// never come out torn or interleaved.
+DEF_TEST(records_stress)
+{
+    record_producer_t rp[RECORD_PRODUCERS];
+    record_consumer_t rc[RECORD_PRODUCERS];
+    pthread_t         threads[2 * RECORD_PRODUCERS];
+
+    pipe_t* p = pipe_new_records(512);
+
+    for(uint32_t i = 0; i < RECORD_PRODUCERS; ++i)
+    {
+        rp[i] = (record_producer_t) { pipe_producer_new(p), i };
+        rc[i] = (record_consumer_t) { pipe_consumer_new(p), 0 };
+    }
+
+    pipe_free(p);
+
+    for(size_t i = 0; i < RECORD_PRODUCERS; ++i)
+    {
+        threads[i]                    = spawn(pop_records,  rc + i);
+        threads[RECORD_PRODUCERS + i] = spawn(push_records, rp + i);
+    }
+
+    size_t popped = 0;
+
+    for(size_t i = 0; i < 2 * RECORD_PRODUCERS; ++i)
+        join(threads[i]);
+
+    for(size_t i = 0; i < RECORD_PRODUCERS; ++i)
+        popped += rc[i].popped;
+
+    check(popped == RECORD_PRODUCERS * RECORD_COUNT);
+}
+
+static void* release_later(void* arg)
+{
+    pusher_popper_t* pp = arg;
+    void* buf;
+
+    sleep_ms(20);
+    check(pipe_pop(pp->cons, &buf, 1) == 1);
+    pipe_pool_release(pp->cons, buf);
+
+    return NULL;
+}
+
+// The pool hands out `count' distinct buffers, each on cache lines of its own,
+// waits once they're all out, and gives up once nobody can release any more.
+DEF_TEST(pool)
+{
+    enum { COUNT = 5, SIZE = 100 };
+
+    pipe_t* p = pipe_new_pooled(SIZE, COUNT);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_elem_size(PIPE_GENERIC(prod)) == sizeof(void*));
+
+    unsigned char* bufs[COUNT];
+
+    for(size_t i = 0; i < COUNT; ++i)
+    {
+        bufs[i] = pipe_pool_acquire(prod);
+
+        check(bufs[i] != NULL);
+        check((uintptr_t)bufs[i] % 64 == 0);
+
+        for(size_t j = 0; j < i; ++j)
+            check(bufs[i] - bufs[j] >= 128 || bufs[j] - bufs[i] >= 128);
+
+        memset(bufs[i], (int)i, SIZE);
+        pipe_push(prod, &bufs[i], 1);
+    }
+
+    // They're all out, so this waits for one to come back.
+    pusher_popper_t pp = { .cons = cons };
+    pthread_t t = spawn(release_later, &pp);
+
+    unsigned char* buf = pipe_pool_acquire(prod);
+    check(buf == bufs[0]);
+    join(t);
+
+    pipe_pool_release(cons, buf);
+
+    for(size_t i = 1; i < COUNT; ++i)
+    {
+        check(pipe_pop(cons, &buf, 1) == 1);
+        check(buf == bufs[i]);
+
+        for(size_t j = 0; j < SIZE; ++j)
+            check(buf[j] == i);
+
+        pipe_pool_release(cons, buf);
+    }
+
+    pipe_consumer_free(cons);
+
+    // Whatever was released is still there, but then nothing more can come.
+    for(size_t i = 0; i < COUNT; ++i)
+        check(pipe_pool_acquire(prod) != NULL);
+
+    check(pipe_pool_acquire(prod) == NULL);
+
+    pipe_producer_free(prod);
+}
+
+#define POOL_THREADS 4
+#define POOL_PAYLOAD 1000
+
+typedef struct {
+    pipe_producer_t* prod;
+    uint32_t         id;
+} pool_producer_t;
+
+// Fills each buffer with its producer and sequence number, all the way through,
+// so a buffer handed to two owners at once shows up as a torn payload.
+static void* pool_push(void* arg)
+{
+    pool_producer_t* pp = arg;
+
+    for(uint32_t seq = 0; seq < 20000; ++seq)
+    {
+        uint32_t* buf = pipe_pool_acquire(pp->prod);
+        check(buf != NULL);
+
+        for(size_t i = 0; i < POOL_PAYLOAD / sizeof *buf; ++i)
+            buf[i] = pp->id << 24 | seq;
+
+        pipe_push(pp->prod, &buf, 1);
+    }
+
+    pipe_producer_free(pp->prod);
+    return NULL;
+}
+
+static void* pool_pop(void* arg)
+{
+    pipe_consumer_t* cons = arg;
+    uint32_t* buf;
+
+    while(pipe_pop(cons, &buf, 1))
+    {
+        for(size_t i = 1; i < POOL_PAYLOAD / sizeof *buf; ++i)
+            check(buf[i] == buf[0]);
+
+        pipe_pool_release(cons, buf);
+    }
+
+    pipe_consumer_free(cons);
+    return NULL;
+}
+
+// Far more payloads than buffers, so every buffer goes around thousands of
+// times.
+DEF_TEST(pool_stress)
+{
+    pool_producer_t pp[POOL_THREADS];
+    pthread_t       threads[2 * POOL_THREADS];
+
+    pipe_t* p = pipe_new_pooled(POOL_PAYLOAD, 8);
+
+    for(uint32_t i = 0; i < POOL_THREADS; ++i)
+    {
+        pp[i] = (pool_producer_t) { pipe_producer_new(p), i };
+        threads[i] = spawn(pool_pop, pipe_consumer_new(p));
+    }
+
+    pipe_free(p);
+
+    for(size_t i = 0; i < POOL_THREADS; ++i)
+        threads[POOL_THREADS + i] = spawn(pool_push, pp + i);
+
+    for(size_t i = 0; i < 2 * POOL_THREADS; ++i)
+        join(threads[i]);
+}
+
+// With a single consumer and backpressure, a broadcast pipe behaves just like
+// any other pipe.
+static pipe_t* pipe_new_broadcast_for_test(size_t elem_size, size_t limit)
+{
+    return pipe_new_broadcast(elem_size, limit, PIPE_BROADCAST_BACKPRESSURE);
+}
+
+DEF_TEST(broadcast_fifo)     { check_fifo(pipe_new_broadcast_for_test);     }
+DEF_TEST(broadcast_close)    { check_close(pipe_new_broadcast_for_test);    }
+DEF_TEST(broadcast_blocking) { check_blocking(pipe_new_broadcast_for_test); }
+DEF_TEST(broadcast_try)      { check_try(pipe_new_broadcast_for_test);      }
+DEF_TEST(broadcast_timed)    { check_timed(pipe_new_broadcast_for_test);    }
+
+// Every consumer gets every element pushed after it was made, and the slowest
+// one holds up the producers.
+DEF_TEST(broadcast_fanout)
+{
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[8];
+
+    pipe_t* p = pipe_new_broadcast(sizeof(int), 4, PIPE_BROADCAST_BACKPRESSURE);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* a = pipe_consumer_new(p);
+
+    pipe_push(prod, elems, 2);
+
+    pipe_consumer_t* b = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(a != NULL && b != NULL);
+
+    pipe_push(prod, elems + 2, 2);
+
+    check(pipe_pop(a, out, 4) == 4);
+    check(memcmp(out, elems, 4 * sizeof(int)) == 0);
+    check(pipe_try_pop(a, out, 4) == PIPE_WOULD_BLOCK);
+
+    // `b' came in late, so it only has two, and there's room for two more.
+    check(pipe_try_push(prod, elems + 4, 4) == 2);
+    check(pipe_try_push(prod, elems + 6, 2) == PIPE_WOULD_BLOCK);
+
+    check(pipe_pop(a, out, 2) == 2 && out[0] == 4 && out[1] == 5);
+    check(pipe_try_pop(b, out, 1) == 1 && out[0] == 2);
+
+    // There's room for 6, but 7 has to wait for `b' to pop more.
+    pusher_popper_t pp = { .prod = prod, .elems = elems + 6, .count = 2 };
+    pthread_t t = spawn(push_in_thread, &pp);
+
+    sleep_ms(20);
+    check(pipe_try_pop(a, out, 2) == 1 && out[0] == 6);
+
+    check(pipe_pop(b, out, 5) == 5);
+    check(out[0] == 3 && out[1] == 4 && out[4] == 7);
+    join(t);
+
+    check(pipe_pop(a, out, 1) == 1 && out[0] == 7);
+
+    check(!pipe_consumer_dropped(a) && !pipe_consumer_dropped(b));
+
+    // The producers are gone, but each consumer still drains what it has left.
+    pipe_push(prod, elems, 1);
+    pipe_producer_free(prod);
+
+    check(pipe_pop(a, out, 4) == 1);
+    check(pipe_pop(a, out, 4) == 0);
+    check(pipe_pop(b, out, 4) == 1);
+    check(pipe_pop(b, out, 4) == 0);
+
+    pipe_consumer_free(a);
+    pipe_consumer_free(b);
+}
+
+// With PIPE_BROADCAST_DROP, the producers never wait, and a consumer that falls
+// a whole ring behind is cut off without holding up the others.
+DEF_TEST(broadcast_drop)
+{
+    int elems[16], out[16];
+
+    for(int i = 0; i < 16; ++i)
+        elems[i] = i;
+
+    pipe_t* p = pipe_new_broadcast(sizeof(int), 8, PIPE_BROADCAST_DROP);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* fast = pipe_consumer_new(p);
+    pipe_consumer_t* slow = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_try_pop(slow, out, 1) == PIPE_WOULD_BLOCK);
+
+    for(int i = 0; i < 16; i += 4)
+    {
+        check(pipe_try_push(prod, elems + i, 4) == 4);
+        check(pipe_pop(fast, out, 4) == 4);
+        check(out[0] == i && out[3] == i + 3);
+    }
+
+    check(pipe_pop(slow, out, 4) == 0);
+    check(pipe_try_pop(slow, out, 4) == 0);
+    check(pipe_consumer_dropped(slow));
+    check(!pipe_consumer_dropped(fast));
+
+    pipe_consumer_free(slow);
+    pipe_producer_free(prod);
+
+    check(pipe_pop(fast, out, 4) == 0);
+    check(!pipe_consumer_dropped(fast));
+
+    pipe_consumer_free(fast);
+}
+
+// Runs `producers' threads pushing `count' elements each into a broadcast pipe,
+// against `consumers' threads that each should see all of them, in order per
+// producer. With PIPE_BROADCAST_DROP, a consumer may be cut off instead, but
+// what it got until then must still be in order.
+static void check_broadcast_stress(size_t limit,
+                                   pipe_broadcast_policy_t policy,
+                                   size_t producers,
+                                   size_t consumers,
+                                   size_t count)
+{
+    stress_producer_t sp[STRESS_MAX_PRODUCERS];
+    stress_consumer_t sc[STRESS_MAX_PRODUCERS];
+    pthread_t         threads[2 * STRESS_MAX_PRODUCERS];
+    stress_progress_t progress = { .done = 0 };
+
+    pthread_mutex_init(&progress.lock, NULL);
+
+    pipe_t* p = pipe_new_broadcast(sizeof(uint64_t), limit, policy);
+
+    for(size_t i = 0; i < producers; ++i)
+        sp[i] = (stress_producer_t) { pipe_producer_new(p), i, count,
+                                      STRESS_BLOCKING, &progress };
+
+    for(size_t i = 0; i < consumers; ++i)
+        sc[i] = (stress_consumer_t) { .cons      = pipe_consumer_new(p),
+                                      .producers = producers,
+                                      .mode      = STRESS_BLOCKING,
+                                      .progress  = &progress };
+
+    pipe_free(p);
+
+    for(size_t i = 0; i < consumers; ++i)
+        threads[i] = spawn(stress_pop, sc + i);
+
+    for(size_t i = 0; i < producers; ++i)
+        threads[consumers + i] = spawn(stress_push, sp + i);
+
+    for(size_t i = 0; i < producers + consumers; ++i)
+        join(threads[i]);
+
+    for(size_t i = 0; i < consumers; ++i)
+    {
+        check(policy == PIPE_BROADCAST_DROP || !sc[i].dropped);
+
+        if(sc[i].dropped)
+            continue;
+
+        for(size_t id = 0; id < producers; ++id)
+        {
+            check(sc[i].popped[id] == count);
+            check(sc[i].seq_sum[id] == (uint64_t)count * (count - 1) / 2);
+        }
+    }
+
+    pthread_mutex_destroy(&progress.lock);
+}
+
+// Consumers that keep up get everything. With backpressure, they all keep up.
+DEF_TEST(broadcast_stress)
+{
+    check_broadcast_stress(4,    PIPE_BROADCAST_BACKPRESSURE, 1, 4, 100000);
+    check_broadcast_stress(64,   PIPE_BROADCAST_BACKPRESSURE, 4, 4, 50000);
+    check_broadcast_stress(16,   PIPE_BROADCAST_DROP,         2, 4, 50000);
+    check_broadcast_stress(4096, PIPE_BROADCAST_DROP,         4, 4, 50000);
+}
+
+// With plain pushes, everything goes into the lowest level, and a priority pipe
+// behaves like any other pipe.
+static pipe_t* pipe_new_priority_for_test(size_t elem_size, size_t limit)
+{
+    return pipe_new_priority(elem_size, 3, limit, 0);
+}
+
+DEF_TEST(priority_fifo)     { check_fifo(pipe_new_priority_for_test);     }
+DEF_TEST(priority_close)    { check_close(pipe_new_priority_for_test);    }
+DEF_TEST(priority_blocking) { check_blocking(pipe_new_priority_for_test); }
+DEF_TEST(priority_try)      { check_try(pipe_new_priority_for_test);      }
+DEF_TEST(priority_timed)    { check_timed(pipe_new_priority_for_test);    }
+
+// Pops come from the highest level with anything in it, and within a level,
+// in order.
+DEF_TEST(priority_order)
+{
+    int elems[9] = { 0, 1, 2, 3, 4, 5, 6, 7, 8 }, out[9];
+
+    pipe_t* p = pipe_new_priority(sizeof(int), 3, 0, 0);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    pipe_push(prod, elems + 6, 2);
+    check(pipe_push_priority(prod, 1, elems + 3, 3) == 3);
+    check(pipe_push_priority(prod, 0, elems, 3) == 3);
+    pipe_push(prod, elems + 8, 1);
+
+    check(pipe_pop_eager(cons, out, 9) == 3);
+    check(out[0] == 0 && out[2] == 2);
+    check(pipe_try_pop(cons, out, 1) == 1 && out[0] == 3);
+
+    // pipe_pop fills `target' from one level after another.
+    check(pipe_pop(cons, out, 5) == 5);
+    check(out[0] == 4 && out[1] == 5 && out[2] == 6 && out[4] == 8);
+
+    check(pipe_try_pop(cons, out, 1) == PIPE_WOULD_BLOCK);
+
+    // Once the producers are gone, whatever's left in any level still comes
+    // out first.
+    check(pipe_push_priority(prod, 2, elems, 1) == 1);
+    check(pipe_push_priority(prod, 1, elems + 1, 1) == 1);
+    pipe_producer_free(prod);
+
+    check(pipe_pop(cons, out, 9) == 2);
+    check(out[0] == 1 && out[1] == 0);
+    check(pipe_pop(cons, out, 9) == 0);
+    check(pipe_try_pop(cons, out, 9) == 0);
+
+    pipe_consumer_free(cons);
+}
+
+// A lower level with elements gets a turn after `quota' pops ahead of it.
+DEF_TEST(priority_quota)
+{
+    int hi[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, lo[2] = { 100, 101 }, out;
+
+    pipe_t* p = pipe_new_priority(sizeof(int), 2, 0, 3);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_push_priority(prod, 0, hi, 8) == 8);
+    check(pipe_push_priority(prod, 1, lo, 2) == 2);
+
+    static const int expected[10] = { 0, 1, 2, 100, 3, 4, 5, 101, 6, 7 };
+
+    for(size_t i = 0; i < 10; ++i)
+    {
+        check(pipe_pop(cons, &out, 1) == 1);
+        check(out == expected[i]);
+    }
+
+    pipe_producer_free(prod);
+    pipe_consumer_free(cons);
+}
+
+// Pushes into a full level wait for room in that level only.
+DEF_TEST(priority_limit)
+{
+    int elems[8] = { 0, 1, 2, 3, 4, 5, 6, 7 }, out[8];
+
+    pipe_t* p = pipe_new_priority(sizeof(int), 2, 4, 0);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    size_t total = 0;
+
+    while(pipe_try_push(prod, elems, 1) == 1)
+        check(++total <= 64);
+
+    check(total >= 4);
+    check(pipe_push_priority(prod, 0, elems, 2) == 2);
+
+    check(pipe_pop(cons, out, 2) == 2);
+    check(out[0] == 0 && out[1] == 1);
+
+    // The lowest level is still full, so this waits for a pop.
+    pusher_popper_t pp = { .prod = prod, .elems = elems + 7, .count = 1 };
+    pthread_t t = spawn(push_in_thread, &pp);
+
+    sleep_ms(20);
+    check(pipe_pop(cons, out, 1) == 1 && out[0] == 0);
+    join(t);
+
+    pipe_producer_free(prod);
+
+    // What's left is the rest of the lowest level, then the late push.
+    size_t popped = 0, n;
+    int    last   = -1;
+
+    while((n = pipe_pop_eager(cons, out, 8)) > 0)
+    {
+        popped += n;
+        last    = out[n - 1];
+    }
+
+    check(popped == total);
+    check(last == 7);
+
+    pipe_consumer_free(cons);
+}
+
+// CPU time used by the calling thread, in microseconds.
+static uint64_t thread_cpu_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &t);
+
+    return (uint64_t)t.tv_sec * 1000000 + (uint64_t)t.tv_nsec / 1000;
+}
+
+static uint64_t now_us(void)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+
+    return (uint64_t)t.tv_sec * 1000000 + (uint64_t)t.tv_nsec / 1000;
+}
+
+enum {
+    CONTENDED_ELEM   = 1024,
+    CONTENDED_BIG    = 30000,
+    CONTENDED_SMALL  = 3,       // Threads pushing or popping alongside.
+    CONTENDED_PUSHES = 256      // The most pushes each of those makes.
+};
+
+// How far the big push has got.
+typedef struct {
+    pthread_mutex_t lock;
+    bool            started,
+                    done;
+} contended_state_t;
+
+typedef struct {
+    pipe_producer_t*   prod;
+    const char*        elems;
+    contended_state_t* state;
+    size_t             pushed;
+    uint64_t           wall_us,
+                       cpu_us;
+} contended_push_t;
+
+static void set_flag(contended_state_t* st, bool* flag)
+{
+    pthread_mutex_lock(&st->lock);
+        *flag = true;
+    pthread_mutex_unlock(&st->lock);
+}
+
+static bool get_flag(contended_state_t* st, const bool* flag)
+{
+    pthread_mutex_lock(&st->lock);
+        bool ret = *flag;
+    pthread_mutex_unlock(&st->lock);
+
+    return ret;
+}
+
+static void* push_big(void* arg)
+{
+    contended_push_t* cp = arg;
+
+    set_flag(cp->state, &cp->state->started);
+    pipe_push(cp->prod, cp->elems, CONTENDED_BIG);
+    set_flag(cp->state, &cp->state->done);
+
+    cp->pushed = CONTENDED_BIG;
+
+    return NULL;
+}
+
+// Pushes one element at a time while the big push is going on, keeping track
+// of how long the pushes took, and how much CPU time they burned doing it.
+static void* push_small(void* arg)
+{
+    contended_push_t* cp = arg;
+
+    while(!get_flag(cp->state, &cp->state->started))
+        sleep_ms(1);
+
+    sleep_ms(2);
+
+    do
+    {
+        uint64_t wall = now_us(),
+                 cpu  = thread_cpu_us();
+
+        pipe_push(cp->prod, cp->elems, 1);
+
+        cp->wall_us += now_us() - wall;
+        cp->cpu_us  += thread_cpu_us() - cpu;
+        cp->pushed++;
+    }
+    while(cp->pushed < CONTENDED_PUSHES
+       && !get_flag(cp->state, &cp->state->done));
+
+    return NULL;
+}
+
+// Every producer of `p' pushes into the same part. One pushes so much in one go
+// that it holds the part's end_lock for a good while, growing the buffer and
+// copying in, and the others push into it meanwhile. They have to sleep until
+// it's done, not spin on the lock. CONTENDED_BIG isn't a power of two, so the
+// buffer it grows into has room left for all of theirs, and they have no
+// resizing of their own to spend CPU time on.
+static void check_contended_push(pipe_t* p)
+{
+    char* elems = calloc(CONTENDED_BIG, CONTENDED_ELEM);
+    check(elems);
+
+    contended_state_t state = { .started = false, .done = false };
+    pthread_mutex_init(&state.lock, NULL);
+
+    contended_push_t big = {
+        .prod = pipe_producer_new(p), .elems = elems, .state = &state,
+    }, small[CONTENDED_SMALL];
+
+    pthread_t t[CONTENDED_SMALL];
+
+    for(size_t i = 0; i < CONTENDED_SMALL; ++i)
+    {
+        small[i] = big;
+        small[i].prod = pipe_producer_new(p);
+        t[i] = spawn(push_small, &small[i]);
+    }
+
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    pthread_t tb = spawn(push_big, &big);
+
+    join(tb);
+
+    uint64_t wall_us = 0, cpu_us = 0;
+    size_t   total   = big.pushed;
+
+    for(size_t i = 0; i < CONTENDED_SMALL; ++i)
+    {
+        join(t[i]);
+        pipe_producer_free(small[i].prod);
+
+        wall_us += small[i].wall_us;
+        cpu_us  += small[i].cpu_us;
+        total   += small[i].pushed;
+    }
+
+    pipe_producer_free(big.prod);
+    pthread_mutex_destroy(&state.lock);
+
+    // Spinning takes a fair share of the CPU for as long as the pushes wait.
+    check(wall_us >= 10000);
+    check(cpu_us < wall_us / 10);
+
+    size_t popped = 0, n;
+
+    while((n = pipe_pop_eager(cons, elems, CONTENDED_BIG)))
+        popped += n;
+
+    check(popped == total);
+
+    pipe_consumer_free(cons);
+    free(elems);
+}
+
+DEF_TEST(priority_contended)
+{
+    check_contended_push(pipe_new_priority(CONTENDED_ELEM, 3, 0, 0));
+}
+
+// Each producer pushes into its own level, so its elements still come out in
+// order, while consumers keep switching levels and racing each other for the
+// level they picked.
+DEF_TEST(priority_stress)
+{
+    check_stress(pipe_new_priority(sizeof(uint64_t), 3, 0, 0), 4, 4, 50000);
+    check_stress_with(pipe_new_priority(sizeof(uint64_t), STRESS_LEVELS, 16, 0),
+                      6, 4, 30000, STRESS_PRIORITY);
+    check_stress_with(pipe_new_priority(sizeof(uint64_t), STRESS_LEVELS, 0, 5),
+                      6, 4, 30000, STRESS_PRIORITY);
+    check_stress_with(pipe_new_priority(sizeof(uint64_t), STRESS_LEVELS, 16, 2),
+                      3, 1, 30000, STRESS_PRIORITY);
+}
+
+// Every engine that pipe_select works with.
+static const pipe_ctor_t select_ctors[] = {
+    pipe_new,
+    pipe_new_spsc,
+    pipe_new_mpmc,
+    pipe_new_mirrored,
+    pipe_new_segmented,
+    pipe_new_broadcast_for_test,
+    pipe_new_priority_for_test,
+};
+
+#define SELECT_CTORS (sizeof select_ctors / sizeof *select_ctors)
+
+typedef struct {
+    pipe_producer_t* prod;
+    unsigned         delay_ms;
+} delayed_push_t;
+
+static void* push_one_later(void* arg)
+{
+    delayed_push_t* dp = arg;
+    int x = 42;
+
+    sleep_ms(dp->delay_ms);
+    pipe_push(dp->prod, &x, 1);
+
+    return NULL;
+}
+
+static void* free_one_later(void* arg)
+{
+    delayed_push_t* dp = arg;
+
+    sleep_ms(dp->delay_ms);
+    pipe_producer_free(dp->prod);
+
+    return NULL;
+}
+
+// Selects over `count' pipes, `count' / SELECT_CTORS of each engine, which is
+// enough to need more than the stack holds when it's big.
+static void check_select(size_t count)
+{
+    pipe_producer_t* prods[64];
+    pipe_consumer_t* conss[64];
+    int              ready[64], x;
+
+    check(count <= 64);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        pipe_t* p = select_ctors[i % SELECT_CTORS](sizeof(int), 4);
+
+        prods[i] = pipe_producer_new(p);
+        conss[i] = pipe_consumer_new(p);
+        pipe_free(p);
+    }
+
+    // Nothing's ready, so it times out, and not before the deadline.
+    uint64_t start = now_ms();
+    struct timespec deadline = deadline_in_ms(20);
+
+    check(pipe_select(conss, count, ready, &deadline) == PIPE_WOULD_BLOCK);
+    check(now_ms() - start >= 19);
+
+    for(size_t i = 0; i < count; ++i)
+        check(ready[i] == 0);
+
+    // Whatever's ready is reported right away, and nothing else is.
+    pipe_push(prods[1], &x, 1);
+    pipe_push(prods[count - 1], &x, 1);
+
+    check(pipe_select(conss, count, ready, NULL) == 2);
+
+    for(size_t i = 0; i < count; ++i)
+        check(ready[i] == (i == 1 || i == count - 1));
+
+    check(pipe_try_pop(conss[1], &x, 1) == 1);
+    check(pipe_try_pop(conss[count - 1], &x, 1) == 1);
+
+    // A push into any one of them wakes it up, whatever the engine.
+    for(size_t i = 0; i < count; ++i)
+    {
+        delayed_push_t dp = { prods[i], 10 };
+        pthread_t t = spawn(push_one_later, &dp);
+
+        start = now_ms();
+        check(pipe_select(conss, count, ready, NULL) == 1);
+        check(ready[i]);
+        check(now_ms() - start < 4000);
+        join(t);
+
+        check(pipe_try_pop(conss[i], &x, 1) == 1 && x == 42);
+    }
+
+    // So does the last producer leaving.
+    delayed_push_t dp = { prods[0], 10 };
+    pthread_t t = spawn(free_one_later, &dp);
+
+    check(pipe_select(conss, count, ready, NULL) == 1);
+    check(ready[0]);
+    check(pipe_try_pop(conss[0], &x, 1) == 0);
+    join(t);
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        if(i > 0)
+            pipe_producer_free(prods[i]);
+
+        pipe_consumer_free(conss[i]);
+    }
+}
+
+DEF_TEST(select)       { check_select(SELECT_CTORS);     }
+DEF_TEST(select_large) { check_select(3 * SELECT_CTORS); }
+
+// A buffered consumer with something cached is ready, even though its pipe is
+// empty.
+DEF_TEST(select_buffered)
+{
+    int elems[2] = { 1, 2 }, ready[1], x;
+
+    pipe_t* p = pipe_new(sizeof(int), 0);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new_buffered(p, 8);
+    pipe_free(p);
+
+    pipe_push(prod, elems, 2);
+    check(pipe_pop(cons, &x, 1) == 1 && x == 1);
+
+    struct timespec deadline = deadline_in_ms(0);
+    check(pipe_select(&cons, 1, ready, &deadline) == 1 && ready[0]);
+    check(pipe_try_pop(cons, &x, 1) == 1 && x == 2);
+
+    deadline = deadline_in_ms(0);
+    check(pipe_select(&cons, 1, ready, &deadline) == PIPE_WOULD_BLOCK);
+
+    pipe_producer_free(prod);
+    pipe_consumer_free(cons);
+}
+
+#define SELECT_STRESS_PIPES 8
+#define SELECT_STRESS_COUNT 20000
+
+static void* select_stress_push(void* arg)
+{
+    pipe_producer_t* prod = arg;
+
+    for(int i = 0; i < SELECT_STRESS_COUNT; ++i)
+        pipe_push(prod, &i, 1);
+
+    pipe_producer_free(prod);
+    return NULL;
+}
+
+// One thread serves a producer thread per pipe, and gets everything from each,
+// in order, without ever blocking on any one pipe.
+DEF_TEST(select_stress)
+{
+    pipe_consumer_t* conss[SELECT_STRESS_PIPES];
+    pthread_t        threads[SELECT_STRESS_PIPES];
+    int              ready[SELECT_STRESS_PIPES], next[SELECT_STRESS_PIPES];
+    size_t           open = SELECT_STRESS_PIPES;
+
+    for(size_t i = 0; i < SELECT_STRESS_PIPES; ++i)
+    {
+        pipe_t* p = select_ctors[i % SELECT_CTORS](sizeof(int), 16);
+
+        conss[i] = pipe_consumer_new(p);
+        threads[i] = spawn(select_stress_push, pipe_producer_new(p));
+        pipe_free(p);
+
+        next[i] = 0;
+    }
+
+    // Closed pipes are always ready, so they're swapped out of the first
+    // `open' as they close.
+    while(open > 0)
+    {
+        size_t n = pipe_select(conss, open, ready, NULL);
+        check(n > 0 && n != PIPE_WOULD_BLOCK);
+
+        for(size_t i = open; i-- > 0;)
+        {
+            if(!ready[i])
+                continue;
+
+            int    out[16];
+            size_t popped = pipe_try_pop(conss[i], out, 16);
+
+            if(popped == PIPE_WOULD_BLOCK)
+                continue;
+
+            if(popped == 0)
+            {
+                check(next[i] == SELECT_STRESS_COUNT);
+                pipe_consumer_free(conss[i]);
+
+                --open;
+                conss[i] = conss[open];
+                next[i]  = next[open];
+                continue;
+            }
+
+            for(size_t j = 0; j < popped; ++j)
+                check(out[j] == next[i]++);
+        }
+    }
+
+    for(size_t i = 0; i < SELECT_STRESS_PIPES; ++i)
+        join(threads[i]);
+}
+
+// Whether `fd' becomes readable within `ms' milliseconds.
+static bool fd_readable(int fd, int ms)
+{
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    int n = poll(&pfd, 1, ms);
+
+    check(n >= 0);
+    return n == 1 && (pfd.revents & POLLIN);
+}
+
+// The consumer's descriptor is readable while there's something to pop, and
+// the producer's while there's room, until a try call comes up empty. Both
+// come up for good once the other side leaves.
+static void check_fds(pipe_ctor_t ctor)
+{
+    int elems[64] = { 0 }, out[64];
+
+    pipe_t* p = ctor(sizeof(int), 4);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    int rfd = pipe_consumer_fd(cons),
+        wfd = pipe_producer_fd(prod);
+
+    check(rfd >= 0 && wfd >= 0 && rfd != wfd);
+
+    // Every handle shares the same descriptors.
+    check(pipe_consumer_fd(cons) == rfd);
+    check(pipe_producer_fd(prod) == wfd);
+
+    // Empty, with room. New descriptors start out as whatever's true.
+    check(!fd_readable(rfd, 0));
+    check(fd_readable(wfd, 0));
+
+    pipe_push(prod, elems, 1);
+    check(fd_readable(rfd, 0));
+
+    // It stays readable until a try_pop would block, not just until a pop.
+    check(pipe_pop(cons, out, 1) == 1);
+    check(fd_readable(rfd, 0));
+    check(pipe_try_pop(cons, out, 1) == PIPE_WOULD_BLOCK);
+    check(!fd_readable(rfd, 0));
+
+    // A push from another thread wakes a poll up.
+    delayed_push_t dp = { prod, 10 };
+    pthread_t t = spawn(push_one_later, &dp);
+
+    check(fd_readable(rfd, 5000));
+    join(t);
+    check(pipe_try_pop(cons, out, 64) == 1);
+
+    // Fill it up, and the producer's goes quiet once a try_push would block.
+    size_t pushed;
+
+    while((pushed = pipe_try_push(prod, elems, 1)) == 1)
+        continue;
+
+    check(pushed == PIPE_WOULD_BLOCK);
+    check(!fd_readable(wfd, 0));
+
+    check(pipe_pop(cons, out, 1) == 1);
+    check(fd_readable(wfd, 0));
+
+    // Draining and closing.
+    while(pipe_try_pop(cons, out, 64) != PIPE_WOULD_BLOCK)
+        continue;
+
+    check(!fd_readable(rfd, 0));
+    pipe_producer_free(prod);
+    check(fd_readable(rfd, 0));
+    check(pipe_try_pop(cons, out, 64) == 0);
+    check(fd_readable(rfd, 0));
+
+    pipe_consumer_free(cons);
+
+    // Consumers leaving makes the producer's readable for good.
+    p = ctor(sizeof(int), 4);
+    prod = pipe_producer_new(p);
+    cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    wfd = pipe_producer_fd(prod);
+    check(wfd >= 0);
+
+    while(pipe_try_push(prod, elems, 64) != PIPE_WOULD_BLOCK)
+        continue;
+
+    check(!fd_readable(wfd, 0));
+    pipe_consumer_free(cons);
+    check(fd_readable(wfd, 0));
+    check(pipe_try_push(prod, elems, 1) == 0);
+
+    pipe_producer_free(prod);
+}
+
+DEF_TEST(fds)
+{
+    for(size_t i = 0; i < SELECT_CTORS; ++i)
+        if(select_ctors[i] != pipe_new_broadcast_for_test)
+            check_fds(select_ctors[i]);
+}
+
+// Broadcast consumers each see something different, so there's no one
+// descriptor for them, but the producers still get one.
+DEF_TEST(broadcast_fds)
+{
+    pipe_t* p = pipe_new_broadcast(sizeof(int), 4, PIPE_BROADCAST_BACKPRESSURE);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    check(pipe_consumer_fd(cons) == -1);
+
+    int wfd = pipe_producer_fd(prod);
+    check(wfd >= 0 && fd_readable(wfd, 0));
+
+    pipe_producer_free(prod);
+    pipe_consumer_free(cons);
+}
+
+// A single handle sticks to a single shard, so it sees a pipe like any other.
+static pipe_t* pipe_new_sharded_for_test(size_t elem_size, size_t limit)
+{
+    return pipe_new_sharded(elem_size, 4, limit);
+}
+
+DEF_TEST(sharded_fifo)     { check_fifo(pipe_new_sharded_for_test);     }
+DEF_TEST(sharded_close)    { check_close(pipe_new_sharded_for_test);    }
+DEF_TEST(sharded_blocking) { check_blocking(pipe_new_sharded_for_test); }
+DEF_TEST(sharded_try)      { check_try(pipe_new_sharded_for_test);      }
+DEF_TEST(sharded_timed)    { check_timed(pipe_new_sharded_for_test);    }
+
+typedef struct {
+    pipe_consumer_t*   cons;
+    char*              elems;
+    contended_state_t* state;
+    size_t             popped;
+    uint64_t           wall_us,
+                       cpu_us;
+} contended_pop_t;
+
+static void* pop_big(void* arg)
+{
+    contended_pop_t* cp = arg;
+
+    set_flag(cp->state, &cp->state->started);
+    cp->popped = pipe_pop_eager(cp->cons, cp->elems, CONTENDED_BIG);
+    set_flag(cp->state, &cp->state->done);
+
+    return NULL;
+}
+
+// Pops one element at a time, until the pipe runs dry for good, keeping track
+// like push_small.
+static void* pop_small(void* arg)
+{
+    contended_pop_t* cp = arg;
+
+    while(!get_flag(cp->state, &cp->state->started))
+        sleep_ms(1);
+
+    for(;;)
+    {
+        uint64_t wall = now_us(),
+                 cpu  = thread_cpu_us();
+
+        size_t n = pipe_pop_eager(cp->cons, cp->elems, 1);
+
+        cp->wall_us += now_us() - wall;
+        cp->cpu_us  += thread_cpu_us() - cpu;
+
+        if(n == 0)
+            return NULL;
+
+        cp->popped += n;
+    }
+}
+
+// The same as check_contended_push, for consumers. One pops everything in one
+// go, holding the part's begin_lock while it copies it all out, and the others
+// pop meanwhile. They have to sleep on the lock, not spin on it.
+static void check_contended_pop(pipe_t* p)
+{
+    char* elems = calloc(CONTENDED_BIG, CONTENDED_ELEM);
+    char  small_elems[CONTENDED_SMALL][CONTENDED_ELEM];
+    check(elems);
+
+    contended_state_t state = { .started = false, .done = false };
+    pthread_mutex_init(&state.lock, NULL);
+
+    pipe_producer_t* prod = pipe_producer_new(p);
+
+    contended_pop_t big = {
+        .cons = pipe_consumer_new(p), .elems = elems, .state = &state,
+    }, small[CONTENDED_SMALL];
+
+    for(size_t i = 0; i < CONTENDED_SMALL; ++i)
+    {
+        small[i]       = big;
+        small[i].cons  = pipe_consumer_new(p);
+        small[i].elems = small_elems[i];
+    }
+
+    pipe_free(p);
+
+    pipe_push(prod, elems, CONTENDED_BIG);
+
+    pthread_t t[CONTENDED_SMALL];
+
+    for(size_t i = 0; i < CONTENDED_SMALL; ++i)
+        t[i] = spawn(pop_small, &small[i]);
+
+    pthread_t tb = spawn(pop_big, &big);
+
+    join(tb);
+
+    // That lets the others go, once they've seen there's nothing left.
+    pipe_producer_free(prod);
+
+    uint64_t wall_us = 0, cpu_us = 0;
+    size_t   total   = big.popped;
+
+    for(size_t i = 0; i < CONTENDED_SMALL; ++i)
+    {
+        join(t[i]);
+        pipe_consumer_free(small[i].cons);
+
+        wall_us += small[i].wall_us;
+        cpu_us  += small[i].cpu_us;
+        total   += small[i].popped;
+    }
+
+    pipe_consumer_free(big.cons);
+    pthread_mutex_destroy(&state.lock);
+
+    check(total == CONTENDED_BIG);
+
+    check(wall_us >= 10000);
+    check(cpu_us < wall_us / 10);
+
+    free(elems);
+}
+
+// With a single shard, every producer shares it, and every consumer goes for
+// it.
+DEF_TEST(sharded_contended)
+{
+    check_contended_push(pipe_new_sharded(CONTENDED_ELEM, 1, 0));
+    check_contended_pop(pipe_new_sharded(CONTENDED_ELEM, 1, 0));
+}
+
+// Each producer's elements come out in order, whether it has a shard to itself
+// or shares one, and whether or not it buffers.
+DEF_TEST(sharded_stress)
+{
+    check_stress(pipe_new_sharded(sizeof(uint64_t), 8, 0),  8, 4, 50000);
+    check_stress(pipe_new_sharded(sizeof(uint64_t), 3, 16), 8, 4, 30000);
+    check_stress_with(pipe_new_sharded(sizeof(uint64_t), 4, 16),
+                      4, 4, 30000, STRESS_TRY);
+    check_stress_buffered(pipe_new_sharded(sizeof(uint64_t), 4, 64),
+                          8, 2, 30000, STRESS_BLOCKING, 16, 0);
+}
+
+// Consumers pop the fullest shard, so a busy shard keeps up with quiet ones.
+// Here, four producers push at very different rates, and one consumer pops a
+// batch per tick, more than they push between them. Every shard's backlog has
+// to stay small. Sweeping the shards round-robin instead gives the busy shard
+// only a quarter of the pops, and its backlog grows without bound.
+DEF_TEST(sharded_balance)
+{
+    enum { SHARDS = 4, BATCH = 32, TICKS = 10000, MAX_BACKLOG = 4 * BATCH };
+
+    static const size_t rate[SHARDS] = { 24, 4, 1, 1 };
+
+    size_t left[SHARDS] = { 0 }, pushed[SHARDS] = { 0 }, worst = 0;
+    pipe_producer_t* prods[SHARDS];
+
+    pipe_t* p = pipe_new_sharded(sizeof(uint64_t), SHARDS, 0);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+
+    for(size_t i = 0; i < SHARDS; ++i)
+        prods[i] = pipe_producer_new(p);
+
+    pipe_free(p);
+
+    for(size_t tick = 0; tick < TICKS; ++tick)
+    {
+        for(size_t i = 0; i < SHARDS; ++i)
+            for(size_t j = 0; j < rate[i]; ++j)
+            {
+                uint64_t tag = TAG(i, pushed[i]++);
+                pipe_push(prods[i], &tag, 1);
+                left[i]++;
+            }
+
+        uint64_t batch[BATCH];
+        size_t   n = pipe_pop_eager(cons, batch, BATCH);
+
+        check(n > 0);
+
+        // A pop only ever takes from one shard.
+        size_t shard = TAG_PRODUCER(batch[0]);
+
+        for(size_t i = 0; i < n; ++i)
+            check(TAG_PRODUCER(batch[i]) == shard);
+
+        left[shard] -= n;
+
+        for(size_t i = 0; i < SHARDS; ++i)
+            worst = left[i] > worst ? left[i] : worst;
+    }
+
+    check(worst <= MAX_BACKLOG);
+
+    for(size_t i = 0; i < SHARDS; ++i)
+        pipe_producer_free(prods[i]);
+
+    pipe_consumer_free(cons);
+}
+
+void pipe_run_test_suite(void)
+{
+    RUN_TEST(pipe_fifo);
+    RUN_TEST(pipe_close);
+    RUN_TEST(pipe_blocking);
+    RUN_TEST(pipe_stress);
+
+    RUN_TEST(spsc_fifo);
+    RUN_TEST(spsc_close);
+    RUN_TEST(spsc_blocking);
+    RUN_TEST(spsc_stress);
+
+    RUN_TEST(mpmc_fifo);
+    RUN_TEST(mpmc_close);
+    RUN_TEST(mpmc_blocking);
+    RUN_TEST(mpmc_stress);
+
+    RUN_TEST(pipe_reserve);
+    RUN_TEST(spsc_reserve);
+    RUN_TEST(pipe_reserve_records);
+    RUN_TEST(spsc_reserve_records);
+
+    RUN_TEST(pipe_peek);
+    RUN_TEST(spsc_peek);
+
+    RUN_TEST(mirrored_fifo);
+    RUN_TEST(mirrored_close);
+    RUN_TEST(mirrored_blocking);
+    RUN_TEST(mirrored_reserve);
+    RUN_TEST(mirrored_peek);
+    RUN_TEST(mirrored_spans);
+    RUN_TEST(mirrored_stress);
+
+    RUN_TEST(pipe_try);
+    RUN_TEST(spsc_try);
+    RUN_TEST(mpmc_try);
+    RUN_TEST(mirrored_try);
+    RUN_TEST(try_stress);
+
+    RUN_TEST(pipe_timed);
+    RUN_TEST(spsc_timed);
+    RUN_TEST(mpmc_timed);
+    RUN_TEST(mirrored_timed);
+    RUN_TEST(timed_stress);
+
+    RUN_TEST(pipe_wait_strategies);
+    RUN_TEST(spsc_wait_strategies);
+    RUN_TEST(mpmc_wait_strategies);
+
+    RUN_TEST(segmented_fifo);
+    RUN_TEST(segmented_close);
+    RUN_TEST(segmented_blocking);
+    RUN_TEST(segmented_try);
+    RUN_TEST(segmented_timed);
+    RUN_TEST(segmented_stress);
+    RUN_TEST(segmented_grow);
+
+    RUN_TEST(capacity_policy);
+    RUN_TEST(allocator);
+    RUN_TEST(page_allocator);
+
+    RUN_TEST(static_fifo);
+    RUN_TEST(static_close);
+    RUN_TEST(static_blocking);
+    RUN_TEST(static_try);
+    RUN_TEST(static_timed);
+    RUN_TEST(static_reserve);
+    RUN_TEST(static_peek);
+    RUN_TEST(static_stress);
+    RUN_TEST(static_size);
+    RUN_TEST(static_mlock);
+
+    RUN_TEST(pipe_buffered_producer);
+    RUN_TEST(mpmc_buffered_producer);
+    RUN_TEST(segmented_buffered_producer);
+    RUN_TEST(buffered_producer_stress);
+
+    RUN_TEST(pipe_buffered_consumer);
+    RUN_TEST(spsc_buffered_consumer);
+    RUN_TEST(mpmc_buffered_consumer);
+    RUN_TEST(segmented_buffered_consumer);
+    RUN_TEST(buffered_consumer_stress);
+
+    RUN_TEST(records);
+    RUN_TEST(records_limit);
+    RUN_TEST(records_stress);
+
+    RUN_TEST(pool);
+    RUN_TEST(pool_stress);
+
+    RUN_TEST(broadcast_fifo);
+    RUN_TEST(broadcast_close);
+    RUN_TEST(broadcast_blocking);
+    RUN_TEST(broadcast_try);
+    RUN_TEST(broadcast_timed);
+    RUN_TEST(broadcast_fanout);
+    RUN_TEST(broadcast_drop);
+    RUN_TEST(broadcast_stress);
+
+    RUN_TEST(priority_fifo);
+    RUN_TEST(priority_close);
+    RUN_TEST(priority_blocking);
+    RUN_TEST(priority_try);
+    RUN_TEST(priority_timed);
+    RUN_TEST(priority_order);
+    RUN_TEST(priority_quota);
+    RUN_TEST(priority_limit);
+    RUN_TEST(priority_contended);
+    RUN_TEST(priority_stress);
+
+    RUN_TEST(select);
+    RUN_TEST(select_large);
+    RUN_TEST(select_buffered);
+    RUN_TEST(select_stress);
+
+    RUN_TEST(fds);
+    RUN_TEST(broadcast_fds);
+
+    RUN_TEST(sharded_fifo);
+    RUN_TEST(sharded_close);
+    RUN_TEST(sharded_blocking);
+    RUN_TEST(sharded_try);
+    RUN_TEST(sharded_timed);
+    RUN_TEST(sharded_stress);
+    RUN_TEST(sharded_balance);
+    RUN_TEST(sharded_contended);
+}
+
+#ifdef PIPE_SUITE_MAIN
+
+// pipe_util.c isn't part of the pipe itself, so it's only tested when the suite
+// is built on its own, where the Makefile links it in.
+#include "pipe_util.h"
+
+#define WORKERS 4
+
+// What a processor has seen, from every thread running it.
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_t       threads[WORKERS];
+    size_t          nthreads,
+                    biggest_slice,
+                    finished;
+    unsigned        slow_ms;    // How long each element takes.
+} proc_log_t;
+
+// Passes elements straight through, taking `slow_ms' over each one.
+static void log_proc(const void* elems, size_t count,
+                     pipe_producer_t* out, void* aux)
+{
+    proc_log_t* log = aux;
+
+    pthread_mutex_lock(&log->lock);
+
+    if(elems == NULL)
+        log->finished++;
+    else
+    {
+        size_t i = 0;
+
+        while(i < log->nthreads && !pthread_equal(log->threads[i], pthread_self()))
+            ++i;
+
+        if(i == log->nthreads && i < WORKERS)
+            log->threads[log->nthreads++] = pthread_self();
+
+        if(count > log->biggest_slice)
+            log->biggest_slice = count;
+    }
+
+    pthread_mutex_unlock(&log->lock);
+
+    if(elems == NULL)
+        return;
+
+    for(size_t i = 0; i < count && log->slow_ms; ++i)
+        sleep_ms(log->slow_ms);
+
+    pipe_push(out, elems, count);
+}
+
+typedef pipeline_t (*parallel_ctor_t)(size_t, size_t, pipe_processor_t, void*,
+                                      size_t);
+
+// Every element comes out exactly once, and every worker gets its last call.
+static void check_parallel(parallel_ctor_t ctor, proc_log_t* log)
+{
+    enum { N = 20000 };
+
+    static bool seen[N];
+    uint64_t elems[N];
+
+    pthread_mutex_init(&log->lock, NULL);
+
+    for(size_t i = 0; i < N; ++i)
+    {
+        elems[i] = i;
+        seen[i]  = false;
+    }
+
+    pipeline_t pl = ctor(WORKERS, sizeof(uint64_t), log_proc, log,
+                         sizeof(uint64_t));
+
+    pipe_push(pl.in, elems, N);
+    pipe_producer_free(pl.in);
+
+    uint64_t out[64];
+    size_t   n, total = 0;
+
+    while((n = pipe_pop_eager(pl.out, out, 64)))
+        for(size_t i = 0; i < n; ++i, ++total)
+        {
+            check(out[i] < N && !seen[out[i]]);
+            seen[out[i]] = true;
+        }
+
+    check(total == N);
+
+    pipe_consumer_free(pl.out);
+
+    // The output pipe's producers are freed after the last calls.
+    check(log->finished == WORKERS);
+    pthread_mutex_destroy(&log->lock);
+}
+
+DEF_TEST(parallel)
+{
+    proc_log_t log = { .slow_ms = 0 };
+    check_parallel(pipe_parallel, &log);
+}
+
+// Workers hand proc slices of their batches, not one element at a time.
+DEF_TEST(parallel_stealing)
+{
+    proc_log_t log = { .slow_ms = 0 };
+    check_parallel(pipe_parallel_stealing, &log);
+
+    check(log.biggest_slice > 1);
+}
+
+// One push lands in the pipe all at once, so whichever worker wakes up first
+// pulls in the whole lot. The others are idle, with nothing queued anywhere
+// when they started waiting, and still have to come and steal. The input stays
+// open until everything is out, so closing it can't be what wakes them.
+DEF_TEST(parallel_steal_idle)
+{
+    enum { N = 64 };
+
+    proc_log_t log = { .slow_ms = 2 };
+    pthread_mutex_init(&log.lock, NULL);
+
+    pipeline_t pl = pipe_parallel_stealing(WORKERS, sizeof(uint64_t),
+                                           log_proc, &log, sizeof(uint64_t));
+
+    // Give the workers time to go idle first.
+    sleep_ms(20);
+
+    uint64_t elems[N], out[N];
+
+    for(size_t i = 0; i < N; ++i)
+        elems[i] = i;
+
+    pipe_push(pl.in, elems, N);
+
+    check(pipe_pop(pl.out, out, N) == N);
+
+    pipe_producer_free(pl.in);
+    check(pipe_pop(pl.out, out, 1) == 0);
+
+    pipe_consumer_free(pl.out);
+
+    check(log.nthreads > 1);
+    check(log.finished == WORKERS);
+
+    pthread_mutex_destroy(&log.lock);
+}
+
+// Counted by pipe.c, when it's built along with the standalone suite.
+extern size_t pipe_suite_wake_calls,
+              pipe_suite_wakes;
+
+static void reset_wakes(void)
+{
+    pipe_suite_wake_calls = 0;
+    pipe_suite_wakes      = 0;
+}
+
+#define WAITERS 4
+
+// Pushing and popping with nobody waiting doesn't wake anybody. With WAITERS
+// threads waiting, a push or pop of fewer elements than that only wakes as
+// many as it has to.
+static void check_wakes(pipe_ctor_t ctor)
+{
+    int elems[64] = { 0 }, out[64];
+
+    pipe_t* p = ctor(sizeof(int), 32);
+    pipe_producer_t* prod = pipe_producer_new(p);
+    pipe_consumer_t* cons = pipe_consumer_new(p);
+    pipe_free(p);
+
+    reset_wakes();
+    pipe_push(prod, elems, 4);
+    check(pipe_pop(cons, out, 4) == 4);
+    check(pipe_suite_wake_calls == 0);
+
+    // Consumers waiting for elements.
+    pusher_popper_t pp[WAITERS];
+    pthread_t       t[WAITERS];
+
+    for(size_t i = 0; i < WAITERS; ++i)
+    {
+        pp[i] = (pusher_popper_t) { .cons = cons, .elems = out + i, .count = 1 };
+        t[i]  = spawn(pop_in_thread, &pp[i]);
+    }
+
+    sleep_ms(50);
+
+    reset_wakes();
+    pipe_push(prod, elems, 1);
+    check(pipe_suite_wake_calls == 1 && pipe_suite_wakes == 1);
+
+    pipe_push(prod, elems, 2);
+    check(pipe_suite_wakes <= 3);
+
+    pipe_push(prod, elems, 1);
+
+    for(size_t i = 0; i < WAITERS; ++i)
+    {
+        join(t[i]);
+        check(pp[i].result == 1);
+    }
+
+    // Producers waiting for room.
+    while(pipe_try_push(prod, elems, 1) == 1)
+        ;
+
+    for(size_t i = 0; i < WAITERS; ++i)
+    {
+        pp[i] = (pusher_popper_t) { .prod = prod, .elems = elems, .count = 1 };
+        t[i]  = spawn(push_in_thread, &pp[i]);
+    }
+
+    sleep_ms(50);
+
+    reset_wakes();
+    check(pipe_pop(cons, out, 1) == 1);
+    check(pipe_suite_wake_calls == 1 && pipe_suite_wakes == 1);
+
+    check(pipe_pop(cons, out, 2) == 2);
+    check(pipe_suite_wakes <= 3);
+
+    check(pipe_pop(cons, out, 1) == 1);
+
+    for(size_t i = 0; i < WAITERS; ++i)
+        join(t[i]);
+
+    pipe_producer_free(prod);
+    pipe_consumer_free(cons);
+}
+
+DEF_TEST(wakes)
+{
+    check_wakes(pipe_new);
+    check_wakes(pipe_new_mpmc);
+}
+
+int main(void)
+{
+    pipe_run_test_suite();
+
+    RUN_TEST(wakes);
+
+    RUN_TEST(parallel);
+    RUN_TEST(parallel_stealing);
+    RUN_TEST(parallel_steal_idle);
+
+    return 0;
+}
+#endif
+
+/* vim: set et ts=4 sw=4 softtabstop=4 textwidth=80: */
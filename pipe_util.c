@@ -25,7 +25,10 @@
 
 #include <assert.h>
 #include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdlib.h>
+#include <string.h>
 
 #ifdef _WIN32 // use the native win32 API on Windows
 
@@ -135,6 +138,372 @@ pipeline_t pipe_parallel(size_t           instances,
     return ret;
 }
 
+// Work stealing needs atomics.
+#ifdef __GNUC__
+#define HAVE_STEALING 1
+#else
+#define HAVE_STEALING 0
+#endif
+
+#if HAVE_STEALING
+
+#define load_relaxed(ptr)     __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define load_acquire(ptr)     __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define store_relaxed(ptr, v) __atomic_store_n((ptr), (v), __ATOMIC_RELAXED)
+#define fetch_add(ptr, v)     __atomic_fetch_add((ptr), (v), __ATOMIC_SEQ_CST)
+#define fetch_sub(ptr, v)     __atomic_fetch_sub((ptr), (v), __ATOMIC_SEQ_CST)
+#define fence(order)          __atomic_thread_fence(__ATOMIC_ ## order)
+
+#define compare_and_swap(ptr, expected, desired)                     \
+    __atomic_compare_exchange_n((ptr), (expected), (desired), false, \
+                                __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+// How many elements a worker pulls out of the input pipe at once, and so how
+// many its deque has to hold.
+#define STEAL_BATCH DEFAULT_BUFFER_SIZE
+
+// The most elements handed to proc at once. A worker works through its batch a
+// slice at a time, so that the rest of it can still be stolen.
+#define STEAL_SLICE 16
+
+// A Chase-Lev deque of elements. Its owner fills it at the bottom, only once
+// it's empty, so there's always room, and takes slices back off the bottom.
+// The other workers steal single elements off the top. Only top is ever
+// contended, so the two ends live on separate cache lines.
+typedef struct {
+    ptrdiff_t top;
+    char      pad[64 - sizeof(ptrdiff_t)];
+    ptrdiff_t bottom;
+    char*     elems;    // STEAL_BATCH slots, elem_size bytes each.
+} deque_t;
+
+typedef struct {
+    pipe_processor_t proc;
+    void*            aux;
+
+    size_t elem_size,
+           workers,
+           busy,        // How many workers have elements queued. Atomic.
+           running;     // How many workers haven't finished. Atomic.
+
+    // Idle workers wait on this alongside the input pipe, with pipe_select. A
+    // worker that fills its deque with more than it can get through in one
+    // slice pushes a byte in for each slice the others could help with.
+    pipe_producer_t* nudge;
+    pipe_consumer_t* nudged;
+
+    deque_t deques[];
+} steal_group_t;
+
+typedef struct {
+    steal_group_t*   group;
+    size_t           id;
+    pipe_consumer_t* in;
+    pipe_producer_t* out;
+} steal_data_t;
+
+static inline size_t slot_index(ptrdiff_t i)
+{
+    return (size_t)(i & (STEAL_BATCH - 1));
+}
+
+static inline char* slot(deque_t* d, size_t elem_size, ptrdiff_t i)
+{
+    return d->elems + slot_index(i) * elem_size;
+}
+
+static inline size_t min_size(size_t a, size_t b)
+{
+    return a < b ? a : b;
+}
+
+// Fills an empty deque with the `count' elements in `elems'. Only the owner
+// calls this.
+static void deque_fill(deque_t* d, size_t elem_size,
+                       const char* elems, size_t count)
+{
+    ptrdiff_t b = load_relaxed(&d->bottom);
+
+    assert(b == load_acquire(&d->top));
+    assert(count <= STEAL_BATCH);
+
+    size_t at_end = min_size(count, STEAL_BATCH - slot_index(b));
+
+    memcpy(slot(d, elem_size, b), elems, at_end * elem_size);
+    memcpy(d->elems, elems + at_end * elem_size, (count - at_end) * elem_size);
+
+    fence(RELEASE);
+    store_relaxed(&d->bottom, b + (ptrdiff_t)count);
+}
+
+// Takes the newest slice of the owner's own deque, and points `elems' at it.
+// Slices never wrap around the end of the deque, so it can be handed to proc
+// right where it is. Nobody else writes to the deque, and the owner won't until
+// it comes back for more. Returns how many elements the slice has, or 0 if the
+// deque is empty. Only the owner calls this.
+//
+// A thief can only ever be taking the element at top, so as long as that's not
+// in the slice, the slice is ours without a CAS. If it is, whatever is left is
+// raced for with a CAS on top, just like the last element in a classic
+// Chase-Lev deque.
+static size_t deque_take(deque_t* d, size_t elem_size, const char** elems)
+{
+    for(;;)
+    {
+        ptrdiff_t b = load_relaxed(&d->bottom),
+                  t = load_relaxed(&d->top);
+
+        if(t >= b)
+            return 0;
+
+        ptrdiff_t count = (ptrdiff_t)min_size(min_size((size_t)(b - t),
+                                                       STEAL_SLICE),
+                                              slot_index(b - 1) + 1),
+                  nb    = b - count;
+
+        store_relaxed(&d->bottom, nb);
+        fence(SEQ_CST);
+        t = load_relaxed(&d->top);
+
+        if(t < nb)
+        {
+            *elems = slot(d, elem_size, nb);
+            return (size_t)count;
+        }
+
+        // The thieves got to everything, or are racing us for the rest of it.
+        // If we win, the deque is empty. If we lose, there may be some left.
+        bool won = t < b && compare_and_swap(&d->top, &t, b);
+
+        store_relaxed(&d->bottom, b);
+
+        if(won)
+        {
+            *elems = slot(d, elem_size, t);
+            return (size_t)(b - t);
+        }
+    }
+}
+
+// Takes the oldest element. Returns false if there's nothing, or if another
+// thread got to it first.
+static bool deque_steal(deque_t* d, size_t elem_size, char* target)
+{
+    ptrdiff_t t = load_acquire(&d->top);
+    fence(SEQ_CST);
+    ptrdiff_t b = load_acquire(&d->bottom);
+
+    if(t >= b)
+        return false;
+
+    // The owner can't reuse this slot without top moving past it first, in
+    // which case the copy is thrown away.
+    memcpy(target, slot(d, elem_size, t), elem_size);
+
+    return compare_and_swap(&d->top, &t, t + 1);
+}
+
+// Steals up to a slice's worth of elements from the first worker that has
+// any, an element at a time, into `target'. Returns how many were stolen.
+static size_t steal_any(steal_group_t* g, size_t thief, char* target)
+{
+    size_t elem_size = g->elem_size;
+
+    for(size_t i = 1; i < g->workers; ++i)
+    {
+        deque_t* d      = &g->deques[(thief + i) % g->workers];
+        size_t   stolen = 0;
+
+        while(stolen < STEAL_SLICE
+           && deque_steal(d, elem_size, target + stolen * elem_size))
+            ++stolen;
+
+        if(stolen)
+            return stolen;
+    }
+
+    return 0;
+}
+
+// Sleeps until the input pipe can be popped, or another worker has more than
+// it can handle on its own.
+static void wait_for_work(steal_group_t* g, pipe_consumer_t* in)
+{
+    pipe_consumer_t* const waits[2] = { in, g->nudged };
+    int  ready[2];
+    char nudge;
+
+    // Somebody else may have taken the nudge already, which is fine. Either
+    // way, it's time to look for something to steal.
+    if(pipe_select(waits, 2, ready, NULL) != PIPE_WOULD_BLOCK && ready[1])
+    {
+        size_t taken = pipe_try_pop(g->nudged, &nudge, 1);
+        (void)taken;
+    }
+}
+
+static void* process_stealing(void* param)
+{
+    steal_data_t w = *(steal_data_t*)param;
+    free(param);
+
+    steal_group_t* g         = w.group;
+    deque_t*       own       = &g->deques[w.id];
+    size_t         elem_size = g->elem_size;
+
+    char* batch = malloc(STEAL_BATCH * elem_size);
+
+    bool queued     = false,
+         input_done = false;
+
+    for(;;)
+    {
+        const char* slice;
+        size_t      count = deque_take(own, elem_size, &slice);
+
+        if(count)
+        {
+            g->proc(slice, count, w.out, g->aux);
+            continue;
+        }
+
+        if(queued)
+        {
+            fetch_sub(&g->busy, 1);
+            queued = false;
+        }
+
+        // Nobody else touches `batch', so stolen elements can go there.
+        if(load_relaxed(&g->busy) > 0 && (count = steal_any(g, w.id, batch)))
+        {
+            g->proc(batch, count, w.out, g->aux);
+            continue;
+        }
+
+        // Whatever's still queued up elsewhere will be seen to by its owner.
+        if(input_done)
+            break;
+
+        size_t popped = pipe_try_pop(w.in, batch, STEAL_BATCH);
+
+        if(popped == 0)
+            input_done = true;
+        else if(popped == PIPE_WOULD_BLOCK)
+            wait_for_work(g, w.in);
+        else
+        {
+            fetch_add(&g->busy, 1);
+            queued = true;
+
+            deque_fill(own, elem_size, batch, popped);
+
+            // Only what's past the first slice is any use to the others.
+            static const char nudges[STEAL_BATCH / STEAL_SLICE] = { 0 };
+
+            size_t slices = (popped + STEAL_SLICE - 1) / STEAL_SLICE;
+
+            // If there are plenty of nudges waiting already, that'll do.
+            if(slices > 1)
+            {
+                size_t pushed = pipe_try_push(g->nudge, nudges,
+                                        min_size(slices - 1, g->workers - 1));
+                (void)pushed;
+            }
+        }
+    }
+
+    g->proc(NULL, 0, NULL, g->aux);
+
+    free(batch);
+
+    pipe_consumer_free(w.in);
+    pipe_producer_free(w.out);
+
+    // The last one out cleans up after everybody.
+    if(fetch_sub(&g->running, 1) == 1)
+    {
+        for(size_t i = 0; i < g->workers; ++i)
+            free(g->deques[i].elems);
+
+        pipe_producer_free(g->nudge);
+        pipe_consumer_free(g->nudged);
+
+        free(g);
+    }
+
+    return NULL;
+}
+
+#endif /* HAVE_STEALING */
+
+// The input pipe's lock is only taken once per batch, and proc gets a slice of
+// it at a time, straight out of the worker's deque. Idle workers sleep until
+// there's input, or until a worker that pulled in a batch nudges them to come
+// and steal. Falls back on pipe_parallel where there are no atomics to steal
+// with.
+pipeline_t pipe_parallel_stealing(size_t           instances,
+                                  size_t           in_size,
+                                  pipe_processor_t proc,
+                                  void*            aux,
+                                  size_t           out_size)
+{
+#if HAVE_STEALING
+    assert(instances);
+    assert(proc);
+
+    steal_group_t* g = malloc(sizeof *g + instances * sizeof *g->deques);
+
+    // The limit keeps nudges from piling up while nobody is idle to take them.
+    pipe_t* nudges = pipe_new(1, instances);
+
+    *g = (steal_group_t) {
+        .proc      = proc,
+        .aux       = aux,
+        .elem_size = in_size,
+        .workers   = instances,
+        .running   = instances,
+        .nudge     = pipe_producer_new(nudges),
+        .nudged    = pipe_consumer_new(nudges),
+    };
+
+    pipe_free(nudges);
+
+    for(size_t i = 0; i < instances; ++i)
+        g->deques[i] = (deque_t) {
+            .elems = malloc(STEAL_BATCH * in_size),
+        };
+
+    pipe_t* in  = pipe_new(in_size,  0),
+          * out = pipe_new(out_size, 0);
+
+    for(size_t i = 0; i < instances; ++i)
+    {
+        steal_data_t* d = malloc(sizeof *d);
+
+        *d = (steal_data_t) {
+            .group = g,
+            .id    = i,
+            .in    = pipe_consumer_new(in),
+            .out   = pipe_producer_new(out),
+        };
+
+        thread_create(&process_stealing, d);
+    }
+
+    pipeline_t ret = {
+        .in  = pipe_producer_new(in),
+        .out = pipe_consumer_new(out)
+    };
+
+    pipe_free(in);
+    pipe_free(out);
+
+    return ret;
+#else
+    return pipe_parallel(instances, in_size, proc, aux, out_size);
+#endif
+}
+
 static pipeline_t va_pipe_pipeline(pipeline_t result_so_far,
                                    va_list args)
 {
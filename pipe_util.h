@@ -0,0 +1,105 @@
+/* pipe_util.h - The public interface to the experimental pipe extensions:
+ *               pipelines of threads connected by pipes.
+ *
+ * The MIT License
+ * Copyright (c) 2011 Clark Gaebel <cg.wowus.cg@gmail.com>
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+#pragma once
+
+#include "pipe.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * A function that processes `count' elements from `elem_in', pushing whatever
+ * it makes of them into `elem_out'. It is passed the same `aux' every time.
+ *
+ * Once the input runs dry for good, it is called one last time with `elem_in'
+ * and `elem_out' NULL and `count' 0, so it can clean up. Every thread running
+ * it gets such a call of its own.
+ */
+typedef void (*pipe_processor_t)(const void*      elem_in,
+                                 size_t           count,
+                                 pipe_producer_t* elem_out,
+                                 void*            aux);
+
+/*
+ * The two ends of a pipeline. Push into `in', and pop the results out of `out'.
+ * Both handles are yours to free.
+ */
+typedef struct {
+    pipe_producer_t* in;
+    pipe_consumer_t* out;
+} pipeline_t;
+
+/*
+ * A pipeline that does nothing at all. Whatever goes in `p' comes right out.
+ */
+pipeline_t pipe_trivial_pipeline(pipe_t* p);
+
+/*
+ * Starts a thread that pops elements out of `in' and runs `proc' on them,
+ * passing `aux' along, with `out' to push the results into. The thread takes
+ * ownership of both handles, and frees them once `in' runs dry.
+ */
+void pipe_connect(pipe_consumer_t* in,
+                  pipe_processor_t proc, void* aux,
+                  pipe_producer_t* out);
+
+/*
+ * Builds a chain of threads connected by pipes. Elements of `first_size' bytes
+ * go in, and the arguments that follow are triples of the processor for the
+ * next stage, its `aux', and the size of the elements it pushes out. The list
+ * ends with a NULL processor.
+ */
+pipeline_t pipe_pipeline(size_t first_size, ...);
+
+/*
+ * Runs `instances' threads of `proc' side by side, all popping from the same
+ * input pipe of `in_size'-byte elements, and pushing into the same output pipe
+ * of `out_size'-byte ones. Results come out in no particular order.
+ */
+pipeline_t pipe_parallel(size_t           instances,
+                         size_t           in_size,
+                         pipe_processor_t proc,
+                         void*            aux,
+                         size_t           out_size);
+
+/*
+ * Like pipe_parallel, except each thread pulls a batch at a time out of the
+ * input pipe into a deque of its own, and hands `proc' slices of that. A
+ * thread that runs dry steals from the others before it waits on the input
+ * again, so one stuck on a slow element can't hold up the rest of its batch.
+ * Use this when elements take uneven amounts of time to process.
+ */
+pipeline_t pipe_parallel_stealing(size_t           instances,
+                                  size_t           in_size,
+                                  pipe_processor_t proc,
+                                  void*            aux,
+                                  size_t           out_size);
+
+#ifdef __cplusplus
+}
+#endif
+
+/* vim: set et ts=4 sw=4 softtabstop=4 textwidth=80: */